@@ -0,0 +1,682 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dirent.h>
+#include <link.h>
+
+#include <cerrno>
+#include <cstring>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <ctime>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "auroraemu.hpp"
+#include "auroraemu_affinity.hpp"
+#include "hlslib/xilinx/Stream.h"
+
+// depth of the user streams of the cores
+const size_t BENCH_STREAM_DEPTH = 1024;
+
+#ifdef BENCH_SPSC_STREAMS
+// lock-free user streams, built as auroraemu_bench_spsc
+typedef AuroraEmuStream<data_stream_t> bench_stream_t;
+typedef AuroraEmuStream<data_stream_t> core_stream_t;
+const std::string BENCH_STREAMS = "spsc";
+
+bench_stream_t *new_stream(const char *name, int numa_node) {
+    return new bench_stream_t(name, BENCH_STREAM_DEPTH, numa_node);
+}
+#else
+typedef hlslib::Stream<data_stream_t, BENCH_STREAM_DEPTH> bench_stream_t;
+typedef hlslib::Stream<data_stream_t> core_stream_t;
+const std::string BENCH_STREAMS = "hlslib";
+
+// the queue of hlslib streams is allocated by the OS
+bench_stream_t *new_stream(const char *name, int) {
+    return new bench_stream_t(name);
+}
+#endif
+
+typedef BasicAuroraEmu<data_stream_t, core_stream_t> bench_emu_t;
+typedef BasicAuroraEmuCore<data_stream_t, core_stream_t> bench_core_t;
+
+// number of heap allocations of the whole process and the part of them made
+// by libzmq itself. Counted by wrapping the allocator of glibc, so the
+// counters stay zero on other platforms
+std::atomic<uint64_t> allocations(0);
+std::atomic<uint64_t> zmq_allocations(0);
+
+#ifdef __GLIBC__
+// code of libzmq, set by find_libzmq() before the measurements
+uintptr_t libzmq_begin = 0;
+uintptr_t libzmq_end = 0;
+
+int find_libzmq_segment(struct dl_phdr_info *info, size_t, void *) {
+    if (info->dlpi_name == nullptr ||
+        std::strstr(info->dlpi_name, "libzmq") == nullptr) {
+        return 0;
+    }
+    for (int i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) &segment = info->dlpi_phdr[i];
+        if (segment.p_type == PT_LOAD && (segment.p_flags & PF_X)) {
+            libzmq_begin = info->dlpi_addr + segment.p_vaddr;
+            libzmq_end = libzmq_begin + segment.p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void find_libzmq() { dl_iterate_phdr(find_libzmq_segment, nullptr); }
+
+// attribute the allocation to libzmq if it was called from there
+inline void count_allocation(void *caller) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    uintptr_t address = reinterpret_cast<uintptr_t>(caller);
+    if (address >= libzmq_begin && address < libzmq_end) {
+        zmq_allocations.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+
+void *malloc(size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_realloc(ptr, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    count_allocation(__builtin_return_address(0));
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+}
+#else
+void find_libzmq() {}
+#endif
+
+// first port used by the switch and the TCP cores
+const int BENCH_SWITCH_PORT = 20000;
+const int BENCH_TCP_PORT = 21000;
+
+struct BenchOptions {
+    std::vector<std::string> transports = {"ipc",    "tcp",    "shm",
+                                           "switch", "direct", "reactor"};
+    std::vector<std::string> topologies = {"loopback", "pair", "ring"};
+    std::vector<int> cores = {1, 2, 8, 32, 128};
+    // flits per flow for the throughput measurement
+    int flits = 10000;
+    // latency samples per flow
+    int samples = 1000;
+    int switch_workers = 1;
+    int reactor_threads = REACTOR_THREADS;
+    // placement of the cores and their user kernels: none, node or cpu
+    std::string placement = "none";
+    // throughput measurements per run, to see their variance
+    int repetitions = 1;
+    std::string json_file = "auroraemu_bench.json";
+};
+
+struct Percentiles {
+    double p50 = 0;
+    double p99 = 0;
+    double p999 = 0;
+    size_t count = 0;
+};
+
+struct BenchResult {
+    std::string transport;
+    std::string topology;
+    int cores;
+    double startup_ms;
+    // threads of the process while the cores are running
+    int threads;
+    // mean and relative standard deviation of the repetitions
+    double flits_per_second;
+    double throughput_cv;
+    // heap allocations while measuring the throughput and the one-way
+    // latency, where every message carries a single flit
+    double allocations_per_flit;
+    double allocations_per_message;
+    double zmq_allocations_per_message;
+    Percentiles one_way_ns;
+    Percentiles rtt_ns;
+};
+
+/**
+ * Sending and receiving core of a flow of flits
+ */
+struct Flow {
+    int source;
+    int destination;
+};
+
+/**
+ * Emulated cores of one benchmark run. Every core receives from exactly one
+ * flow of the topology.
+ */
+struct BenchNetwork {
+    std::vector<std::unique_ptr<bench_stream_t>> in;
+    std::vector<std::unique_ptr<bench_stream_t>> out;
+    std::unique_ptr<AuroraEmuSwitch> aurora_switch;
+    // has to outlive the cores
+    std::unique_ptr<AuroraEmuReactor> reactor;
+    std::vector<std::unique_ptr<bench_core_t>> switch_cores;
+    std::vector<std::unique_ptr<bench_emu_t>> cores;
+    std::vector<Flow> flows;
+    // placement of every core, shared with the user kernel threads that
+    // write and read its streams
+    std::vector<AuroraEmuPlacement> placement;
+};
+
+std::vector<Flow> make_flows(const std::string &topology, int num_cores) {
+    std::vector<Flow> flows;
+    for (int i = 0; i < num_cores; i++) {
+        if (topology == "loopback") {
+            flows.push_back({i, i});
+        } else if (topology == "pair") {
+            flows.push_back({i ^ 1, i});
+        } else {
+            flows.push_back({(i + num_cores - 1) % num_cores, i});
+        }
+    }
+    return flows;
+}
+
+/**
+ * Placement of the cores. node distributes blocks of neighbouring cores
+ * over the NUMA nodes, so pairs and most ring neighbours share a node. cpu
+ * pins every core to its own CPU, as long as there are enough.
+ */
+std::vector<AuroraEmuPlacement> make_placement(const std::string &policy,
+                                               int num_cores) {
+    std::vector<AuroraEmuPlacement> placement(num_cores);
+    if (policy == "node") {
+        int nodes = numa_node_count();
+        for (int i = 0; i < num_cores; i++) {
+            placement[i] = AuroraEmuPlacement::node(i * nodes / num_cores);
+        }
+    } else if (policy == "cpu") {
+        std::vector<int> cpus = online_cpus();
+        for (int i = 0; i < num_cores; i++) {
+            placement[i] = AuroraEmuPlacement::cpu(cpus[i % cpus.size()]);
+        }
+    }
+    return placement;
+}
+
+void build_network(BenchNetwork &net, const std::string &transport,
+                   const BenchOptions &options) {
+    int num_cores = net.flows.size();
+    net.placement = make_placement(options.placement, num_cores);
+    for (int i = 0; i < num_cores; i++) {
+        int node = net.placement[i].memory_node();
+        net.in.emplace_back(new_stream("in", node));
+        net.out.emplace_back(new_stream("out", node));
+    }
+    AuroraEmuConfig config;
+    // measure the transport, not the shortcut for cores of one process
+    config.local_links = false;
+    config.shm_ring_slots = 1024;
+    config.switch_workers = options.switch_workers;
+    if (transport == "switch" || transport == "direct" ||
+        transport == "reactor") {
+        config.direct_links = (transport == "direct");
+        config.direct_address = "127.0.0.1";
+        if (transport == "reactor") {
+            net.reactor.reset(new AuroraEmuReactor(options.reactor_threads));
+            config.reactor = net.reactor.get();
+        }
+        net.aurora_switch.reset(new AuroraEmuSwitch(
+            "127.0.0.1", BENCH_SWITCH_PORT, options.switch_workers,
+            options.placement == "node" ? AuroraEmuPlacement::node(0)
+                                        : AuroraEmuPlacement(),
+            config.direct_links));
+        // flows are indexed by their destination
+        std::vector<int> destination(num_cores);
+        for (const Flow &f : net.flows) {
+            destination[f.source] = f.destination;
+        }
+        for (int i = 0; i < num_cores; i++) {
+            config.placement = net.placement[i];
+            net.switch_cores.emplace_back(new bench_core_t(
+                "127.0.0.1", BENCH_SWITCH_PORT, "bench" + std::to_string(i),
+                "bench" + std::to_string(destination[i]), *net.in[i],
+                *net.out[i], config));
+        }
+        return;
+    }
+    for (int i = 0; i < num_cores; i++) {
+        config.placement = net.placement[i];
+        if (transport == "tcp") {
+            net.cores.emplace_back(new bench_emu_t(
+                "127.0.0.1", BENCH_TCP_PORT + i, *net.in[i], *net.out[i],
+                config));
+        } else {
+            net.cores.emplace_back(new bench_emu_t(
+                transport + ":///tmp/auroraemu_bench_" + std::to_string(i),
+                *net.in[i], *net.out[i], config));
+        }
+    }
+    for (const Flow &f : net.flows) {
+        net.cores[f.destination]->connect(
+            net.cores[f.source]->get_address());
+    }
+}
+
+int count_threads() {
+    int count = 0;
+    DIR *dir = opendir("/proc/self/task");
+    if (dir == nullptr) {
+        return 0;
+    }
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+Percentiles percentiles(std::vector<int64_t> &samples) {
+    Percentiles p;
+    p.count = samples.size();
+    if (samples.empty()) {
+        return p;
+    }
+    std::sort(samples.begin(), samples.end());
+    auto at = [&samples](double q) {
+        size_t i = std::min(samples.size() - 1,
+                            static_cast<size_t>(q * samples.size()));
+        return static_cast<double>(samples[i]);
+    };
+    p.p50 = at(0.5);
+    p.p99 = at(0.99);
+    p.p999 = at(0.999);
+    return p;
+}
+
+/**
+ * All flows send flits_per_flow flits at the same time. Returns the
+ * aggregate number of flits per second.
+ */
+double measure_throughput(BenchNetwork &net, int flits_per_flow) {
+    std::vector<std::thread> threads;
+    auto start = std::chrono::steady_clock::now();
+    for (const Flow &f : net.flows) {
+        bench_stream_t &in = *net.in[f.source];
+        bench_stream_t &out = *net.out[f.destination];
+        const AuroraEmuPlacement &writer = net.placement[f.source];
+        const AuroraEmuPlacement &reader = net.placement[f.destination];
+        threads.emplace_back([&in, &writer, flits_per_flow]() {
+            writer.apply();
+            data_stream_t data;
+            for (int i = 0; i < flits_per_flow; i++) {
+                data.data = ap_uint<512>(i);
+                in.write(data);
+            }
+        });
+        threads.emplace_back([&out, &reader, flits_per_flow]() {
+            reader.apply();
+            for (int i = 0; i < flits_per_flow; i++) {
+                out.read();
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    auto end = std::chrono::steady_clock::now();
+    return net.flows.size() * static_cast<double>(flits_per_flow) /
+           std::chrono::duration<double>(end - start).count();
+}
+
+/**
+ * One-way latency of single flits. Every flow only sends the next flit
+ * after the previous one arrived, so the links are not loaded. The send
+ * time is carried in the flit.
+ */
+std::vector<int64_t> measure_one_way(BenchNetwork &net, int samples) {
+    std::vector<std::vector<int64_t>> latencies(net.flows.size());
+    std::vector<std::thread> threads;
+    for (size_t f = 0; f < net.flows.size(); f++) {
+        bench_stream_t &in = *net.in[net.flows[f].source];
+        bench_stream_t &out = *net.out[net.flows[f].destination];
+        const AuroraEmuPlacement &writer = net.placement[net.flows[f].source];
+        const AuroraEmuPlacement &reader =
+            net.placement[net.flows[f].destination];
+        std::vector<int64_t> &l = latencies[f];
+        l.reserve(samples);
+        threads.emplace_back([&in, &out, &l, &writer, &reader, samples]() {
+            writer.apply();
+            std::atomic<int> received(0);
+            std::thread receiver([&out, &l, &received, &reader, samples]() {
+                reader.apply();
+                for (int i = 0; i < samples; i++) {
+                    data_stream_t data = out.read();
+                    l.push_back(now_ns() -
+                                static_cast<int64_t>(data.data.to_uint64()));
+                    received = i + 1;
+                }
+            });
+            for (int i = 0; i < samples; i++) {
+                data_stream_t data;
+                data.data = ap_uint<512>(now_ns());
+                in.write(data);
+                while (received <= i) {
+                    std::this_thread::yield();
+                }
+            }
+            receiver.join();
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::vector<int64_t> all;
+    for (auto &l : latencies) {
+        all.insert(all.end(), l.begin(), l.end());
+    }
+    return all;
+}
+
+/**
+ * Round trip time of single flits that the receiving core sends back
+ * immediately. Only used for pairs, the first core of every pair starts
+ * the round trips.
+ */
+std::vector<int64_t> measure_rtt(BenchNetwork &net, int samples) {
+    std::vector<std::vector<int64_t>> rtts(net.flows.size() / 2);
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p < rtts.size(); p++) {
+        bench_stream_t &in1 = *net.in[2 * p];
+        bench_stream_t &out1 = *net.out[2 * p];
+        bench_stream_t &in2 = *net.in[2 * p + 1];
+        bench_stream_t &out2 = *net.out[2 * p + 1];
+        const AuroraEmuPlacement &first = net.placement[2 * p];
+        const AuroraEmuPlacement &second = net.placement[2 * p + 1];
+        std::vector<int64_t> &r = rtts[p];
+        threads.emplace_back([&in2, &out2, &second, samples]() {
+            second.apply();
+            for (int i = 0; i < samples; i++) {
+                in2.write(out2.read());
+            }
+        });
+        threads.emplace_back([&in1, &out1, &r, &first, samples]() {
+            first.apply();
+            for (int i = 0; i < samples; i++) {
+                data_stream_t data;
+                int64_t start = now_ns();
+                data.data = ap_uint<512>(i);
+                in1.write(data);
+                out1.read();
+                r.push_back(now_ns() - start);
+            }
+        });
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    std::vector<int64_t> all;
+    for (auto &r : rtts) {
+        all.insert(all.end(), r.begin(), r.end());
+    }
+    return all;
+}
+
+BenchResult run(const std::string &transport, const std::string &topology,
+                int num_cores, const BenchOptions &options) {
+    BenchResult result;
+    result.transport = transport;
+    result.topology = topology;
+    result.cores = num_cores;
+    BenchNetwork net;
+    net.flows = make_flows(topology, num_cores);
+    auto start = std::chrono::steady_clock::now();
+    build_network(net, transport, options);
+    auto end = std::chrono::steady_clock::now();
+    result.startup_ms =
+        std::chrono::duration<double, std::milli>(end - start).count();
+    result.threads = count_threads();
+    uint64_t before = allocations;
+    std::vector<double> throughput;
+    for (int i = 0; i < options.repetitions; i++) {
+        throughput.push_back(measure_throughput(net, options.flits));
+    }
+    double sum = 0;
+    for (double t : throughput) {
+        sum += t;
+    }
+    result.flits_per_second = sum / throughput.size();
+    double variance = 0;
+    for (double t : throughput) {
+        variance += (t - result.flits_per_second) *
+                    (t - result.flits_per_second) / throughput.size();
+    }
+    result.throughput_cv = std::sqrt(variance) / result.flits_per_second;
+    result.allocations_per_flit = static_cast<double>(allocations - before) /
+                                  num_cores / options.flits /
+                                  options.repetitions;
+    before = allocations;
+    uint64_t zmq_before = zmq_allocations;
+    std::vector<int64_t> one_way = measure_one_way(net, options.samples);
+    result.allocations_per_message =
+        static_cast<double>(allocations - before) / num_cores /
+        options.samples;
+    result.zmq_allocations_per_message =
+        static_cast<double>(zmq_allocations - zmq_before) / num_cores /
+        options.samples;
+    result.one_way_ns = percentiles(one_way);
+    if (topology == "pair") {
+        std::vector<int64_t> rtt = measure_rtt(net, options.samples);
+        result.rtt_ns = percentiles(rtt);
+    }
+    return result;
+}
+
+std::string to_json(const Percentiles &p) {
+    std::ostringstream s;
+    s << "{\"p50\": " << p.p50 << ", \"p99\": " << p.p99
+      << ", \"p999\": " << p.p999 << ", \"samples\": " << p.count << "}";
+    return s.str();
+}
+
+void write_json(const std::string &file_name, const BenchOptions &options,
+                const std::vector<BenchResult> &results) {
+    std::ofstream f(file_name);
+    std::time_t now = std::time(nullptr);
+    char date[32];
+    std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ",
+                  std::gmtime(&now));
+    f << std::setprecision(10);
+    f << "{\n";
+    f << "  \"date\": \"" << date << "\",\n";
+    f << "  \"hardware_concurrency\": "
+      << std::thread::hardware_concurrency() << ",\n";
+    f << "  \"flits_per_flow\": " << options.flits << ",\n";
+    f << "  \"latency_samples_per_flow\": " << options.samples << ",\n";
+    f << "  \"switch_workers\": " << options.switch_workers << ",\n";
+    f << "  \"reactor_threads\": " << options.reactor_threads << ",\n";
+    f << "  \"streams\": \"" << BENCH_STREAMS << "\",\n";
+    f << "  \"placement\": \"" << options.placement << "\",\n";
+    f << "  \"numa_nodes\": " << numa_node_count() << ",\n";
+    f << "  \"repetitions\": " << options.repetitions << ",\n";
+    f << "  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult &r = results[i];
+        f << "    {\"transport\": \"" << r.transport << "\", \"topology\": \""
+          << r.topology << "\", \"cores\": " << r.cores
+          << ", \"startup_ms\": " << r.startup_ms
+          << ", \"threads\": " << r.threads
+          << ", \"flits_per_second\": " << r.flits_per_second
+          << ", \"throughput_cv\": " << r.throughput_cv
+          << ", \"allocations_per_flit\": " << r.allocations_per_flit
+          << ", \"allocations_per_message\": " << r.allocations_per_message
+          << ", \"zmq_allocations_per_message\": "
+          << r.zmq_allocations_per_message
+          << ", \"one_way_ns\": " << to_json(r.one_way_ns);
+        if (r.rtt_ns.count > 0) {
+            f << ", \"rtt_ns\": " << to_json(r.rtt_ns);
+        }
+        f << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    f << "  ]\n}\n";
+}
+
+std::vector<std::string> split(const std::string &list) {
+    std::vector<std::string> items;
+    std::istringstream s(list);
+    std::string item;
+    while (std::getline(s, item, ',')) {
+        items.push_back(item);
+    }
+    return items;
+}
+
+void print_usage() {
+    std::cout << "Usage: auroraemu_bench [options]\n"
+              << "  --transports LIST   ipc,tcp,shm,switch,direct,reactor\n"
+              << "  --topologies LIST   loopback,pair,ring\n"
+              << "  --cores LIST        number of cores, e.g. 1,2,8,32,128\n"
+              << "  --flits N           flits per flow for the throughput\n"
+              << "  --samples N         latency samples per flow\n"
+              << "  --switch-workers N  routing threads of the switch\n"
+              << "  --reactor-threads N threads of the reactor transport\n"
+              << "  --placement P       pin cores and kernels: none,node,cpu\n"
+              << "  --repetitions N     throughput measurements per run\n"
+              << "  --json FILE         output file of the results\n";
+}
+
+int main(int argc, char *argv[]) {
+    BenchOptions options;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--help" || i + 1 >= argc) {
+            print_usage();
+            return arg == "--help" ? 0 : 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--transports") {
+            options.transports = split(value);
+        } else if (arg == "--topologies") {
+            options.topologies = split(value);
+        } else if (arg == "--cores") {
+            options.cores.clear();
+            for (const std::string &c : split(value)) {
+                options.cores.push_back(std::stoi(c));
+            }
+        } else if (arg == "--flits") {
+            options.flits = std::stoi(value);
+        } else if (arg == "--samples") {
+            options.samples = std::stoi(value);
+        } else if (arg == "--switch-workers") {
+            options.switch_workers = std::stoi(value);
+        } else if (arg == "--reactor-threads") {
+            options.reactor_threads = std::stoi(value);
+        } else if (arg == "--placement") {
+            options.placement = value;
+        } else if (arg == "--repetitions") {
+            options.repetitions = std::max(1, std::stoi(value));
+        } else if (arg == "--json") {
+            options.json_file = value;
+        } else {
+            print_usage();
+            return 1;
+        }
+    }
+    find_libzmq();
+    std::vector<BenchResult> results;
+    std::cout << std::left << std::setw(10) << "transport" << std::setw(10)
+              << "topology" << std::setw(7) << "cores" << std::setw(14)
+              << "flits/s" << std::setw(9) << "cv [%]" << std::setw(12)
+              << "p50 [us]" << std::setw(12) << "p99 [us]" << std::setw(12)
+              << "p999 [us]" << std::setw(12) << "allocs/msg" << std::setw(12)
+              << "zmq allocs" << std::setw(12) << "rtt p50 [us]" << std::endl;
+    for (const std::string &transport : options.transports) {
+        for (const std::string &topology : options.topologies) {
+            for (int num_cores : options.cores) {
+                // pairs and rings need at least two cores
+                if ((topology == "pair" && num_cores % 2 != 0) ||
+                    (topology == "ring" && num_cores < 2)) {
+                    continue;
+                }
+                BenchResult r = run(transport, topology, num_cores, options);
+                results.push_back(r);
+                std::cout << std::setw(10) << r.transport << std::setw(10)
+                          << r.topology << std::setw(7) << r.cores
+                          << std::setw(14) << r.flits_per_second
+                          << std::setw(9) << 100 * r.throughput_cv
+                          << std::setw(12) << r.one_way_ns.p50 / 1000
+                          << std::setw(12) << r.one_way_ns.p99 / 1000
+                          << std::setw(12) << r.one_way_ns.p999 / 1000
+                          << std::setw(12) << r.allocations_per_message
+                          << std::setw(12) << r.zmq_allocations_per_message;
+                if (r.rtt_ns.count > 0) {
+                    std::cout << std::setw(12) << r.rtt_ns.p50 / 1000;
+                }
+                std::cout << std::endl;
+                write_json(options.json_file, options, results);
+            }
+        }
+    }
+    return 0;
+}
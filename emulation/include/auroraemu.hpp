@@ -13,26 +13,502 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#pragma once
+
+#include <unistd.h>
+
 #include <ap_axi_sdata.h>
 #include <ap_int.h>
 #include <hlslib/xilinx/Stream.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <thread>
+#include <vector>
 #include <zmq.hpp>
 
+#include "auroraemu_affinity.hpp"
+#include "auroraemu_latency.hpp"
+#include "auroraemu_nfc.hpp"
+#include "auroraemu_pacing.hpp"
+#include "auroraemu_pool.hpp"
+#include "auroraemu_reactor.hpp"
+#include "auroraemu_registers.hpp"
+#include "auroraemu_shm.hpp"
+#include "auroraemu_sim.hpp"
+#include "auroraemu_stream.hpp"
+#include "auroraemu_trace.hpp"
+
 typedef ap_axiu<512, 0, 0, 0> data_stream_t;
 
+/**
+ * Payload type and width of an AXI stream type like ap_axiu<256, 0, 0, 0>.
+ * Messages only carry as many bytes per flit as the payload type needs.
+ */
+template <typename T>
+struct AxiStreamTraits {
+    typedef decltype(T().data) data_t;
+    // width of the payload on the link in bytes
+    static size_t width_bytes() { return data_t::width / 8; }
+};
+
+// time in milliseconds between two attempts of a readiness handshake
+const int HANDSHAKE_INTERVAL = 1;
+// time in milliseconds a core waits for its switch or shared memory ring
+// before its constructor or connect() throws
+const int HANDSHAKE_TIMEOUT = 10000;
+// Deprecated, nothing waits for it anymore. Time in milliseconds the cores
+// used to sleep for their ZMQ subscriptions to complete and to poll the
+// user stream
 const int RECV_POLL_INTERVAL = 100;
+// time in milliseconds after which an idle recv thread checks whether its
+// core is destroyed, in case the kill signal was sent before it subscribed
+const int KILL_CHECK_INTERVAL = 100;
+
+// time in milliseconds a core waits for the reply of the switch directory
+const int DIRECTORY_TIMEOUT = 100;
+// time in milliseconds between lookups of a core that is not registered yet
+const int DIRECTORY_RETRY_INTERVAL = 1;
+// requests and replies of the switch directory
+const std::string DIRECTORY_REGISTER = "register";
+const std::string DIRECTORY_UNREGISTER = "unregister";
+const std::string DIRECTORY_LOOKUP = "lookup";
+const std::string DIRECTORY_SWITCHED = "switch";
+// third part of a lookup that peer directories answer from their own cores
+const std::string DIRECTORY_LOCAL = "local";
+// appended to the probe replies of a switch that serves direct links
+const std::string SWITCH_DIRECT_LINKS = "direct_links";
+
+// default number of flits that are packed into a single message
+const size_t MAX_BATCH_SIZE = 64;
+// default time in microseconds to wait for further flits before a
+// partially filled batch is sent
+const int BATCH_FLUSH_TIMEOUT = 0;
+// default maximum number of flits of an AXI frame sent in one message
+const size_t MAX_FRAME_SIZE = 4096;
+
+/**
+ * Options of the emulated Aurora cores that are not required to
+ * establish a connection
+ */
+struct AuroraEmuConfig {
+    // maximum number of flits sent in one message. A value of 1 sends
+    // every flit in its own message
+    size_t max_batch_size = MAX_BATCH_SIZE;
+    // time in microseconds to wait for more flits if the user stream runs
+    // empty before the batch is sent
+    int flush_timeout_us = BATCH_FLUSH_TIMEOUT;
+    // pass TLAST and TKEEP to the receiver like the USE_FRAMING build of the
+    // hardware. Instead of batches, every AXI frame is sent in one message,
+    // frames longer than max_frame_size flits are split
+    bool framing = false;
+    size_t max_frame_size = MAX_FRAME_SIZE;
+    // number of flits buffered by a shared memory link
+    uint32_t shm_ring_slots = SHM_RING_SLOTS;
+    // pass flits directly into the stream of the remote core if it lives in
+    // the same process instead of sending them over the transport. Either
+    // core can disable it, and cores with nfc always use the transport
+    bool local_links = true;
+    // model the RX FIFO of the Aurora core and pause the sender with native
+    // flow control. Only used for ZMQ links, local and shared memory links
+    // are bounded by their stream or ring
+    bool nfc = false;
+    uint32_t rx_fifo_depth = RX_FIFO_DEPTH;
+    uint32_t rx_fifo_prog_full = RX_FIFO_PROG_FULL;
+    uint32_t rx_fifo_prog_empty = RX_FIFO_PROG_EMPTY;
+    // time in microseconds the sender keeps sending after receiving XOFF
+    int nfc_latency_us = 0;
+    // limit the throughput of the link to the line rate in Gbit/s minus the
+    // encoding overhead. For ZMQ links, flits are additionally passed to the
+    // receiving user kernel link_latency_ns after they left the sender
+    bool pacing = false;
+    double line_rate_gbps = LINE_RATE_GBPS;
+    double encoding_efficiency = LINE_ENCODING_EFFICIENCY;
+    int link_latency_ns = 0;
+    // number of workers of the AuroraEmuSwitch the core is connected to
+    int switch_workers = 1;
+    // time in milliseconds to wait for the switch, or for the shared memory
+    // ring of the remote core in connect(), before throwing
+    int handshake_timeout_ms = HANDSHAKE_TIMEOUT;
+    // send the data of an AuroraEmuCore directly to the remote core after
+    // looking up its endpoint in the switch directory. Only multicast
+    // messages and flow control pass the switch
+    bool direct_links = false;
+    // host name or IP address other cores use for the direct link to this
+    // core. Empty uses the host name of the machine
+    std::string direct_address = "";
+    // run the send and receive paths of an AuroraEmuCore on the threads of
+    // a shared reactor instead of its own threads. The reactor has to
+    // outlive the core
+    AuroraEmuReactor *reactor = nullptr;
+    // record the flits received by the core with their arrival time and
+    // source in this file, see FlitTraceWriter. Empty disables recording
+    std::string trace_file = "";
+    // model an AuroraEmuCore in the virtual time of the simulation instead
+    // of sending its flits over ZMQ. Set for all cores if the library is
+    // built with AURORAEMU_SIMULATION
+    AuroraEmuSimulation *simulation = default_simulation();
+    // pin the forwarding threads of the core to these CPUs and allocate its
+    // message buffers on their NUMA node. Should be the placement of the
+    // user kernel that owns the streams of the core, see
+    // AuroraEmuPlacement::current(). Not used for cores on a reactor
+    AuroraEmuPlacement placement;
+    // one of this many data messages of a ZMQ link carries a latency sample
+    // of its first flit, if the library is built with
+    // AURORAEMU_LATENCY_TRACE. See SampledLatencyTrace
+    uint32_t latency_sample_interval = LATENCY_SAMPLE_INTERVAL;
+    // append the latency histograms of the core to this file when it is
+    // destroyed. Empty disables the report
+    std::string latency_report = "";
+};
+
+/**
+ * Receive the optional frames after the data of a message: the delivery
+ * time and the latency sample, which is copied to sample unless it is
+ * nullptr. Messages without delivery time can be delivered immediately.
+ */
+inline MessageDelivery receive_delivery(zmq::socket_t &socket,
+                                        const zmq::message_t &msg,
+                                        LatencySample *sample = nullptr) {
+    MessageDelivery delivery = {0};
+    bool more = msg.more();
+    while (more) {
+        zmq::message_t frame;
+        auto result = socket.recv(frame, zmq::recv_flags::none);
+        more = frame.more();
+        if (frame.size() == sizeof(MessageDelivery)) {
+            delivery = *static_cast<const MessageDelivery *>(frame.data());
+        } else if (sample != nullptr && LatencySample::is_sample(frame)) {
+            std::memcpy(sample, frame.data(), sizeof(LatencySample));
+        }
+    }
+    return delivery;
+}
+
+/**
+ * Receive the optional frames after the data of a message and wait
+ * until the flits may be passed to the user kernel
+ */
+inline void wait_for_delivery(zmq::socket_t &socket, const zmq::message_t &msg,
+                              LatencySample *sample = nullptr) {
+    receive_delivery(socket, msg, sample).wait();
+}
+
+/**
+ * Send a data message that left the link at departure, followed by its
+ * delivery time if the link is paced and the latency sample if it is not
+ * nullptr
+ */
+inline void send_delivered(zmq::socket_t &socket, zmq::message_t &msg,
+                           std::chrono::steady_clock::time_point departure,
+                           const AuroraEmuConfig &config,
+                           const LatencySample *sample = nullptr) {
+    if (!config.pacing && sample == nullptr) {
+        socket.send(msg, zmq::send_flags::none);
+        return;
+    }
+    socket.send(msg, zmq::send_flags::sndmore);
+    if (config.pacing) {
+        MessageDelivery delivery = MessageDelivery::after(
+            departure, std::chrono::nanoseconds(config.link_latency_ns));
+        zmq::message_t delivery_msg(static_cast<void *>(&delivery),
+                                    sizeof(delivery));
+        socket.send(delivery_msg, sample != nullptr ? zmq::send_flags::sndmore
+                                                    : zmq::send_flags::none);
+    }
+    if (sample != nullptr) {
+        zmq::message_t sample_msg(static_cast<const void *>(sample),
+                                  sizeof(LatencySample));
+        socket.send(sample_msg, zmq::send_flags::none);
+    }
+}
+
+/**
+ * Send a data message with the given number of payload bytes, followed by
+ * its delivery time if the link is paced and the latency sample if it is
+ * not nullptr
+ */
+inline void send_paced(zmq::socket_t &socket, zmq::message_t &msg,
+                       size_t bytes, LinkPacer &pacer,
+                       const AuroraEmuConfig &config,
+                       const LatencySample *sample = nullptr) {
+    send_delivered(socket, msg,
+                   config.pacing ? pacer.pace(bytes)
+                                 : std::chrono::steady_clock::now(),
+                   config, sample);
+}
+
+// batches of ZMQ links without framing only contain the data of the flits
+template <typename T>
+void append_flit(std::vector<typename AxiStreamTraits<T>::data_t> &flits,
+                 const T &flit) {
+    flits.push_back(flit.data);
+}
+
+template <typename T>
+void append_flit(std::vector<T> &flits, const T &flit) {
+    flits.push_back(flit);
+}
+
+template <typename T>
+void append_flit(PooledFlits<typename AxiStreamTraits<T>::data_t> &flits,
+                 const T &flit) {
+    flits.push_back(flit.data);
+}
+
+template <typename T>
+void append_flit(PooledFlits<T> &flits, const T &flit) {
+    flits.push_back(flit);
+}
+
+/**
+ * Start a new batch with the already read flit first and add up to
+ * max_batch_size - 1 flits from the stream. Reading stops if the stream
+ * stays empty for longer than flush_timeout_us.
+ */
+template <typename T, typename Stream, typename Batch>
+void collect_batch(Stream &stream, const T &first, Batch &batch,
+                   const AuroraEmuConfig &config) {
+    batch.clear();
+    append_flit(batch, first);
+    auto deadline = std::chrono::steady_clock::now() +
+                    std::chrono::microseconds(config.flush_timeout_us);
+    while (batch.size() < config.max_batch_size) {
+        if (stream.empty()) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                break;
+            }
+            std::this_thread::yield();
+            continue;
+        }
+        append_flit(batch, stream.read());
+    }
+}
+
+/**
+ * Start a new frame with the already read flit first and block on the
+ * stream until TLAST is read or the frame has max_frame_size flits. Stops
+ * early if the reader is stopped.
+ */
+template <typename T, typename Reader, typename Frame>
+void collect_frame(Reader &reader, const T &first, Frame &frame,
+                   const AuroraEmuConfig &config) {
+    frame.clear();
+    frame.push_back(first);
+    T data;
+    while (!frame.back().last && frame.size() < config.max_frame_size &&
+           reader.read(data)) {
+        frame.push_back(data);
+    }
+}
+
+/**
+ * Write all flits contained in a received message of the given size in
+ * bytes to the stream or RX FIFO. Returns the number of flits.
+ */
+template <typename T, typename Stream>
+size_t unpack_batch(const void *msg, size_t bytes, Stream &stream) {
+    typedef typename AxiStreamTraits<T>::data_t data_t;
+    const data_t *flits = static_cast<const data_t *>(msg);
+    size_t count = bytes / sizeof(data_t);
+    for (size_t i = 0; i < count; i++) {
+        T data;
+        data.data = flits[i];
+        stream.write(data);
+    }
+    return count;
+}
+
+/**
+ * Flits of received messages that wait for space in the user stream of a
+ * core that runs on an AuroraEmuReactor. The vector keeps its capacity when
+ * it runs empty, so the backlog stops allocating once it had the size of
+ * the largest message.
+ */
+template <typename T>
+struct FlitBacklog {
+    std::vector<T> flits;
+    // index of the next flit passed to the user stream
+    size_t head = 0;
+
+    void write(const T &flit) { flits.push_back(flit); }
+
+    bool empty() const { return head == flits.size(); }
+
+    const T &front() const { return flits[head]; }
+
+    void pop_front() {
+        if (++head == flits.size()) {
+            flits.clear();
+            head = 0;
+        }
+    }
+};
+
+/**
+ * Size in bytes of the largest data message of a core, which carries a
+ * frame or a batch
+ */
+template <typename T>
+size_t max_message_size(const AuroraEmuConfig &config) {
+    return config.framing
+               ? config.max_frame_size * sizeof(T)
+               : config.max_batch_size *
+                     sizeof(typename AxiStreamTraits<T>::data_t);
+}
+
+// true if the message contains the given id, e.g. the topic of a message
+inline bool message_is(const zmq::message_t &msg, const std::string &id) {
+    return msg.size() == id.size() &&
+           std::memcmp(msg.data(), id.data(), id.size()) == 0;
+}
+
+/**
+ * Append the flits of a received data message to the trace, all with the
+ * same arrival time
+ */
+template <typename T>
+void trace_flits(FlitTraceWriter<T> &trace, const void *msg, size_t bytes,
+                 bool framing, uint32_t source) {
+    typedef typename AxiStreamTraits<T>::data_t data_t;
+    int64_t now = trace.now();
+    if (framing) {
+        const T *flits = static_cast<const T *>(msg);
+        for (size_t i = 0; i < bytes / sizeof(T); i++) {
+            trace.append(flits[i], source, now);
+        }
+        return;
+    }
+    const data_t *flits = static_cast<const data_t *>(msg);
+    for (size_t i = 0; i < bytes / sizeof(data_t); i++) {
+        T data;
+        data.data = flits[i];
+        trace.append(data, source, now);
+    }
+}
+
+/**
+ * Pass the flits of a received data message with the given size in bytes to
+ * the RX FIFO model, if NFC is enabled, or the user stream and update the
+ * RX and frame counters. The flits are recorded with the given source id if
+ * a trace is given.
+ */
+template <typename T, typename Stream>
+void receive_flits(const void *msg, size_t bytes, RxFifo<T> *rx_fifo,
+                   Stream &stream, AuroraEmuRegisters &registers,
+                   bool framing, FlitTraceWriter<T> *trace = nullptr,
+                   uint32_t source = 0) {
+    if (trace != nullptr) {
+        trace_flits(*trace, msg, bytes, framing, source);
+    }
+    if (!framing) {
+        registers.add(AuroraEmuRegisters::RX_COUNT_ADDRESS,
+                      rx_fifo ? unpack_batch<T>(msg, bytes, *rx_fifo)
+                              : unpack_batch<T>(msg, bytes, stream));
+        return;
+    }
+    // framed messages carry the flits including TLAST and TKEEP
+    const T *flits = static_cast<const T *>(msg);
+    size_t count = bytes / sizeof(T);
+    uint32_t frames = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (rx_fifo) {
+            rx_fifo->write(flits[i]);
+        }
+        if (flits[i].last) {
+            frames++;
+        }
+    }
+    if (!rx_fifo) {
+        write_flits(stream, flits, count);
+    }
+    registers.add(AuroraEmuRegisters::RX_COUNT_ADDRESS, count);
+    registers.add(AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS, frames);
+}
+
+template <typename T, typename Stream>
+void receive_flits(const zmq::message_t &msg, RxFifo<T> *rx_fifo,
+                   Stream &stream, AuroraEmuRegisters &registers,
+                   bool framing, FlitTraceWriter<T> *trace = nullptr,
+                   uint32_t source = 0) {
+    receive_flits(msg.data(), msg.size(), rx_fifo, stream, registers,
+                  framing, trace, source);
+}
+
+/**
+ * Read a register of an emulated core. The flow control counters and the
+ * RX FIFO status are taken from the RX FIFO model if NFC is enabled.
+ */
+template <typename T>
+uint32_t read_core_register(const AuroraEmuRegisters &registers,
+                            RxFifo<T> *rx_fifo, uint32_t address) {
+    switch (address) {
+        case AuroraEmuRegisters::FIFO_STATUS_ADDRESS: {
+            // the TX FIFO is not modeled and always drained
+            uint32_t status = AuroraEmuRegisters::FIFO_TX_PROG_EMPTY |
+                              AuroraEmuRegisters::FIFO_TX_ALMOST_EMPTY;
+            if (rx_fifo == nullptr || rx_fifo->is_prog_empty()) {
+                status |= AuroraEmuRegisters::FIFO_RX_PROG_EMPTY;
+            }
+            if (rx_fifo == nullptr || rx_fifo->size() <= 1) {
+                status |= AuroraEmuRegisters::FIFO_RX_ALMOST_EMPTY;
+            }
+            if (rx_fifo != nullptr && rx_fifo->is_prog_full()) {
+                status |= AuroraEmuRegisters::FIFO_RX_PROG_FULL;
+            }
+            return status;
+        }
+        case AuroraEmuRegisters::FIFO_RX_OVERFLOW_COUNT_ADDRESS:
+            return rx_fifo ? rx_fifo->overflow_count.load() : 0;
+        case AuroraEmuRegisters::NFC_FULL_TRIGGER_COUNT_ADDRESS:
+            return rx_fifo ? rx_fifo->full_trigger_count.load() : 0;
+        case AuroraEmuRegisters::NFC_EMPTY_TRIGGER_COUNT_ADDRESS:
+            return rx_fifo ? rx_fifo->empty_trigger_count.load() : 0;
+        case AuroraEmuRegisters::NFC_LATENCY_COUNT_ADDRESS:
+            return rx_fifo ? rx_fifo->max_latency.load() : 0;
+        default:
+            return registers.read(address);
+    }
+}
+
+/**
+ * Write a register of an emulated core. Only the counter reset has an
+ * effect, a core reset is accepted and ignored.
+ */
+template <typename T>
+void write_core_register(AuroraEmuRegisters &registers, RxFifo<T> *rx_fifo,
+                         uint32_t address, uint32_t value) {
+    if (address == AuroraEmuRegisters::COUNTER_RESET_ADDRESS && value) {
+        registers.reset_counter();
+        if (rx_fifo != nullptr) {
+            rx_fifo->reset_counter();
+        }
+    }
+}
 
-class AuroraEmu {
+/**
+ * Point-to-point link of an emulated Aurora core. T is the AXI stream type
+ * of the user kernels, e.g. ap_axiu<256, 0, 0, 0> for a FIFO width of 32
+ * bytes.
+ */
+template <typename T, typename Stream = hlslib::Stream<T>>
+class BasicAuroraEmu {
    private:
+    typedef typename AxiStreamTraits<T>::data_t data_t;
+
     // ZMQ sockets used to exchange data between Aurora cores
     zmq::context_t ctx;
     zmq::socket_t sock_out;
     zmq::socket_t sock_in;
 
-    // ZMQ socket used to terminate send and recv threads
+    // ZMQ socket used to terminate the recv thread
     zmq::socket_t kill_socket;
 
     // send and recv threads used to pass data to and from user kernels
@@ -40,14 +516,150 @@ class AuroraEmu {
     std::thread send_thread;
 
     // streams used to pass data to and from user kernels
-    hlslib::Stream<data_stream_t> &remote_to_user;
-    hlslib::Stream<data_stream_t> &user_to_remote;
+    Stream &remote_to_user;
+    Stream &user_to_remote;
+
+    // shared memory rings used instead of the ZMQ sockets for shm links.
+    // They always carry the side channels of the flits
+    ShmRing<T> ring_out;
+    ShmRing<T> ring_in;
 
     // id that is used to name the socket of the aurora emulator
     // or the network port
     std::string id;
     std::string protocol;
 
+    // batching options
+    AuroraEmuConfig config;
+
+    // cleared by the destructor to terminate the send thread and the recv
+    // thread of shm links
+    std::atomic<bool> running;
+    // blocking reads of the send thread from user_to_remote
+    AuroraEmuStreamReader<T, Stream> tx_reader;
+
+    // core in the same process that receives from this core. Set by the
+    // receiving core in connect() and cleared when it is destroyed
+    std::atomic<BasicAuroraEmu *> local_remote;
+    // held by the send thread while it passes flits to local_remote
+    std::mutex local_mutex;
+    // core in the same process that sends to this core. Guarded by
+    // local_cores_mutex()
+    BasicAuroraEmu *local_sender;
+
+    // RX FIFO model and flow control state if NFC is enabled
+    std::unique_ptr<RxFifo<T>> rx_fifo;
+    TxFlowControl tx_flow_control;
+    // passes flits from the RX FIFO model to the user kernel
+    std::thread drain_thread;
+    // serializes data and NFC messages of the send and recv threads
+    std::mutex send_mutex;
+    // set once the remote core subscribed to sock_out. Guarded by send_mutex
+    bool subscribed;
+
+    // limits the send rate to the line rate of the link
+    LinkPacer pacer;
+
+    // status and counters at the addresses of the hardware core
+    AuroraEmuRegisters registers;
+
+    // records the received flits if trace_file is set. The source id is
+    // derived from the address of the remote core in connect()
+    std::unique_ptr<FlitTraceWriter<T>> trace;
+    uint32_t trace_source;
+
+    // buffers of the messages sent over ZMQ
+    MessagePoolPtr pool;
+
+    // samples the latency of the flits sent and received over ZMQ
+    AuroraEmuLatencyTrace latency;
+
+    // all cores of this process by address to detect local links
+    static std::map<std::string, BasicAuroraEmu *> &local_cores() {
+        static std::map<std::string, BasicAuroraEmu *> cores;
+        return cores;
+    }
+
+    static std::mutex &local_cores_mutex() {
+        static std::mutex m;
+        return m;
+    }
+
+    /**
+     * Receive from the core with the given address over a local link if it
+     * lives in the same process and both cores use local links. Returns
+     * false otherwise.
+     */
+    bool attach_local_sender(const std::string &address) {
+        if (!config.local_links || config.nfc) {
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(local_cores_mutex());
+        auto core = local_cores().find(address);
+        if (core == local_cores().end() || !core->second->config.local_links ||
+            core->second->config.nfc) {
+            return false;
+        }
+        local_sender = core->second;
+        local_sender->local_remote = this;
+        return true;
+    }
+
+    /**
+     * Remove the core from the registry and detach its local links, so no
+     * other core passes flits to it or takes flits from it once it is
+     * destroyed. running has to be cleared, so a sender that waits for
+     * space in the stream of this core gives up.
+     */
+    void detach_local_links() {
+        std::lock_guard<std::mutex> lock(local_cores_mutex());
+        local_cores().erase(get_address());
+        if (local_sender != nullptr) {
+            std::lock_guard<std::mutex> sender_lock(local_sender->local_mutex);
+            local_sender->local_remote = nullptr;
+            local_sender = nullptr;
+        }
+        std::lock_guard<std::mutex> own_lock(local_mutex);
+        BasicAuroraEmu *receiver = local_remote;
+        if (receiver != nullptr) {
+            receiver->local_sender = nullptr;
+            local_remote = nullptr;
+        }
+    }
+
+    /**
+     * Move the first flit and the flits that are already available, up to
+     * max_batch_size, from the user stream straight into the user stream of
+     * a receiver in the same process. Gives up if one of the cores is
+     * destroyed while the stream is full. Has to be called with local_mutex
+     * held.
+     */
+    void pass_to_local(BasicAuroraEmu &local, const T &first) {
+        int64_t now = local.trace ? local.trace->now() : 0;
+        size_t count = 0;
+        T flit = first;
+        do {
+            if (config.pacing) {
+                pacer.pace(AxiStreamTraits<T>::width_bytes());
+            }
+            registers.add(AuroraEmuRegisters::TX_COUNT_ADDRESS, 1);
+            if (!write_while(local.remote_to_user, flit, [&]() {
+                    return running && local.running;
+                })) {
+                return;
+            }
+            local.registers.add(AuroraEmuRegisters::RX_COUNT_ADDRESS, 1);
+            if (local.trace) {
+                local.trace->append(flit, local.trace_source, now);
+            }
+            if (flit.last && local.config.framing) {
+                local.registers.add(
+                    AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS, 1);
+            }
+        } while (++count < config.max_batch_size &&
+                 user_to_remote.read_nb(flit));
+    }
+
     void forward_from_remote() {
         zmq::socket_t kill_listener(ctx, zmq::socket_type::sub);
         kill_listener.connect("inproc://kill_" + id);
@@ -56,13 +668,25 @@ class AuroraEmu {
         // listen to kill singals and data coming in
         zmq::pollitem_t items[] = {{sock_in, 0, ZMQ_POLLIN, 0},
                                    {kill_listener, 0, ZMQ_POLLIN, 0}};
-        while (true) {
-            zmq::poll(&items[0], 2);
+        while (running) {
+            zmq::poll(&items[0], 2,
+                      std::chrono::milliseconds(KILL_CHECK_INTERVAL));
             if (items[0].revents & ZMQ_POLLIN) {
                 auto result = sock_in.recv(msg, zmq::recv_flags::none);
-                data_stream_t data;
-                data.data = *static_cast<ap_uint<512> *>(msg.data());
-                remote_to_user.write(data);
+                wait_for_delivery(sock_in, msg, latency.rx_sample());
+                latency.receive();
+                if (msg.size() == sizeof(uint16_t)) {
+                    // flow control message of the remote core
+                    tx_flow_control.receive(
+                        *static_cast<const uint16_t *>(msg.data()));
+                } else {
+                    receive_flits(msg, rx_fifo.get(), remote_to_user,
+                                  registers, config.framing, trace.get(),
+                                  trace_source);
+                    latency.dequeue();
+                }
+                // let ZMQ reuse its receive buffer while the thread waits
+                msg.rebuild();
             }
             if (items[1].revents & ZMQ_POLLIN) {
                 break;
@@ -70,91 +694,402 @@ class AuroraEmu {
         }
     }
 
+    void forward_from_rx_fifo() {
+        T data;
+        while (rx_fifo->read(data, running)) {
+            remote_to_user.write(data);
+        }
+    }
+
+    /**
+     * Block until the remote core subscribed to sock_out, so no message gets
+     * lost. The XPUB socket receives the subscription as a message. Has to
+     * be called with send_mutex held.
+     */
+    void wait_for_subscriber() {
+        zmq::message_t msg;
+        zmq::pollitem_t items[] = {{sock_out, 0, ZMQ_POLLIN, 0}};
+        while (!subscribed && running) {
+            zmq::poll(&items[0], 1,
+                      std::chrono::milliseconds(HANDSHAKE_INTERVAL));
+            if (items[0].revents & ZMQ_POLLIN) {
+                auto result = sock_out.recv(msg, zmq::recv_flags::none);
+                // subscriptions start with 1, unsubscriptions with 0
+                subscribed = msg.size() > 0 &&
+                             static_cast<const uint8_t *>(msg.data())[0] == 1;
+            }
+        }
+    }
+
+    void send_nfc(uint16_t nfc) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        wait_for_subscriber();
+        zmq::message_t msg(static_cast<void *>(&nfc), sizeof(nfc));
+        sock_out.send(msg, zmq::send_flags::none);
+    }
+
+    void forward_from_ring() {
+        std::vector<T> flits(config.max_batch_size);
+        while (true) {
+            size_t count = ring_in.pop(flits.data(), flits.size(), running);
+            if (count == 0) {
+                return;
+            }
+            if (trace) {
+                int64_t now = trace->now();
+                for (size_t i = 0; i < count; i++) {
+                    trace->append(flits[i], trace_source, now);
+                }
+            }
+            uint32_t frames = 0;
+            for (size_t i = 0; i < count; i++) {
+                remote_to_user.write(flits[i]);
+                if (flits[i].last) {
+                    frames++;
+                }
+            }
+            registers.add(AuroraEmuRegisters::RX_COUNT_ADDRESS, count);
+            if (config.framing) {
+                registers.add(AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS,
+                              frames);
+            }
+        }
+    }
+
+    void bind() {
+        if (protocol == "shm") {
+            ring_out.create(id, config.shm_ring_slots);
+        } else {
+            // never drop messages if the receiver is slow
+            sock_out.set(zmq::sockopt::sndhwm, 0);
+            sock_out.bind(get_address());
+        }
+        kill_socket.bind("inproc://kill_" + id);
+        if (config.nfc) {
+            rx_fifo.reset(new RxFifo<T>(
+                config.rx_fifo_depth, config.rx_fifo_prog_full,
+                config.rx_fifo_prog_empty,
+                [this](uint16_t nfc) { send_nfc(nfc); }));
+        }
+        if (!config.trace_file.empty()) {
+            trace.reset(new FlitTraceWriter<T>(config.trace_file));
+        }
+        std::lock_guard<std::mutex> lock(local_cores_mutex());
+        local_cores()[get_address()] = this;
+    }
+
     void forward_from_user() {
-        zmq::socket_t kill_listener(ctx, zmq::socket_type::sub);
-        kill_listener.connect("inproc://kill_" + id);
-        kill_listener.set(zmq::sockopt::subscribe, "");
+        PooledFlits<data_t> batch(*pool);
+        // flits including their side channels for framing
+        PooledFlits<T> frame(*pool);
+        // flits of shm links, which always carry the side channels
+        std::vector<T> flits;
         while (true) {
-            // check if stream is empty. If so, sleep a bit to reduce CPU load
-            while (user_to_remote.empty()) {
-                std::this_thread::sleep_for(
-                    std::chrono::milliseconds(RECV_POLL_INTERVAL));
-                // check for kill signals in between
-                zmq::message_t m;
-                if (kill_listener.recv(m, zmq::recv_flags::dontwait)
-                        .has_value()) {
+            // wait until the user kernel writes data or the destructor
+            // clears running
+            T first;
+            if (!tx_reader.read(first)) {
+                return;
+            }
+            // hand the flits that are already available over to a
+            // receiver in the same process
+            std::unique_lock<std::mutex> local_lock(local_mutex);
+            BasicAuroraEmu *local = local_remote;
+            if (local != nullptr) {
+                pass_to_local(*local, first);
+                continue;
+            }
+            local_lock.unlock();
+            // forward incoming data to remote core
+            if (ring_out.is_open()) {
+                if (config.framing) {
+                    collect_frame(tx_reader, first, flits, config);
+                } else {
+                    collect_batch(user_to_remote, first, flits, config);
+                }
+                if (!running) {
                     return;
                 }
+                registers.add(AuroraEmuRegisters::TX_COUNT_ADDRESS,
+                              flits.size());
+                if (config.pacing) {
+                    pacer.pace(flits.size() *
+                               AxiStreamTraits<T>::width_bytes());
+                }
+                ring_out.push(flits.data(), flits.size(), running);
+                continue;
+            }
+            latency.enqueue();
+            if (config.framing) {
+                collect_frame(tx_reader, first, frame, config);
+            } else {
+                collect_batch(user_to_remote, first, batch, config);
             }
-            // forward incoming data to user kernel
-            ap_uint<512> data = user_to_remote.read().data;
-            zmq::message_t msg(static_cast<void *>(&data),
-                               sizeof(ap_uint<512>));
-            sock_out.send(msg, zmq::send_flags::none);
+            if (!running) {
+                return;
+            }
+            size_t count = config.framing ? frame.size() : batch.size();
+            registers.add(AuroraEmuRegisters::TX_COUNT_ADDRESS, count);
+            if (config.nfc) {
+                tx_flow_control.wait(running);
+            }
+            // the flits are sent from the pool buffer without a copy
+            zmq::message_t msg =
+                config.framing ? frame.message() : batch.message();
+            std::lock_guard<std::mutex> lock(send_mutex);
+            wait_for_subscriber();
+            if (!running) {
+                return;
+            }
+            send_paced(sock_out, msg,
+                       count * AxiStreamTraits<T>::width_bytes(), pacer,
+                       config, latency.send());
         }
     }
 
    public:
-    AuroraEmu(std::string host_address, int port,
-              hlslib::Stream<data_stream_t> &user_to_remote,
-              hlslib::Stream<data_stream_t> &remote_to_user)
+    BasicAuroraEmu(std::string host_address, int port,
+                   Stream &user_to_remote,
+                   Stream &remote_to_user,
+                   AuroraEmuConfig config = AuroraEmuConfig())
         : ctx(1),
-          sock_out(ctx, zmq::socket_type::pub),
+          sock_out(ctx, zmq::socket_type::xpub),
           sock_in(ctx, zmq::socket_type::sub),
           kill_socket(ctx, zmq::socket_type::pub),
-          user_to_remote(user_to_remote),
           remote_to_user(remote_to_user),
+          user_to_remote(user_to_remote),
           id(host_address + ":" + std::to_string(port)),
-          protocol("tcp") {
-        sock_out.bind(protocol + "://" + id);
-        kill_socket.bind("inproc://kill_" + id);
+          protocol("tcp"),
+          config(config),
+          running(true),
+          tx_reader(user_to_remote, running),
+          local_remote(nullptr),
+          local_sender(nullptr),
+          tx_flow_control(config.nfc_latency_us),
+          subscribed(false),
+          pacer(config.pacing ? config.line_rate_gbps : 0,
+                config.encoding_efficiency),
+          registers(AxiStreamTraits<T>::width_bytes(), config.rx_fifo_depth,
+                    config.rx_fifo_prog_full, config.rx_fifo_prog_empty,
+                    config.framing, config.framing),
+          trace_source(0),
+          pool(MessagePool::create(max_message_size<T>(config),
+                                    MESSAGE_POOL_BUFFERS,
+                                    config.placement.memory_node())),
+          latency(config.latency_sample_interval) {
+        bind();
     }
 
-    AuroraEmu(std::string pipe_name,
-              hlslib::Stream<data_stream_t> &user_to_remote,
-              hlslib::Stream<data_stream_t> &remote_to_user)
+    /**
+     * Create a core that communicates over named pipes. The name may be
+     * prefixed with a protocol: "ipc://" (default) for ZMQ named pipes or
+     * "shm://" for a shared memory ring that can only be connected to by a
+     * single receiver on the same host.
+     */
+    BasicAuroraEmu(std::string pipe_name,
+                   Stream &user_to_remote,
+                   Stream &remote_to_user,
+                   AuroraEmuConfig config = AuroraEmuConfig())
         : ctx(1),
-          sock_out(ctx, zmq::socket_type::pub),
+          sock_out(ctx, zmq::socket_type::xpub),
           sock_in(ctx, zmq::socket_type::sub),
           kill_socket(ctx, zmq::socket_type::pub),
-          user_to_remote(user_to_remote),
           remote_to_user(remote_to_user),
+          user_to_remote(user_to_remote),
           id(pipe_name),
-          protocol("ipc") {
-        sock_out.bind(protocol + "://" + id);
-        kill_socket.bind("inproc://kill_" + id);
+          protocol("ipc"),
+          config(config),
+          running(true),
+          tx_reader(user_to_remote, running),
+          local_remote(nullptr),
+          local_sender(nullptr),
+          tx_flow_control(config.nfc_latency_us),
+          subscribed(false),
+          pacer(config.pacing ? config.line_rate_gbps : 0,
+                config.encoding_efficiency),
+          registers(AxiStreamTraits<T>::width_bytes(), config.rx_fifo_depth,
+                    config.rx_fifo_prog_full, config.rx_fifo_prog_empty,
+                    config.framing, config.framing),
+          trace_source(0),
+          pool(MessagePool::create(max_message_size<T>(config),
+                                    MESSAGE_POOL_BUFFERS,
+                                    config.placement.memory_node())),
+          latency(config.latency_sample_interval) {
+        size_t separator = pipe_name.find("://");
+        if (separator != std::string::npos) {
+            protocol = pipe_name.substr(0, separator);
+            id = pipe_name.substr(separator + 3);
+        }
+        bind();
     }
 
-    ~AuroraEmu() {
+    ~BasicAuroraEmu() {
         // send kill signal to all threads
         // and wait for them to join
+        running = false;
+        detach_local_links();
+        tx_reader.stop();
         zmq::message_t t(0);
         kill_socket.send(t, zmq::send_flags::none);
+        ring_in.wake();
+        ring_out.wake();
+        tx_flow_control.wake();
+        if (rx_fifo) {
+            // the recv thread may wait for space in the RX FIFO
+            rx_fifo->stop();
+        }
         if (recv_thread.joinable()) {
             recv_thread.join();
         }
+        if (drain_thread.joinable()) {
+            drain_thread.join();
+        }
         if (send_thread.joinable()) {
             send_thread.join();
         }
+        latency.report(config.latency_report, get_address());
     }
 
-    void connect(AuroraEmu &other_core, bool bidirectional = true) {
+    void connect(BasicAuroraEmu &other_core, bool bidirectional = true) {
         if ((get_address() != other_core.get_address()) && bidirectional)
             other_core.connect(*this, false);
-        sock_in.connect(other_core.get_address());
-        sock_in.set(zmq::sockopt::subscribe, "");
-        std::thread t1(&AuroraEmu::forward_from_remote, this);
-        std::thread t2(&AuroraEmu::forward_from_user, this);
+        connect(other_core.get_address());
+    }
+
+    /**
+     * Receive data from the core with the given address, which may also
+     * live in another process. Only the local core is connected, so the
+     * remote core has to connect to this core for bidirectional
+     * communication.
+     * If the remote core lives in the same process and both cores use
+     * local_links, it writes its flits directly into the stream of this
+     * core and no recv thread is started.
+     */
+    void connect(std::string remote_address) {
+        trace_source = flit_trace_source(remote_address);
+        if (config.local_links && attach_local_sender(remote_address)) {
+            std::thread t(&BasicAuroraEmu::forward_from_user, this);
+            config.placement.apply(t);
+            send_thread.swap(t);
+            return;
+        }
+        bool shm = (remote_address.compare(0, 6, "shm://") == 0);
+        if (shm) {
+            // the ring is created by the constructor of the remote core
+            auto deadline =
+                std::chrono::steady_clock::now() +
+                std::chrono::milliseconds(config.handshake_timeout_ms);
+            while (!ring_in.open(remote_address.substr(6))) {
+                if (std::chrono::steady_clock::now() >= deadline) {
+                    throw std::runtime_error("No shared memory ring at " +
+                                             remote_address);
+                }
+                std::this_thread::sleep_for(
+                    std::chrono::milliseconds(HANDSHAKE_INTERVAL));
+            }
+        } else {
+            sock_in.set(zmq::sockopt::rcvhwm, 0);
+            sock_in.connect(remote_address);
+            sock_in.set(zmq::sockopt::subscribe, "");
+            if (rx_fifo) {
+                std::thread t(&BasicAuroraEmu::forward_from_rx_fifo, this);
+                config.placement.apply(t);
+                drain_thread.swap(t);
+            }
+        }
+        std::thread t1(shm ? &BasicAuroraEmu::forward_from_ring
+                           : &BasicAuroraEmu::forward_from_remote,
+                       this);
+        std::thread t2(&BasicAuroraEmu::forward_from_user, this);
+        config.placement.apply(t1);
+        config.placement.apply(t2);
         recv_thread.swap(t1);
         send_thread.swap(t2);
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(RECV_POLL_INTERVAL));
     }
 
     std::string get_address() { return protocol + "://" + id; }
+
+    /**
+     * Latency histograms of the flits received over ZMQ, nullptr unless the
+     * library is built with AURORAEMU_LATENCY_TRACE
+     */
+    const LatencyHistograms *get_latency_histograms() const {
+        return latency.histograms();
+    }
+
+    uint32_t get_nfc_full_trigger_count() {
+        return rx_fifo ? rx_fifo->full_trigger_count.load() : 0;
+    }
+
+    uint32_t get_nfc_empty_trigger_count() {
+        return rx_fifo ? rx_fifo->empty_trigger_count.load() : 0;
+    }
+
+    // maximum number of flits received after sending XOFF
+    uint32_t get_nfc_latency_count() {
+        return rx_fifo ? rx_fifo->max_latency.load() : 0;
+    }
+
+    uint32_t get_fifo_rx_overflow_count() {
+        return rx_fifo ? rx_fifo->overflow_count.load() : 0;
+    }
+
+    /**
+     * Read the register at the given address of the control s axi interface
+     * of the hardware core, e.g. TX_COUNT_ADDRESS
+     */
+    uint32_t read_register(uint32_t address) {
+        return read_core_register(registers, rx_fifo.get(), address);
+    }
+
+    void write_register(uint32_t address, uint32_t value) {
+        write_core_register(registers, rx_fifo.get(), address, value);
+    }
 };
 
-class AuroraEmuSwitch {
+typedef BasicAuroraEmu<data_stream_t> AuroraEmu;
+typedef BasicAuroraEmuReplay<data_stream_t> AuroraEmuReplay;
+
+/**
+ * Index of the switch worker that routes the messages for the given core id.
+ * Uses FNV-1a instead of std::hash, so cores and switches built with
+ * different compilers agree on the worker.
+ */
+inline int switch_worker(const std::string &id, int num_workers) {
+    uint32_t hash = 2166136261u;
+    for (char c : id) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hash % num_workers;
+}
+
+/**
+ * Port of the socket the cores send to for the given switch worker. The
+ * worker publishes the messages on the next port.
+ */
+inline int switch_worker_port(int port, int worker) {
+    return port + 2 * worker;
+}
+
+/**
+ * Routes the messages of all destination ids that are mapped to one worker of
+ * an AuroraEmuSwitch. Every worker has its own context, sockets and thread,
+ * so independent flows do not serialize behind each other.
+ *
+ * Workers of federated switches exchange the messages for remote cores with
+ * the worker of the same index of their peers. The ids of the local cores
+ * are learned from their subscriptions and announced to the peers, which
+ * keep a routing table of the ids. Messages to ids that are not in the
+ * table are sent to all peers. Messages from a peer start with an empty
+ * frame and are only delivered to local cores, so they never loop.
+ *
+ * The probes of the handshake of a core have an empty source. They are
+ * returned with the number of workers of the switch and whether it serves
+ * direct links as content, so a core that shards the ids over a different
+ * number of workers or needs the directory fails instead of losing
+ * messages.
+ */
+class AuroraEmuSwitchWorker {
    private:
     // ZMQ sockets used to exchange data between Aurora cores
     zmq::context_t ctx;
@@ -165,95 +1100,706 @@ class AuroraEmuSwitch {
     zmq::socket_t kill_socket;
     zmq::socket_t kill_listener;
 
-    // send and recv threads used to pass data to and from user kernels
+    // pass peer requests to the switch thread and its replies back
+    zmq::socket_t control;
+    zmq::socket_t control_listener;
+
+    // thread that forwards the messages
     std::thread switch_thread;
 
-    // ZMQ address of the kill socket for this switch
-    std::string kill_id;
+    // endpoint the ids of the local cores are announced on
+    std::string route_endpoint;
+    // content of the probes returned to the cores
+    std::string probe_reply;
+    // bound with the first peer. Peers subscribe to it
+    zmq::socket_t routes_out;
+    // messages to the workers of the peers and their announcements
+    std::vector<zmq::socket_t> peers_out;
+    std::vector<zmq::socket_t> peers_routes;
+    // ids of the cores subscribed to this worker
+    std::set<std::string> local_ids;
+    // indices of the peers with cores of an id
+    std::map<std::string, std::set<size_t>> routes;
+    // frames of the message that is forwarded to peers
+    std::vector<zmq::message_t> frames;
 
-    void forward_data() {
+    // messages sent to peers and the part of them sent to all peers
+    std::atomic<uint64_t> peer_messages;
+    std::atomic<uint64_t> flooded_messages;
+
+    /**
+     * Forward all frames of a message from the incoming socket: topic,
+     * source, content and the optional delivery time and latency sample
+     */
+    void forward_message() {
+        int64_t in_ns = AuroraEmuLatencyTrace::switch_in();
         zmq::message_t msg;
-        // listen to kill signals and data coming in
-        zmq::pollitem_t items[] = {{incoming, 0, ZMQ_POLLIN, 0},
-                                   {kill_listener, 0, ZMQ_POLLIN, 0}};
-        while (true) {
-            zmq::poll(&items[0], 2);
-            if (items[0].revents & ZMQ_POLLIN) {
-                // forward topic
+        if (peers_out.empty()) {
+            bool more = true;
+            bool probe = false;
+            int frame = 0;
+            while (more) {
                 auto result = incoming.recv(msg, zmq::recv_flags::none);
-                distributor.send(msg, zmq::send_flags::sndmore);
-                // forward content
-                result = incoming.recv(msg, zmq::recv_flags::none);
-                distributor.send(msg, zmq::send_flags::none);
+                more = msg.more();
+                if (frame == 0 && msg.size() == 0 && more) {
+                    // mark of a peer this switch did not peer with
+                    continue;
+                }
+                if (frame == 1 && msg.size() == 0) {
+                    probe = true;
+                } else if (frame == 2 && probe) {
+                    msg.rebuild(probe_reply.data(), probe_reply.size());
+                }
+                if (!more && frame > 2) {
+                    AuroraEmuLatencyTrace::switch_out(msg, in_ns);
+                }
+                frame++;
+                distributor.send(msg, more ? zmq::send_flags::sndmore
+                                           : zmq::send_flags::none);
             }
-            if (items[1].revents & ZMQ_POLLIN) {
-                break;
+            return;
+        }
+        frames.clear();
+        bool more = true;
+        while (more) {
+            auto result = incoming.recv(msg, zmq::recv_flags::none);
+            more = msg.more();
+            frames.push_back(std::move(msg));
+        }
+        bool from_peer = frames[0].size() == 0;
+        size_t first = from_peer ? 1 : 0;
+        if (frames.size() - first > 3) {
+            AuroraEmuLatencyTrace::switch_out(frames.back(), in_ns);
+        }
+        std::string destination = frames[first].to_string();
+        // the probes of the handshake are sent by a core to itself
+        bool probe = frames.size() > first + 2 && frames[first + 1].size() == 0;
+        if (probe) {
+            frames[first + 2].rebuild(probe_reply.data(), probe_reply.size());
+        }
+        if (!from_peer && !probe) {
+            // cores with the same id may be attached to several switches
+            auto route = routes.find(destination);
+            if (route != routes.end()) {
+                for (size_t peer : route->second) {
+                    send_to_peer(peer, first);
+                }
+            } else if (local_ids.count(destination) == 0) {
+                // counted first, so a receiver that got the message sees
+                // the count
+                flooded_messages++;
+                for (size_t peer = 0; peer < peers_out.size(); peer++) {
+                    send_to_peer(peer, first);
+                }
             }
         }
+        for (size_t i = first; i < frames.size(); i++) {
+            distributor.send(frames[i], i + 1 < frames.size()
+                                            ? zmq::send_flags::sndmore
+                                            : zmq::send_flags::none);
+        }
     }
 
-   public:
-    /**
-     * Construct and connect a new aurora switch and do not start thread
-     * to listen for incoming connections. Thread has to be started with
-     * additional call to listen()
-     *
-     */
-    AuroraEmuSwitch()
-        : ctx(1),
-          incoming(ctx, zmq::socket_type::pull),
-          distributor(ctx, zmq::socket_type::pub),
-          kill_socket(ctx, zmq::socket_type::pub),
-          kill_listener(ctx, zmq::socket_type::sub),
-          kill_id("") {}
+    // send a copy of the message to a peer, marked with an empty frame
+    void send_to_peer(size_t peer, size_t first) {
+        zmq::message_t mark(0);
+        peers_out[peer].send(mark, zmq::send_flags::sndmore);
+        for (size_t i = first; i < frames.size(); i++) {
+            zmq::message_t copy;
+            copy.copy(frames[i]);
+            peers_out[peer].send(copy, i + 1 < frames.size()
+                                           ? zmq::send_flags::sndmore
+                                           : zmq::send_flags::none);
+        }
+        peer_messages++;
+    }
 
     /**
-     * Construct and connect a new aurora switch and start thread
-     * to listen for new connections
-     *
-     * host_address: IP address or name of the host machine
-     * port: Port of the aurora switch. port and port+1 will be used to
-     *      establish the switch functionality.
-     */
-    AuroraEmuSwitch(std::string host_address, int port) : AuroraEmuSwitch() {
-        this->listen(host_address, port);
-    }
-
-    void listen(std::string host_address, int port) {
-        if (!switch_thread.joinable()) {
-            kill_id =
-                "inproc://kill_" + host_address + "_" + std::to_string(port);
-            incoming.bind("tcp://" + host_address + ":" + std::to_string(port));
-            distributor.bind("tcp://" + host_address + ":" +
-                             std::to_string(port + 1));
-            kill_socket.bind(kill_id);
-            kill_listener.connect(kill_id);
-            kill_listener.set(zmq::sockopt::subscribe, "");
-            switch_thread = std::thread(&AuroraEmuSwitch::forward_data, this);
+     * Track the subscriptions of the local cores and announce them to the
+     * peers. Subscriptions start with 1, unsubscriptions with 0, followed by
+     * the id. The announcements use the same format.
+     */
+    void receive_subscription() {
+        zmq::message_t msg;
+        auto result = distributor.recv(msg, zmq::recv_flags::none);
+        if (msg.size() == 0) {
+            return;
+        }
+        std::string id(static_cast<const char *>(msg.data()) + 1,
+                       msg.size() - 1);
+        if (static_cast<const uint8_t *>(msg.data())[0] == 1) {
+            local_ids.insert(id);
         } else {
-            throw std::runtime_error("Switch already running!");
+            local_ids.erase(id);
+        }
+        if (routes_out) {
+            routes_out.send(msg, zmq::send_flags::none);
         }
     }
 
-    ~AuroraEmuSwitch() {
-        // send kill signal to all threads
-        // and wait for them to join
-        if (switch_thread.joinable()) {
-            zmq::message_t t(0);
-            kill_socket.send(t, zmq::send_flags::none);
-            switch_thread.join();
+    // announce all local ids to a peer that just subscribed
+    void announce_routes() {
+        zmq::message_t msg;
+        auto result = routes_out.recv(msg, zmq::recv_flags::none);
+        for (const std::string &id : local_ids) {
+            std::string announcement = std::string(1, '\x01') + id;
+            zmq::message_t route(announcement);
+            routes_out.send(route, zmq::send_flags::none);
         }
     }
-};
 
-class AuroraEmuCore {
+    void receive_routes(size_t peer) {
+        zmq::message_t msg;
+        auto result = peers_routes[peer].recv(msg, zmq::recv_flags::none);
+        if (msg.size() == 0) {
+            return;
+        }
+        std::string id(static_cast<const char *>(msg.data()) + 1,
+                       msg.size() - 1);
+        if (static_cast<const uint8_t *>(msg.data())[0] == 1) {
+            routes[id].insert(peer);
+            return;
+        }
+        auto route = routes.find(id);
+        if (route != routes.end()) {
+            route->second.erase(peer);
+            if (route->second.empty()) {
+                routes.erase(route);
+            }
+        }
+    }
+
+    /**
+     * Connect to the worker of a peer switch on request of peer(). Replies
+     * with an empty message or the error.
+     */
+    void add_peer() {
+        std::vector<std::string> request;
+        zmq::message_t msg;
+        bool more = true;
+        while (more) {
+            auto result = control_listener.recv(msg, zmq::recv_flags::none);
+            more = msg.more();
+            request.push_back(msg.to_string());
+        }
+        std::string error;
+        try {
+            if (!routes_out) {
+                routes_out = zmq::socket_t(ctx, zmq::socket_type::xpub);
+                // report every new peer, so it gets all routes
+                routes_out.set(zmq::sockopt::xpub_verbose, 1);
+                routes_out.set(zmq::sockopt::sndhwm, 0);
+                routes_out.bind(route_endpoint);
+            }
+            zmq::socket_t out(ctx, zmq::socket_type::push);
+            out.set(zmq::sockopt::sndhwm, 0);
+            out.connect(request[0]);
+            zmq::socket_t in(ctx, zmq::socket_type::sub);
+            in.set(zmq::sockopt::rcvhwm, 0);
+            in.connect(request[1]);
+            in.set(zmq::sockopt::subscribe, "");
+            peers_out.push_back(std::move(out));
+            peers_routes.push_back(std::move(in));
+        } catch (const zmq::error_t &e) {
+            error = e.what();
+        }
+        zmq::message_t reply(error);
+        control_listener.send(reply, zmq::send_flags::none);
+    }
+
+    void forward_data() {
+        // listen to kill signals, subscriptions, peer requests, routes and
+        // data coming in. The items of the routes change with the peers
+        std::vector<zmq::pollitem_t> items;
+        while (true) {
+            items.assign({{incoming, 0, ZMQ_POLLIN, 0},
+                          {kill_listener, 0, ZMQ_POLLIN, 0},
+                          {distributor, 0, ZMQ_POLLIN, 0},
+                          {control_listener, 0, ZMQ_POLLIN, 0}});
+            if (routes_out) {
+                items.push_back({routes_out, 0, ZMQ_POLLIN, 0});
+            }
+            for (zmq::socket_t &peer : peers_routes) {
+                items.push_back({peer, 0, ZMQ_POLLIN, 0});
+            }
+            zmq::poll(items.data(), items.size());
+            // the subscriptions of local cores before their messages
+            if (items[2].revents & ZMQ_POLLIN) {
+                receive_subscription();
+            }
+            if (items[0].revents & ZMQ_POLLIN) {
+                forward_message();
+            }
+            if (items[1].revents & ZMQ_POLLIN) {
+                break;
+            }
+            if (routes_out && (items[4].revents & ZMQ_POLLIN)) {
+                announce_routes();
+            }
+            size_t offset = routes_out ? 5 : 4;
+            for (size_t peer = 0; peer < peers_routes.size(); peer++) {
+                if (items[offset + peer].revents & ZMQ_POLLIN) {
+                    receive_routes(peer);
+                }
+            }
+            if (items[3].revents & ZMQ_POLLIN) {
+                add_peer();
+            }
+        }
+    }
+
+   public:
+    /**
+     * Bind to port and port+1 and start forwarding on a thread with the
+     * given placement. The routes for peers are announced on route_port.
+     */
+    AuroraEmuSwitchWorker(std::string host_address, int port, int route_port,
+                          int num_workers, bool direct_links,
+                          const AuroraEmuPlacement &placement =
+                              AuroraEmuPlacement())
+        : ctx(1),
+          distributor(ctx, zmq::socket_type::xpub),
+          incoming(ctx, zmq::socket_type::pull),
+          kill_socket(ctx, zmq::socket_type::pub),
+          kill_listener(ctx, zmq::socket_type::sub),
+          control(ctx, zmq::socket_type::pair),
+          control_listener(ctx, zmq::socket_type::pair),
+          route_endpoint("tcp://" + host_address + ":" +
+                         std::to_string(route_port)),
+          probe_reply(std::to_string(num_workers) +
+                      (direct_links ? " " + SWITCH_DIRECT_LINKS : "")),
+          peer_messages(0),
+          flooded_messages(0) {
+        std::string kill_id =
+            "inproc://kill_" + host_address + "_" + std::to_string(port);
+        // buffer all messages instead of dropping them at the publisher
+        incoming.set(zmq::sockopt::rcvhwm, 0);
+        distributor.set(zmq::sockopt::sndhwm, 0);
+        incoming.bind("tcp://" + host_address + ":" + std::to_string(port));
+        distributor.bind("tcp://" + host_address + ":" +
+                         std::to_string(port + 1));
+        kill_socket.bind(kill_id);
+        kill_listener.connect(kill_id);
+        kill_listener.set(zmq::sockopt::subscribe, "");
+        std::string control_id =
+            "inproc://control_" + host_address + "_" + std::to_string(port);
+        control.bind(control_id);
+        control_listener.connect(control_id);
+        switch_thread =
+            std::thread(&AuroraEmuSwitchWorker::forward_data, this);
+        placement.apply(switch_thread);
+    }
+
+    ~AuroraEmuSwitchWorker() {
+        // send kill signal to the thread and wait for it to join
+        zmq::message_t t(0);
+        kill_socket.send(t, zmq::send_flags::none);
+        switch_thread.join();
+    }
+
+    /**
+     * Exchange messages and routes with the worker of a peer switch that
+     * receives on incoming_endpoint and announces its routes on
+     * peer_route_endpoint. Blocks until the worker is connected.
+     */
+    void peer(const std::string &incoming_endpoint,
+              const std::string &peer_route_endpoint) {
+        zmq::message_t in(incoming_endpoint);
+        zmq::message_t routes(peer_route_endpoint);
+        control.send(in, zmq::send_flags::sndmore);
+        control.send(routes, zmq::send_flags::none);
+        zmq::message_t reply;
+        auto result = control.recv(reply, zmq::recv_flags::none);
+        if (reply.size() > 0) {
+            throw std::runtime_error("Could not peer switch: " +
+                                     reply.to_string());
+        }
+    }
+
+    uint64_t get_peer_message_count() const { return peer_messages; }
+
+    uint64_t get_flooded_message_count() const { return flooded_messages; }
+};
+
+/**
+ * Port of the directory of a switch with the given number of workers
+ */
+inline int switch_directory_port(int port, int num_workers) {
+    return switch_worker_port(port, num_workers);
+}
+
+/**
+ * Port the given worker of a switch announces the ids of its cores on to
+ * peer switches
+ */
+inline int switch_route_port(int port, int num_workers, int worker) {
+    return switch_directory_port(port, num_workers) + 1 + worker;
+}
+
+/**
+ * Send a request to the switch directory at endpoint. Returns false if the
+ * directory did not reply within DIRECTORY_TIMEOUT.
+ */
+inline bool send_directory_request(zmq::context_t &ctx,
+                                   const std::string &endpoint,
+                                   const std::vector<std::string> &request,
+                                   std::string &reply) {
+    zmq::socket_t socket(ctx, zmq::socket_type::req);
+    socket.set(zmq::sockopt::linger, 0);
+    socket.set(zmq::sockopt::rcvtimeo, DIRECTORY_TIMEOUT);
+    socket.connect(endpoint);
+    for (size_t i = 0; i < request.size(); i++) {
+        zmq::message_t msg(request[i]);
+        socket.send(msg, i + 1 < request.size() ? zmq::send_flags::sndmore
+                                                : zmq::send_flags::none);
+    }
+    zmq::message_t msg;
+    if (!socket.recv(msg, zmq::recv_flags::none)) {
+        return false;
+    }
+    reply = msg.to_string();
+    return true;
+}
+
+/**
+ * Directory of the direct link endpoints of the cores connected to an
+ * AuroraEmuSwitch. Requests consist of a command, the core id and, for
+ * register and unregister, the endpoint of the core. A lookup returns the
+ * endpoint, an empty string if the id is not registered yet, or
+ * DIRECTORY_SWITCHED if several cores share the id and the switch has to
+ * multicast their messages.
+ *
+ * Ids that are not registered are looked up in the directories of the peer
+ * switches, which answer from their own registrations only, so direct links
+ * also connect cores of different switches.
+ */
+class AuroraEmuDirectory {
    private:
-    // ZMQ sockets used to exchange data between Aurora cores
     zmq::context_t ctx;
-    zmq::socket_t to_switch;
+    zmq::socket_t service;
+
+    // ZMQ socket used to terminate the directory thread
+    zmq::socket_t kill_socket;
+    zmq::socket_t kill_listener;
+
+    std::thread directory_thread;
+
+    // endpoints of all cores registered with an id
+    std::map<std::string, std::vector<std::string>> endpoints;
+
+    // directories of the peer switches, added while serving
+    std::mutex peers_mutex;
+    std::vector<std::string> peers;
+
+    /**
+     * Look up an id in the directories of the peers, which reply with the
+     * endpoints of their own cores. Other requests are served from the
+     * local registrations in the meantime, so directories that look up in
+     * each other do not block.
+     */
+    std::vector<std::string> lookup_peers(const std::string &id) {
+        std::vector<std::string> peer_directories;
+        {
+            std::lock_guard<std::mutex> lock(peers_mutex);
+            peer_directories = peers;
+        }
+        std::vector<zmq::socket_t> sockets;
+        std::vector<zmq::pollitem_t> items = {{service, 0, ZMQ_POLLIN, 0}};
+        for (const std::string &peer : peer_directories) {
+            zmq::socket_t socket(ctx, zmq::socket_type::req);
+            socket.set(zmq::sockopt::linger, 0);
+            socket.connect(peer);
+            std::vector<std::string> request = {DIRECTORY_LOOKUP, id,
+                                                DIRECTORY_LOCAL};
+            for (size_t i = 0; i < request.size(); i++) {
+                zmq::message_t msg(request[i]);
+                socket.send(msg, i + 1 < request.size()
+                                     ? zmq::send_flags::sndmore
+                                     : zmq::send_flags::none);
+            }
+            sockets.push_back(std::move(socket));
+        }
+        for (zmq::socket_t &socket : sockets) {
+            items.push_back({socket, 0, ZMQ_POLLIN, 0});
+        }
+        std::vector<std::string> found;
+        size_t pending = sockets.size();
+        // reply to the core before it stops waiting
+        auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(DIRECTORY_TIMEOUT / 2);
+        while (pending > 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            if (left.count() <= 0) {
+                break;
+            }
+            zmq::poll(items.data(), items.size(), left);
+            if (items[0].revents & ZMQ_POLLIN) {
+                serve_request(false);
+            }
+            for (size_t i = 0; i < sockets.size(); i++) {
+                if (items[i + 1].revents & ZMQ_POLLIN) {
+                    zmq::message_t msg;
+                    auto result = sockets[i].recv(msg, zmq::recv_flags::none);
+                    if (msg.size() > 0) {
+                        found.push_back(msg.to_string());
+                    }
+                    items[i + 1].events = 0;
+                    pending--;
+                }
+            }
+        }
+        return found;
+    }
+
+    std::string handle(const std::vector<std::string> &request,
+                       bool federated) {
+        if (request.size() >= 2 && request.size() <= 3 &&
+            request[0] == DIRECTORY_LOOKUP) {
+            std::vector<std::string> found;
+            auto it = endpoints.find(request[1]);
+            if (it != endpoints.end()) {
+                found = it->second;
+            } else if (federated && request.size() == 2) {
+                found = lookup_peers(request[1]);
+            }
+            if (found.empty()) {
+                return "";
+            }
+            return found.size() == 1 ? found[0] : DIRECTORY_SWITCHED;
+        }
+        if (request.size() == 3 && request[0] == DIRECTORY_REGISTER) {
+            endpoints[request[1]].push_back(request[2]);
+        } else if (request.size() == 3 && request[0] == DIRECTORY_UNREGISTER) {
+            std::vector<std::string> &e = endpoints[request[1]];
+            e.erase(std::remove(e.begin(), e.end(), request[2]), e.end());
+            if (e.empty()) {
+                endpoints.erase(request[1]);
+            }
+        }
+        return "";
+    }
+
+    /**
+     * Receive a request of a REQ socket and reply to it. Requests are
+     * preceded by the id of the client and an empty frame.
+     */
+    void serve_request(bool federated) {
+        zmq::message_t client;
+        zmq::message_t msg;
+        auto result = service.recv(client, zmq::recv_flags::none);
+        std::vector<std::string> request;
+        bool more = client.more();
+        bool delimiter = true;
+        while (more) {
+            result = service.recv(msg, zmq::recv_flags::none);
+            more = msg.more();
+            if (delimiter) {
+                delimiter = false;
+                continue;
+            }
+            request.push_back(msg.to_string());
+        }
+        std::string r = handle(request, federated);
+        zmq::message_t empty(0);
+        zmq::message_t reply(r);
+        service.send(client, zmq::send_flags::sndmore);
+        service.send(empty, zmq::send_flags::sndmore);
+        service.send(reply, zmq::send_flags::none);
+    }
+
+    void serve() {
+        zmq::pollitem_t items[] = {{service, 0, ZMQ_POLLIN, 0},
+                                   {kill_listener, 0, ZMQ_POLLIN, 0}};
+        while (true) {
+            zmq::poll(&items[0], 2);
+            if (items[0].revents & ZMQ_POLLIN) {
+                serve_request(true);
+            }
+            if (items[1].revents & ZMQ_POLLIN) {
+                break;
+            }
+        }
+    }
+
+   public:
+    AuroraEmuDirectory(std::string host_address, int port)
+        : ctx(1),
+          service(ctx, zmq::socket_type::router),
+          kill_socket(ctx, zmq::socket_type::pub),
+          kill_listener(ctx, zmq::socket_type::sub) {
+        std::string kill_id = "inproc://kill_directory";
+        service.bind("tcp://" + host_address + ":" + std::to_string(port));
+        kill_socket.bind(kill_id);
+        kill_listener.connect(kill_id);
+        kill_listener.set(zmq::sockopt::subscribe, "");
+        directory_thread = std::thread(&AuroraEmuDirectory::serve, this);
+    }
+
+    ~AuroraEmuDirectory() {
+        zmq::message_t t(0);
+        kill_socket.send(t, zmq::send_flags::none);
+        directory_thread.join();
+    }
+
+    /**
+     * Look up the ids that are not registered here also in the directory
+     * at endpoint
+     */
+    void add_peer(const std::string &endpoint) {
+        std::lock_guard<std::mutex> lock(peers_mutex);
+        peers.push_back(endpoint);
+    }
+};
+
+/**
+ * Switch that routes the messages of AuroraEmuCores by their destination id.
+ * The destination ids are sharded over a number of workers, so all messages
+ * of a flow pass the same worker and keep their order.
+ */
+class AuroraEmuSwitch {
+   private:
+    std::vector<std::unique_ptr<AuroraEmuSwitchWorker>> workers;
+    std::unique_ptr<AuroraEmuDirectory> directory;
+
+   public:
+    /**
+     * Construct a new aurora switch and do not start threads
+     * to listen for incoming connections. Threads have to be started with
+     * additional call to listen()
+     *
+     */
+    AuroraEmuSwitch() {}
+
+    /**
+     * Construct and connect a new aurora switch and start threads
+     * to listen for new connections
+     *
+     * host_address: IP address or name of the host machine
+     * port: Port of the aurora switch. The ports port to
+     *      port+2*num_workers-1 will be used to establish the switch
+     *      functionality and the num_workers ports after
+     *      port+2*num_workers for the routes announced to peer switches,
+     *      once the switch peers.
+     * num_workers: number of routing threads. The cores have to be
+     *      configured with the same switch_workers.
+     * placement: CPUs the routing threads are pinned to. Empty leaves the
+     *      placement to the OS.
+     * direct_links: serve the directory for cores with direct_links on
+     *      port+2*num_workers. Otherwise that port stays free and such cores
+     *      fail to connect.
+     */
+    AuroraEmuSwitch(std::string host_address, int port, int num_workers = 1,
+                    AuroraEmuPlacement placement = AuroraEmuPlacement(),
+                    bool direct_links = false) {
+        this->listen(host_address, port, num_workers, placement,
+                     direct_links);
+    }
+
+    void listen(std::string host_address, int port, int num_workers = 1,
+                AuroraEmuPlacement placement = AuroraEmuPlacement(),
+                bool direct_links = false) {
+        if (!workers.empty()) {
+            throw std::runtime_error("Switch already running!");
+        }
+        for (int i = 0; i < num_workers; i++) {
+            workers.emplace_back(new AuroraEmuSwitchWorker(
+                host_address, switch_worker_port(port, i),
+                switch_route_port(port, num_workers, i), num_workers,
+                direct_links, placement));
+        }
+        if (direct_links) {
+            directory.reset(new AuroraEmuDirectory(
+                host_address, switch_directory_port(port, num_workers)));
+        }
+    }
+
+    /**
+     * Federate with the switch at host_address:port, e.g. the switch of
+     * another host. Messages of local cores to cores of the peer are passed
+     * to it, while local traffic stays in this switch. The peer learns the
+     * ids of the local cores, so it has to peer with this switch as well.
+     * Every switch of a federation has to peer with all others and use the
+     * same number of workers. Direct links across switches need the
+     * directory on all of them.
+     */
+    void peer(std::string host_address, int port) {
+        if (workers.empty()) {
+            throw std::runtime_error("Switch not running!");
+        }
+        int num_workers = workers.size();
+        std::string host = "tcp://" + host_address + ":";
+        for (int i = 0; i < num_workers; i++) {
+            workers[i]->peer(
+                host + std::to_string(switch_worker_port(port, i)),
+                host + std::to_string(
+                           switch_route_port(port, num_workers, i)));
+        }
+        if (directory) {
+            directory->add_peer(host + std::to_string(switch_directory_port(
+                                           port, num_workers)));
+        }
+    }
+
+    int get_num_workers() const { return workers.size(); }
+
+    /**
+     * Number of messages passed to peer switches
+     */
+    uint64_t get_peer_message_count() const {
+        uint64_t count = 0;
+        for (const auto &worker : workers) {
+            count += worker->get_peer_message_count();
+        }
+        return count;
+    }
+
+    /**
+     * Number of messages to ids without route that were passed to all peers
+     */
+    uint64_t get_flooded_message_count() const {
+        uint64_t count = 0;
+        for (const auto &worker : workers) {
+            count += worker->get_flooded_message_count();
+        }
+        return count;
+    }
+};
+
+/**
+ * Emulated Aurora core connected to an AuroraEmuSwitch. T is the AXI stream
+ * type of the user kernels.
+ */
+template <typename T, typename Stream = hlslib::Stream<T>>
+class BasicAuroraEmuCore : private AuroraEmuReactorTask,
+                           private AuroraEmuSimulationPort {
+   private:
+    typedef typename AxiStreamTraits<T>::data_t data_t;
+
+    // context of the core or of its reactor. Contexts only start their
+    // threads with the first socket, so an unused own context is free
+    zmq::context_t own_ctx;
+    zmq::context_t &ctx;
+
+    // ZMQ sockets used to exchange data between Aurora cores. There is one
+    // socket per switch worker, connected on first use
+    std::vector<zmq::socket_t> to_switch;
     zmq::socket_t from_switch;
+    std::string switch_address;
+    int switch_port;
 
-    // ZMQ socket used to terminate send and recv threads
+    // direct links: the core receives on direct_in and sends to the remote
+    // core on direct_out once the switch directory returned its endpoint
+    zmq::socket_t direct_in;
+    zmq::socket_t direct_out;
+    std::string direct_endpoint;
+    // set by the send thread after the lookup of the remote core
+    bool remote_resolved;
+    // socket of the lookups of a core on a reactor, which must not wait for
+    // the reply of the directory
+    zmq::socket_t lookup;
+
+    // ZMQ socket used to terminate the recv thread
     zmq::socket_t kill_socket;
 
     // send and recv threads used to pass data to and from user kernels
@@ -261,32 +1807,390 @@ class AuroraEmuCore {
     std::thread send_thread;
 
     // streams used to pass data to and from user kernels
-    hlslib::Stream<data_stream_t> &remote_to_user;
-    hlslib::Stream<data_stream_t> &user_to_remote;
+    Stream &remote_to_user;
+    Stream &user_to_remote;
 
     // id that is used to name the socket of the aurora emulator
     // or the network port
     std::string id;
     std::string remote_id;
+    // first two frames of every data message, copied for each message
+    // without building them from the ids again
+    zmq::message_t remote_topic;
+    zmq::message_t own_topic;
+
+    // buffers of the data messages. Declared before the state of the
+    // reactor, which may hold buffers of the pool
+    MessagePoolPtr pool;
+
+    // moves the flits of the core in virtual time if set. No sockets and
+    // threads are used then
+    AuroraEmuSimulation *simulation;
+
+    // runs the core instead of the threads above if set. The state below
+    // is only accessed by the reactor thread of the core
+    AuroraEmuReactor *reactor;
+    // received message that is passed on once it is due
+    zmq::message_t rx_pending;
+    bool has_rx_pending;
+    MessageDelivery rx_delivery;
+    // flits of the last message that did not fit into remote_to_user
+    FlitBacklog<T> rx_backlog;
+    // flits read from user_to_remote for the next message
+    PooledFlits<data_t> tx_batch;
+    PooledFlits<T> tx_frame;
+    std::chrono::steady_clock::time_point tx_flush_deadline;
+    // message held back until it left the paced link
+    zmq::message_t tx_pending;
+    bool has_tx_pending;
+    std::chrono::steady_clock::time_point tx_departure;
+    // time of the next lookup of the remote core for direct links on a
+    // reactor
+    std::chrono::steady_clock::time_point next_lookup;
+
+    // batching options
+    AuroraEmuConfig config;
+
+    // cleared by the destructor to terminate the send thread
+    std::atomic<bool> running;
+    // blocking reads of the send thread from user_to_remote
+    AuroraEmuStreamReader<T, Stream> tx_reader;
+
+    // RX FIFO model and flow control state if NFC is enabled
+    std::unique_ptr<RxFifo<T>> rx_fifo;
+    TxFlowControl tx_flow_control;
+    // passes flits from the RX FIFO model to the user kernel
+    std::thread drain_thread;
+    // serializes data and NFC messages of the send and recv threads
+    std::mutex send_mutex;
+
+    // limits the send rate to the line rate of the link
+    LinkPacer pacer;
+    // core that sent the last received message and cores paused by XOFF.
+    // Only accessed by the recv thread and the NFC callback
+    std::string current_source;
+    std::set<std::string> paused_sources;
+    // content of the last probe returned by the switch
+    std::string switch_probe_reply;
+
+    // status and counters at the addresses of the hardware core
+    AuroraEmuRegisters registers;
+
+    // records the received flits if trace_file is set
+    std::unique_ptr<FlitTraceWriter<T>> trace;
+
+    // samples the latency of the flits sent and received over ZMQ
+    AuroraEmuLatencyTrace latency;
+
+    /**
+     * Socket to the switch worker that routes the messages to destination.
+     * Has to be called with send_mutex held.
+     */
+    zmq::socket_t &switch_socket(const std::string &destination) {
+        int worker = switch_worker(destination, to_switch.size());
+        zmq::socket_t &socket = to_switch[worker];
+        if (!socket) {
+            socket = zmq::socket_t(ctx, zmq::socket_type::push);
+            socket.set(zmq::sockopt::sndhwm, 0);
+            socket.connect("tcp://" + switch_address + ":" +
+                           std::to_string(switch_worker_port(switch_port,
+                                                             worker)));
+        }
+        return socket;
+    }
+
+    void send_nfc(const std::string &destination, uint16_t nfc) {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        zmq::socket_t &socket = switch_socket(destination);
+        zmq::message_t a_id(destination);
+        zmq::message_t own_id(id);
+        zmq::message_t msg(static_cast<void *>(&nfc), sizeof(nfc));
+        socket.send(a_id, zmq::send_flags::sndmore);
+        socket.send(own_id, zmq::send_flags::sndmore);
+        socket.send(msg, zmq::send_flags::none);
+    }
+
+    // called by the RX FIFO model with its lock held
+    void send_nfc(uint16_t nfc) {
+        if (nfc == NFC_XOFF) {
+            paused_sources.insert(current_source);
+            send_nfc(current_source, nfc);
+        } else {
+            for (const std::string &source : paused_sources) {
+                send_nfc(source, nfc);
+            }
+            paused_sources.clear();
+        }
+    }
+
+    void forward_from_rx_fifo() {
+        T data;
+        while (rx_fifo->read(data, running)) {
+            remote_to_user.write(data);
+        }
+    }
+
+    /**
+     * Send a request to the switch directory. Returns false if the switch
+     * did not reply within DIRECTORY_TIMEOUT.
+     */
+    bool directory_request(const std::vector<std::string> &request,
+                           std::string &reply) {
+        return send_directory_request(
+            ctx,
+            "tcp://" + switch_address + ":" +
+                std::to_string(switch_directory_port(switch_port,
+                                                     config.switch_workers)),
+            request, reply);
+    }
+
+    /**
+     * Bind the socket of the direct link to a free port and set the endpoint
+     * other cores connect to
+     */
+    void bind_direct_link() {
+        std::string address = config.direct_address;
+        if (address.empty()) {
+            char host[256] = {0};
+            gethostname(host, sizeof(host) - 1);
+            address = host;
+        }
+        direct_in = zmq::socket_t(ctx, zmq::socket_type::pull);
+        direct_in.set(zmq::sockopt::rcvhwm, 0);
+        direct_in.bind("tcp://" +
+                       (config.direct_address.empty() ? std::string("*")
+                                                      : config.direct_address) +
+                       ":*");
+        std::string bound = direct_in.get(zmq::sockopt::last_endpoint);
+        direct_endpoint = "tcp://" + address + bound.substr(bound.rfind(':'));
+    }
+
+    /**
+     * Look up the remote core in the switch directory once and connect the
+     * direct link to it. Returns false if the remote core is not registered
+     * yet.
+     */
+    bool try_resolve_remote() {
+        std::string endpoint;
+        return directory_request({DIRECTORY_LOOKUP, remote_id}, endpoint) &&
+               connect_remote(endpoint);
+    }
+
+    /**
+     * Look up the remote core for a core on a reactor without blocking. A
+     * request is sent on the lookup socket and the reply is taken on a later
+     * step. Replies of older requests answer the same lookup, so they are
+     * used as well. Returns true once the remote core is resolved.
+     */
+    bool poll_resolve_remote(std::chrono::steady_clock::time_point now) {
+        zmq::message_t delimiter;
+        zmq::message_t reply;
+        while (lookup.recv(delimiter, zmq::recv_flags::dontwait)) {
+            // the reply follows the empty frame of the router
+            auto result = lookup.recv(reply, zmq::recv_flags::none);
+            if (connect_remote(reply.to_string())) {
+                return true;
+            }
+            // not registered yet, ask again soon
+            next_lookup =
+                now + std::chrono::milliseconds(DIRECTORY_RETRY_INTERVAL);
+        }
+        if (now >= next_lookup) {
+            std::vector<std::string> request = {"", DIRECTORY_LOOKUP,
+                                                remote_id};
+            for (size_t i = 0; i < request.size(); i++) {
+                zmq::message_t msg(request[i]);
+                lookup.send(msg, i + 1 < request.size()
+                                     ? zmq::send_flags::sndmore
+                                     : zmq::send_flags::none);
+            }
+            // ask again if the directory did not reply
+            next_lookup = now + std::chrono::milliseconds(DIRECTORY_TIMEOUT);
+        }
+        return false;
+    }
+
+    /**
+     * Connect the direct link to the endpoint returned by the directory.
+     * Multicast ids keep using the switch. Returns false if the remote core
+     * is not registered yet.
+     */
+    bool connect_remote(const std::string &endpoint) {
+        if (endpoint.empty()) {
+            return false;
+        }
+        if (endpoint != DIRECTORY_SWITCHED) {
+            std::lock_guard<std::mutex> lock(send_mutex);
+            direct_out = zmq::socket_t(ctx, zmq::socket_type::push);
+            direct_out.set(zmq::sockopt::sndhwm, 0);
+            direct_out.connect(endpoint);
+        }
+        remote_resolved = true;
+        return true;
+    }
+
+    /**
+     * Look up the remote core and connect the direct link to it. Blocks
+     * until the remote core is registered.
+     */
+    void resolve_remote() {
+        while (running && !try_resolve_remote()) {
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(DIRECTORY_RETRY_INTERVAL));
+        }
+    }
+
+    // register the endpoint of the direct link, retries until the switch
+    // is up
+    void register_direct_link() {
+        std::string reply;
+        while (running &&
+               !directory_request({DIRECTORY_REGISTER, id, direct_endpoint},
+                                  reply)) {
+        }
+    }
+
+    /**
+     * Receive the remaining frames of a message on the given socket after
+     * its topic. Returns true for the probes of the handshake, which are
+     * dropped after their content was stored in switch_probe_reply.
+     */
+    bool receive_message(zmq::socket_t &socket, zmq::message_t &msg) {
+        // receive id of the sending core
+        zmq::message_t source;
+        auto result = socket.recv(source, zmq::recv_flags::none);
+        // receive actual message
+        result = socket.recv(msg, zmq::recv_flags::none);
+        if (source.size() == 0) {
+            switch_probe_reply = msg.to_string();
+            return true;
+        }
+        // reuses the memory of the string
+        current_source.assign(static_cast<const char *>(source.data()),
+                              source.size());
+        if (reactor != nullptr) {
+            // passed on by reactor_step() once it is due
+            rx_delivery = receive_delivery(socket, msg, latency.rx_sample());
+            latency.receive();
+            rx_pending.move(msg);
+            has_rx_pending = true;
+            return false;
+        }
+        wait_for_delivery(socket, msg, latency.rx_sample());
+        latency.receive();
+        if (msg.size() == sizeof(uint16_t)) {
+            // flow control message of the remote core
+            tx_flow_control.receive(*static_cast<const uint16_t *>(msg.data()));
+        } else {
+            receive_flits(msg, rx_fifo.get(), remote_to_user, registers,
+                          config.framing, trace.get(),
+                          trace ? flit_trace_source(current_source) : 0);
+            latency.dequeue();
+        }
+        // let ZMQ reuse its receive buffer while the thread waits
+        msg.rebuild();
+        return false;
+    }
+
+    /**
+     * Receive a message from the switch. Returns true if it was a probe
+     * sent to this core.
+     */
+    bool receive_from_switch(zmq::message_t &msg) {
+        // receive aurora id of incoming message
+        auto result = from_switch.recv(msg, zmq::recv_flags::none);
+        return receive_from_switch_topic(msg);
+    }
+
+    // receive the rest of a message from the switch after its topic
+    bool receive_from_switch_topic(zmq::message_t &msg) {
+        // subscriptions match prefixes, so drop messages for other ids like
+        // a10 for a1
+        if (message_is(msg, id)) {
+            return receive_message(from_switch, msg);
+        }
+        while (msg.more()) {
+            auto result = from_switch.recv(msg, zmq::recv_flags::none);
+        }
+        return false;
+    }
+
+    /**
+     * Send probes with an empty source to the own id over the switch until
+     * one of them comes back. Then the subscription is live at the switch
+     * worker that routes all messages to this core, so none of them can get
+     * lost. Messages of other cores that arrive in the meantime are passed
+     * on. Throws if no probe came back within handshake_timeout_ms, if the
+     * switch has a different number of workers than switch_workers in the
+     * config, or does not serve the directory needed for direct_links.
+     */
+    void wait_for_subscription() {
+        zmq::message_t msg;
+        zmq::pollitem_t items[] = {{from_switch, 0, ZMQ_POLLIN, 0}};
+        auto deadline = std::chrono::steady_clock::now() +
+                        std::chrono::milliseconds(config.handshake_timeout_ms);
+        while (true) {
+            if (std::chrono::steady_clock::now() >= deadline) {
+                throw std::runtime_error(
+                    "Core " + id + " got no reply from the switch at " +
+                    switch_address + ":" + std::to_string(switch_port));
+            }
+            {
+                std::lock_guard<std::mutex> lock(send_mutex);
+                zmq::socket_t &socket = switch_socket(id);
+                zmq::message_t a_id(id);
+                zmq::message_t no_source(0);
+                zmq::message_t probe(0);
+                socket.send(a_id, zmq::send_flags::sndmore);
+                socket.send(no_source, zmq::send_flags::sndmore);
+                socket.send(probe, zmq::send_flags::none);
+            }
+            zmq::poll(&items[0], 1,
+                      std::chrono::milliseconds(HANDSHAKE_INTERVAL));
+            if ((items[0].revents & ZMQ_POLLIN) && receive_from_switch(msg)) {
+                break;
+            }
+        }
+        std::string workers =
+            switch_probe_reply.substr(0, switch_probe_reply.find(' '));
+        if (workers != std::to_string(config.switch_workers)) {
+            throw std::runtime_error(
+                "Core " + id + " uses " +
+                std::to_string(config.switch_workers) +
+                " switch workers, but the switch has " + workers);
+        }
+        if (config.direct_links &&
+            switch_probe_reply.find(SWITCH_DIRECT_LINKS) ==
+                std::string::npos) {
+            throw std::runtime_error("Core " + id +
+                                     " uses direct links, but the switch "
+                                     "does not serve them");
+        }
+    }
 
     void forward_from_remote() {
         zmq::socket_t kill_listener(ctx, zmq::socket_type::sub);
         kill_listener.connect("inproc://kill_" + id);
         kill_listener.set(zmq::sockopt::subscribe, "");
+        if (config.direct_links) {
+            register_direct_link();
+        }
         zmq::message_t msg;
-        // listen to kill signals and data coming in
+        // listen to kill signals and data coming in. The direct link is only
+        // polled if it is enabled
         zmq::pollitem_t items[] = {{from_switch, 0, ZMQ_POLLIN, 0},
-                                   {kill_listener, 0, ZMQ_POLLIN, 0}};
-        while (true) {
-            zmq::poll(&items[0], 2);
+                                   {kill_listener, 0, ZMQ_POLLIN, 0},
+                                   {direct_in, 0, ZMQ_POLLIN, 0}};
+        while (running) {
+            zmq::poll(&items[0], config.direct_links ? 3 : 2,
+                      std::chrono::milliseconds(KILL_CHECK_INTERVAL));
             if (items[0].revents & ZMQ_POLLIN) {
-                // receive aurora id of incoming message. Discard
-                auto result = from_switch.recv(msg, zmq::recv_flags::none);
-                // receive actual message
-                result = from_switch.recv(msg, zmq::recv_flags::none);
-                data_stream_t data;
-                data.data = *static_cast<ap_uint<512> *>(msg.data());
-                remote_to_user.write(data);
+                receive_from_switch(msg);
+            }
+            if (config.direct_links && (items[2].revents & ZMQ_POLLIN)) {
+                // aurora id of the message, always the own one
+                auto result = direct_in.recv(msg, zmq::recv_flags::none);
+                receive_message(direct_in, msg);
             }
             if (items[1].revents & ZMQ_POLLIN) {
                 break;
@@ -295,29 +2199,231 @@ class AuroraEmuCore {
     }
 
     void forward_from_user() {
-        zmq::socket_t kill_listener(ctx, zmq::socket_type::sub);
-        kill_listener.connect("inproc://kill_" + id);
-        kill_listener.set(zmq::sockopt::subscribe, "");
+        PooledFlits<data_t> batch(*pool);
+        // flits including their side channels for framing
+        PooledFlits<T> frame(*pool);
         while (true) {
-            // check if stream is empty. If so, sleep a bit to reduce CPU load
-            while (user_to_remote.empty()) {
-                std::this_thread::sleep_for(
-                    std::chrono::milliseconds(RECV_POLL_INTERVAL));
-                // check for kill signals in between
-                zmq::message_t m;
-                if (kill_listener.recv(m, zmq::recv_flags::dontwait)
-                        .has_value()) {
+            // wait until the user kernel writes data or the destructor
+            // clears running
+            T first;
+            if (!tx_reader.read(first)) {
+                return;
+            }
+            latency.enqueue();
+            // forward incoming data to remote core
+            if (config.framing) {
+                collect_frame(tx_reader, first, frame, config);
+            } else {
+                collect_batch(user_to_remote, first, batch, config);
+            }
+            if (!running) {
+                return;
+            }
+            size_t count = config.framing ? frame.size() : batch.size();
+            registers.add(AuroraEmuRegisters::TX_COUNT_ADDRESS, count);
+            if (config.nfc) {
+                tx_flow_control.wait(running);
+            }
+            // the flits are sent from the pool buffer without a copy
+            zmq::message_t msg =
+                config.framing ? frame.message() : batch.message();
+            if (config.direct_links && !remote_resolved) {
+                resolve_remote();
+                if (!running) {
                     return;
                 }
             }
-            // forward incoming data to user kernel
-            ap_uint<512> data = user_to_remote.read().data;
-            zmq::message_t msg(static_cast<void *>(&data),
-                               sizeof(ap_uint<512>));
-            zmq::message_t a_id(remote_id);
-            to_switch.send(a_id, zmq::send_flags::sndmore);
-            to_switch.send(msg, zmq::send_flags::none);
+            send_data(msg,
+                      pacer.pace(count * AxiStreamTraits<T>::width_bytes()));
+        }
+    }
+
+    /**
+     * Send a data message to the remote core that left the link at
+     * departure
+     */
+    void send_data(zmq::message_t &msg,
+                   std::chrono::steady_clock::time_point departure) {
+        zmq::message_t a_id;
+        zmq::message_t own_id;
+        a_id.copy(remote_topic);
+        own_id.copy(own_topic);
+        std::lock_guard<std::mutex> lock(send_mutex);
+        zmq::socket_t &socket =
+            direct_out ? direct_out : switch_socket(remote_id);
+        socket.send(a_id, zmq::send_flags::sndmore);
+        socket.send(own_id, zmq::send_flags::sndmore);
+        send_delivered(socket, msg, departure, config, latency.send());
+    }
+
+    std::vector<zmq::socket_t *> reactor_sockets() override {
+        std::vector<zmq::socket_t *> sockets = {&from_switch};
+        if (config.direct_links) {
+            sockets.push_back(&direct_in);
+            sockets.push_back(&lookup);
+        }
+        return sockets;
+    }
+
+    /**
+     * Receive path on the reactor. A new message is only received once all
+     * flits of the last one were passed to the user kernel or the RX FIFO,
+     * so a full stream or FIFO stops the core from reading its sockets,
+     * like the recv thread.
+     */
+    bool reactor_receive() {
+        bool progress = false;
+        T data;
+        if (rx_fifo) {
+            while (!remote_to_user.full() && rx_fifo->try_read(data)) {
+                remote_to_user.write(data);
+                progress = true;
+            }
+            while (!rx_backlog.empty() &&
+                   rx_fifo->try_write(rx_backlog.front())) {
+                rx_backlog.pop_front();
+                progress = true;
+            }
+        } else {
+            while (!rx_backlog.empty() && !remote_to_user.full()) {
+                remote_to_user.write(rx_backlog.front());
+                rx_backlog.pop_front();
+                progress = true;
+            }
+        }
+        if (!rx_backlog.empty()) {
+            return progress;
+        }
+        // all flits of the last message were passed to the user kernel
+        latency.dequeue();
+        if (!has_rx_pending) {
+            zmq::message_t msg;
+            if (from_switch.recv(msg, zmq::recv_flags::dontwait)) {
+                receive_from_switch_topic(msg);
+            } else if (config.direct_links &&
+                       direct_in.recv(msg, zmq::recv_flags::dontwait)) {
+                // aurora id of the message, always the own one
+                receive_message(direct_in, msg);
+            } else {
+                return progress;
+            }
+            progress = true;
+        }
+        if (has_rx_pending) {
+            if (!rx_delivery.due()) {
+                // wait for the delivery time of the paced link
+                return true;
+            }
+            if (rx_pending.size() == sizeof(uint16_t)) {
+                // flow control message of the remote core
+                tx_flow_control.receive(
+                    *static_cast<const uint16_t *>(rx_pending.data()));
+            } else {
+                // the flits move on to the RX FIFO from the backlog
+                receive_flits(rx_pending, static_cast<RxFifo<T> *>(nullptr),
+                              rx_backlog, registers, config.framing,
+                              trace.get(),
+                              trace ? flit_trace_source(current_source) : 0);
+            }
+            rx_pending.rebuild();
+            has_rx_pending = false;
         }
+        return progress;
+    }
+
+    /**
+     * Send path on the reactor. Flits are collected over several steps
+     * until the batch or frame is complete, like in forward_from_user().
+     */
+    bool reactor_send() {
+        auto now = std::chrono::steady_clock::now();
+        if (has_tx_pending) {
+            if (now < tx_departure) {
+                return true;
+            }
+            send_data(tx_pending, tx_departure);
+            has_tx_pending = false;
+        }
+        if (config.nfc && tx_flow_control.paused()) {
+            return false;
+        }
+        bool progress = false;
+        size_t count = config.framing ? tx_frame.size() : tx_batch.size();
+        bool complete = false;
+        T data;
+        while (!complete && user_to_remote.read_nb(data)) {
+            if (count == 0) {
+                tx_flush_deadline =
+                    now + std::chrono::microseconds(config.flush_timeout_us);
+                latency.enqueue();
+            }
+            if (config.framing) {
+                tx_frame.push_back(data);
+                complete = data.last || tx_frame.size() >= config.max_frame_size;
+            } else {
+                append_flit(tx_batch, data);
+                complete = tx_batch.size() >= config.max_batch_size;
+            }
+            count++;
+            progress = true;
+        }
+        if (count == 0) {
+            return progress;
+        }
+        if (!complete && (config.framing || now < tx_flush_deadline)) {
+            // wait for the rest of the frame or the flush timeout
+            return true;
+        }
+        if (config.direct_links && !remote_resolved &&
+            !poll_resolve_remote(now)) {
+            return true;
+        }
+        registers.add(AuroraEmuRegisters::TX_COUNT_ADDRESS, count);
+        zmq::message_t msg =
+            config.framing ? tx_frame.message() : tx_batch.message();
+        auto departure = config.pacing
+                             ? pacer.reserve(count *
+                                             AxiStreamTraits<T>::width_bytes())
+                             : now;
+        if (departure > now) {
+            tx_pending.move(msg);
+            tx_departure = departure;
+            has_tx_pending = true;
+        } else {
+            send_data(msg, departure);
+        }
+        return true;
+    }
+
+    bool reactor_step() override {
+        bool received = reactor_receive();
+        return reactor_send() || received;
+    }
+
+    bool sim_read(std::string &flit) override {
+        T data;
+        if (!user_to_remote.read_nb(data)) {
+            return false;
+        }
+        flit.assign(reinterpret_cast<const char *>(&data), sizeof(T));
+        registers.add(AuroraEmuRegisters::TX_COUNT_ADDRESS, 1);
+        return true;
+    }
+
+    bool sim_write(const std::string &flit, const std::string &source,
+                   double time_ns) override {
+        if (remote_to_user.full()) {
+            return false;
+        }
+        T data;
+        std::memcpy(static_cast<void *>(&data), flit.data(), sizeof(T));
+        remote_to_user.write(data);
+        registers.add(AuroraEmuRegisters::RX_COUNT_ADDRESS, 1);
+        if (trace) {
+            trace->append(data, flit_trace_source(source),
+                          static_cast<int64_t>(time_ns));
+        }
+        return true;
     }
 
    public:
@@ -331,43 +2437,204 @@ class AuroraEmuCore {
      * remote_id: ID of the aurora core to connect to
      * user_to_remote: AXI stream to pass data into the aurora core
      * remote_to_user: AXI stream to read data from the aurora core
+     * config: batching options of the core
      */
-    AuroraEmuCore(std::string switch_address, int switch_port, std::string id,
-                  std::string remote_id,
-                  hlslib::Stream<data_stream_t> &user_to_remote,
-                  hlslib::Stream<data_stream_t> &remote_to_user)
-        : ctx(1),
-          to_switch(ctx, zmq::socket_type::push),
+    BasicAuroraEmuCore(std::string switch_address, int switch_port,
+                       std::string id, std::string remote_id,
+                       Stream &user_to_remote,
+                       Stream &remote_to_user,
+                       AuroraEmuConfig config = AuroraEmuConfig())
+        : own_ctx(1),
+          ctx(config.reactor ? config.reactor->context() : own_ctx),
+          to_switch(config.switch_workers),
           from_switch(ctx, zmq::socket_type::sub),
-          kill_socket(ctx, zmq::socket_type::pub),
-          user_to_remote(user_to_remote),
+          switch_address(switch_address),
+          switch_port(switch_port),
+          remote_resolved(false),
           remote_to_user(remote_to_user),
+          user_to_remote(user_to_remote),
           id(id),
-          remote_id(remote_id) {
-        kill_socket.bind("inproc://kill_" + id);
-        to_switch.connect("tcp://" + switch_address + ":" +
-                          std::to_string(switch_port));
-        from_switch.connect("tcp://" + switch_address + ":" +
-                            std::to_string(switch_port + 1));
+          remote_id(remote_id),
+          remote_topic(remote_id),
+          own_topic(id),
+          pool(MessagePool::create(max_message_size<T>(config),
+                                    MESSAGE_POOL_BUFFERS,
+                                    config.placement.memory_node())),
+          simulation(config.simulation),
+          reactor(config.simulation ? nullptr : config.reactor),
+          has_rx_pending(false),
+          tx_batch(*pool),
+          tx_frame(*pool),
+          has_tx_pending(false),
+          config(config),
+          running(true),
+          tx_reader(user_to_remote, running),
+          tx_flow_control(config.nfc_latency_us),
+          pacer(config.pacing ? config.line_rate_gbps : 0,
+                config.encoding_efficiency),
+          registers(AxiStreamTraits<T>::width_bytes(), config.rx_fifo_depth,
+                    config.rx_fifo_prog_full, config.rx_fifo_prog_empty,
+                    config.framing, config.framing),
+          latency(config.latency_sample_interval) {
+        if (!config.trace_file.empty()) {
+            trace.reset(new FlitTraceWriter<T>(config.trace_file));
+        }
+        if (simulation != nullptr) {
+            simulation->add(*this, id, remote_id,
+                            AxiStreamTraits<T>::width_bytes(),
+                            {config.line_rate_gbps, config.encoding_efficiency,
+                             config.link_latency_ns, config.nfc,
+                             config.rx_fifo_prog_full,
+                             config.rx_fifo_prog_empty, config.nfc_latency_us});
+            return;
+        }
+        if (reactor == nullptr) {
+            kill_socket = zmq::socket_t(ctx, zmq::socket_type::pub);
+            kill_socket.bind("inproc://kill_" + id);
+        }
+        if (config.nfc) {
+            rx_fifo.reset(new RxFifo<T>(
+                config.rx_fifo_depth, config.rx_fifo_prog_full,
+                config.rx_fifo_prog_empty,
+                [this](uint16_t nfc) { send_nfc(nfc); }));
+            if (reactor == nullptr) {
+                std::thread t(&BasicAuroraEmuCore::forward_from_rx_fifo, this);
+                config.placement.apply(t);
+                drain_thread.swap(t);
+            }
+        }
+        {
+            std::lock_guard<std::mutex> lock(send_mutex);
+            switch_socket(remote_id);
+        }
+        from_switch.set(zmq::sockopt::rcvhwm, 0);
+        // the worker of the own id publishes all messages to this core
+        int worker = switch_worker(id, config.switch_workers);
+        from_switch.connect(
+            "tcp://" + switch_address + ":" +
+            std::to_string(switch_worker_port(switch_port, worker) + 1));
         from_switch.set(zmq::sockopt::subscribe, id);
-        std::thread t1(&AuroraEmuCore::forward_from_remote, this);
-        std::thread t2(&AuroraEmuCore::forward_from_user, this);
+        if (config.direct_links) {
+            bind_direct_link();
+        }
+        // blocks until the switch is up
+        try {
+            wait_for_subscription();
+        } catch (...) {
+            running = false;
+            if (drain_thread.joinable()) {
+                rx_fifo->stop();
+                drain_thread.join();
+            }
+            // drop the probes that no switch will take
+            for (zmq::socket_t &socket : to_switch) {
+                if (socket) {
+                    socket.set(zmq::sockopt::linger, 0);
+                }
+            }
+            throw;
+        }
+        if (reactor != nullptr) {
+            if (config.direct_links) {
+                register_direct_link();
+                lookup = zmq::socket_t(ctx, zmq::socket_type::dealer);
+                lookup.set(zmq::sockopt::linger, 0);
+                lookup.connect("tcp://" + switch_address + ":" +
+                               std::to_string(switch_directory_port(
+                                   switch_port, config.switch_workers)));
+            }
+            reactor->add(*this);
+            return;
+        }
+        std::thread t1(&BasicAuroraEmuCore::forward_from_remote, this);
+        std::thread t2(&BasicAuroraEmuCore::forward_from_user, this);
+        config.placement.apply(t1);
+        config.placement.apply(t2);
         recv_thread.swap(t1);
         send_thread.swap(t2);
-        std::this_thread::sleep_for(
-            std::chrono::milliseconds(RECV_POLL_INTERVAL));
     }
 
-    ~AuroraEmuCore() {
+    ~BasicAuroraEmuCore() {
+        if (simulation != nullptr) {
+            simulation->remove(*this);
+            return;
+        }
+        if (reactor != nullptr) {
+            reactor->remove(*this);
+        }
         // send kill signal to all threads
         // and wait for them to join
-        zmq::message_t t(0);
-        kill_socket.send(t, zmq::send_flags::none);
+        running = false;
+        tx_reader.stop();
+        if (kill_socket) {
+            zmq::message_t t(0);
+            kill_socket.send(t, zmq::send_flags::none);
+        }
+        tx_flow_control.wake();
+        if (rx_fifo) {
+            // the recv thread may wait for space in the RX FIFO
+            rx_fifo->stop();
+        }
         if (recv_thread.joinable()) {
             recv_thread.join();
         }
+        if (drain_thread.joinable()) {
+            drain_thread.join();
+        }
         if (send_thread.joinable()) {
             send_thread.join();
         }
+        if (config.direct_links) {
+            // single attempt, the switch may already be gone
+            std::string reply;
+            directory_request({DIRECTORY_UNREGISTER, id, direct_endpoint},
+                              reply);
+        }
+        latency.report(config.latency_report, id);
+    }
+
+    /**
+     * Latency histograms of the flits received over ZMQ, nullptr unless the
+     * library is built with AURORAEMU_LATENCY_TRACE
+     */
+    const LatencyHistograms *get_latency_histograms() const {
+        return latency.histograms();
+    }
+
+    uint32_t get_nfc_full_trigger_count() {
+        return rx_fifo ? rx_fifo->full_trigger_count.load() : 0;
+    }
+
+    uint32_t get_nfc_empty_trigger_count() {
+        return rx_fifo ? rx_fifo->empty_trigger_count.load() : 0;
+    }
+
+    // maximum number of flits received after sending XOFF
+    uint32_t get_nfc_latency_count() {
+        return rx_fifo ? rx_fifo->max_latency.load() : 0;
+    }
+
+    uint32_t get_fifo_rx_overflow_count() {
+        return rx_fifo ? rx_fifo->overflow_count.load() : 0;
+    }
+
+    // true if the data is sent directly to the remote core
+    bool has_direct_link() {
+        std::lock_guard<std::mutex> lock(send_mutex);
+        return static_cast<bool>(direct_out);
+    }
+
+    /**
+     * Read the register at the given address of the control s axi interface
+     * of the hardware core, e.g. TX_COUNT_ADDRESS
+     */
+    uint32_t read_register(uint32_t address) {
+        return read_core_register(registers, rx_fifo.get(), address);
+    }
+
+    void write_register(uint32_t address, uint32_t value) {
+        write_core_register(registers, rx_fifo.get(), address, value);
     }
 };
+
+typedef BasicAuroraEmuCore<data_stream_t> AuroraEmuCore;
@@ -0,0 +1,298 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// list of the online CPUs in sysfs
+const std::string CPU_ONLINE_PATH = "/sys/devices/system/cpu/online";
+// directory of the NUMA nodes in sysfs
+const std::string NUMA_NODE_PATH = "/sys/devices/system/node/node";
+// highest NUMA node that memory can be bound to
+const int NUMA_MAX_NODES = 1024;
+
+/**
+ * Parse a CPU list of the kernel like "0-3,8,10-11"
+ */
+inline std::vector<int> parse_cpu_list(const std::string &list) {
+    std::vector<int> cpus;
+    std::istringstream s(list);
+    std::string range;
+    while (std::getline(s, range, ',')) {
+        size_t dash = range.find('-');
+        try {
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos
+                           ? first
+                           : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        } catch (const std::exception &) {
+            // empty lists of nodes without CPUs
+        }
+    }
+    return cpus;
+}
+
+/**
+ * CPUs that are online. The process may be limited to a part of them, e.g.
+ * by taskset or a cgroup.
+ */
+inline std::vector<int> online_cpus() {
+    std::ifstream f(CPU_ONLINE_PATH);
+    std::string list;
+    if (f.good() && std::getline(f, list)) {
+        return parse_cpu_list(list);
+    }
+    std::vector<int> cpus;
+    for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++) {
+        cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+/**
+ * Number of NUMA nodes of the machine. Machines without NUMA support in
+ * the kernel have a single node.
+ */
+inline int numa_node_count() {
+    int count = 0;
+    while (std::ifstream(NUMA_NODE_PATH + std::to_string(count) +
+                         "/cpulist")
+               .good()) {
+        count++;
+    }
+    return count > 0 ? count : 1;
+}
+
+/**
+ * CPUs of a NUMA node. Without NUMA support in the kernel, node 0 has all
+ * online CPUs.
+ */
+inline std::vector<int> numa_node_cpus(int node) {
+    std::ifstream f(NUMA_NODE_PATH + std::to_string(node) + "/cpulist");
+    if (!f.good()) {
+        return node == 0 ? online_cpus() : std::vector<int>();
+    }
+    std::string list;
+    std::getline(f, list);
+    return parse_cpu_list(list);
+}
+
+/**
+ * NUMA node of a CPU, 0 if it is not found
+ */
+inline int numa_node_of_cpu(int cpu) {
+    int count = numa_node_count();
+    for (int node = 0; node < count; node++) {
+        for (int c : numa_node_cpus(node)) {
+            if (c == cpu) {
+                return node;
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Prefer the given NUMA node for the pages of a memory range. The pages are
+ * allocated on the node when they are touched first. Returns false if the
+ * kernel does not support it, the memory is then placed by the default
+ * policy. addr has to be aligned to the page size.
+ */
+inline bool bind_memory_to_node(void *addr, size_t bytes, int node) {
+    if (node < 0 || node >= NUMA_MAX_NODES) {
+        return false;
+    }
+    const size_t bits = 8 * sizeof(unsigned long);
+    unsigned long mask[NUMA_MAX_NODES / bits] = {0};
+    mask[node / bits] = 1UL << (node % bits);
+    return syscall(SYS_mbind, addr, bytes, MPOL_PREFERRED, mask,
+                   NUMA_MAX_NODES, 0) == 0;
+}
+
+/**
+ * Page aligned memory that prefers the given NUMA node, or the default
+ * policy for a negative node. The pages are mapped freshly, so none of
+ * them was placed on another node before the policy is set. Has to be
+ * freed with free_on_node() and the same size.
+ */
+inline void *allocate_on_node(size_t bytes, int node) {
+    size_t size = std::max<size_t>(bytes, 1);
+    void *addr = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+        throw std::bad_alloc();
+    }
+    if (node >= 0 && numa_node_count() > 1) {
+        bind_memory_to_node(addr, size, node);
+    }
+    return addr;
+}
+
+/**
+ * Free memory of allocate_on_node()
+ */
+inline void free_on_node(void *addr, size_t bytes) {
+    munmap(addr, std::max<size_t>(bytes, 1));
+}
+
+/**
+ * Array of n default constructed values in memory of a NUMA node, see
+ * allocate_on_node()
+ */
+template <typename T>
+class NodeArray {
+   private:
+    T *values;
+    size_t n;
+
+   public:
+    NodeArray(size_t n, int node)
+        : values(static_cast<T *>(allocate_on_node(n * sizeof(T), node))),
+          n(n) {
+        for (size_t i = 0; i < n; i++) {
+            new (&values[i]) T();
+        }
+    }
+
+    NodeArray(const NodeArray &) = delete;
+    NodeArray &operator=(const NodeArray &) = delete;
+
+    ~NodeArray() {
+        for (size_t i = 0; i < n; i++) {
+            values[i].~T();
+        }
+        free_on_node(values, n * sizeof(T));
+    }
+
+    T &operator[](size_t i) { return values[i]; }
+
+    const T &operator[](size_t i) const { return values[i]; }
+};
+
+/**
+ * Placement of the threads and buffers of an emulated core or switch. The
+ * threads are pinned to the CPUs of the placement, the message buffers are
+ * allocated on its NUMA node. An empty placement leaves both to the OS.
+ *
+ * To co-locate the forwarding threads of a core with the user kernel that
+ * owns its streams, pin the kernel thread first and create the core with
+ * AuroraEmuPlacement::current() from that thread, e.g.:
+ *
+ *     AuroraEmuPlacement::node(1).apply();
+ *     AuroraEmuConfig config;
+ *     config.placement = AuroraEmuPlacement::current();
+ */
+struct AuroraEmuPlacement {
+    // CPUs the threads may run on. Empty does not pin the threads
+    std::vector<int> cpus;
+    // NUMA node of the buffers, -1 for the node of the first CPU
+    int numa_node = -1;
+
+    /**
+     * All CPUs of a NUMA node
+     */
+    static AuroraEmuPlacement node(int node) {
+        AuroraEmuPlacement placement;
+        placement.cpus = numa_node_cpus(node);
+        placement.numa_node = node;
+        return placement;
+    }
+
+    /**
+     * A single CPU, for cores that should not share a CPU with others
+     */
+    static AuroraEmuPlacement cpu(int cpu) {
+        AuroraEmuPlacement placement;
+        placement.cpus.push_back(cpu);
+        return placement;
+    }
+
+    /**
+     * The CPUs the calling thread is pinned to. If it is not pinned, all
+     * CPUs of the NUMA node it currently runs on.
+     */
+    static AuroraEmuPlacement current() {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0 &&
+            CPU_COUNT(&set) < static_cast<int>(online_cpus().size())) {
+            AuroraEmuPlacement placement;
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) {
+                    placement.cpus.push_back(cpu);
+                }
+            }
+            return placement;
+        }
+        int cpu = sched_getcpu();
+        return node(cpu < 0 ? 0 : numa_node_of_cpu(cpu));
+    }
+
+    bool empty() const { return cpus.empty(); }
+
+    /**
+     * NUMA node the buffers are allocated on, -1 if the placement is empty
+     */
+    int memory_node() const {
+        if (numa_node >= 0 || cpus.empty()) {
+            return numa_node;
+        }
+        return numa_node_of_cpu(cpus.front());
+    }
+
+    /**
+     * Pin a thread to the CPUs. Returns false if the placement is empty or
+     * the thread could not be pinned, e.g. because none of the CPUs is
+     * available to the process.
+     */
+    bool apply(pthread_t thread) const {
+        if (cpus.empty()) {
+            return false;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (int cpu : cpus) {
+            if (cpu >= 0 && cpu < CPU_SETSIZE) {
+                CPU_SET(cpu, &set);
+            }
+        }
+        return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+    }
+
+    bool apply(std::thread &thread) const {
+        return apply(thread.native_handle());
+    }
+
+    // pin the calling thread
+    bool apply() const { return apply(pthread_self()); }
+};
@@ -0,0 +1,325 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "auroraemu.hpp"
+
+// default number of flits a channel may send per round of the scheduler
+const uint32_t CHANNEL_WEIGHT = 16;
+// largest weight, the TLAST flags of a burst are sent in a 64 bit mask
+const uint32_t CHANNEL_MAX_BURST = 64;
+// number of rounds without data before the scheduler sleeps
+const int CHANNEL_SPIN_COUNT = 1000;
+// time in microseconds the idle scheduler sleeps between two rounds
+const int CHANNEL_POLL_INTERVAL = 50;
+
+/**
+ * Pair of user streams of a virtual channel and its share of the link
+ */
+template <typename T>
+struct BasicAuroraEmuChannel {
+    hlslib::Stream<T> *user_to_remote;
+    hlslib::Stream<T> *remote_to_user;
+    // maximum number of flits sent per round, at most CHANNEL_MAX_BURST
+    uint32_t weight;
+};
+
+/**
+ * Counters of a virtual channel. The latency of a flit is the time from
+ * the scheduler reading it from user_to_remote to the flit being written to
+ * remote_to_user of the receiving side, so it is only meaningful if both
+ * sides run on the same host.
+ */
+struct AuroraEmuChannelStats {
+    uint64_t flits_sent = 0;
+    uint64_t flits_received = 0;
+    // received flits per second between the first and the last received
+    // flit
+    double flits_per_second = 0;
+    double mean_latency_ns = 0;
+    int64_t max_latency_ns = 0;
+};
+
+/**
+ * First flit of every burst, followed by count flits of the channel
+ */
+struct ChannelHeader {
+    uint16_t channel;
+    uint16_t count;
+    uint32_t reserved;
+    // TLAST of the flits of the burst, bit i for flit i
+    uint64_t last_mask;
+    // time the burst was read from the user stream in ns of the steady clock
+    int64_t timestamp_ns;
+};
+
+/**
+ * Multiplexes several pairs of user streams, the virtual channels, over the
+ * single stream pair of an emulated core, like control and data streams
+ * that share one Aurora link. Both sides of the link need a
+ * BasicAuroraEmuChannels with the same channels, which are identified by
+ * their index.
+ *
+ * The flits are sent in bursts with a header flit that carries the channel
+ * id, so the channels work with all cores and transports. TLAST is kept
+ * even if the link does not use framing, TKEEP only with framing. The last
+ * flit of every burst is sent with TLAST set, so cores with framing forward
+ * every burst as soon as it is complete. The channels are scheduled in
+ * weighted round-robin: in every round, each channel sends up to weight
+ * flits that are available, so a bulk channel cannot starve the others.
+ * The core counts the header flits in its TX and RX counters.
+ */
+template <typename T>
+class BasicAuroraEmuChannels {
+   private:
+    typedef typename AxiStreamTraits<T>::data_t data_t;
+
+    static_assert(sizeof(data_t) >= sizeof(ChannelHeader),
+                  "Flits are too narrow for the channel header");
+
+    struct Channel {
+        BasicAuroraEmuChannel<T> streams;
+        std::atomic<uint64_t> flits_sent;
+        std::atomic<uint64_t> flits_received;
+        std::atomic<uint64_t> latency_sum_ns;
+        std::atomic<int64_t> max_latency_ns;
+        std::atomic<int64_t> first_receive_ns;
+        std::atomic<int64_t> last_receive_ns;
+
+        explicit Channel(const BasicAuroraEmuChannel<T> &streams)
+            : streams(streams),
+              flits_sent(0),
+              flits_received(0),
+              latency_sum_ns(0),
+              max_latency_ns(0),
+              first_receive_ns(0),
+              last_receive_ns(0) {}
+    };
+
+    // user streams of the core that carries the channels
+    hlslib::Stream<T> &user_to_remote;
+    hlslib::Stream<T> &remote_to_user;
+
+    std::vector<std::unique_ptr<Channel>> channels;
+    // flits of bursts with an unknown channel id
+    std::atomic<uint64_t> dropped;
+
+    // cleared by the destructor to terminate the threads
+    std::atomic<bool> running;
+    // blocking reads of the demux thread from remote_to_user
+    AuroraEmuStreamReader<T, hlslib::Stream<T>> rx_reader;
+    std::thread mux_thread;
+    std::thread demux_thread;
+
+    static int64_t now_ns() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+    }
+
+    /**
+     * Write without blocking on a full stream, so the destructor can stop
+     * the threads if nobody reads. Returns false once running is cleared.
+     */
+    bool write(hlslib::Stream<T> &stream, const T &flit) {
+        while (stream.full()) {
+            if (!running) {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        stream.write(flit);
+        return true;
+    }
+
+    bool send_burst(size_t channel, std::vector<T> &burst) {
+        ChannelHeader header = {};
+        header.channel = channel;
+        header.count = burst.size();
+        header.timestamp_ns = now_ns();
+        for (size_t i = 0; i < burst.size(); i++) {
+            if (burst[i].last) {
+                header.last_mask |= uint64_t(1) << i;
+            }
+            burst[i].last = (i + 1 == burst.size());
+        }
+        T header_flit;
+        header_flit.data = data_t(0);
+        std::memcpy(static_cast<void *>(&header_flit.data), &header,
+                    sizeof(header));
+        header_flit.last = 0;
+        if (!write(user_to_remote, header_flit)) {
+            return false;
+        }
+        for (const T &flit : burst) {
+            if (!write(user_to_remote, flit)) {
+                return false;
+            }
+        }
+        channels[channel]->flits_sent += burst.size();
+        return true;
+    }
+
+    void multiplex() {
+        std::vector<T> burst;
+        burst.reserve(CHANNEL_MAX_BURST);
+        int idle = 0;
+        while (running) {
+            bool progress = false;
+            for (size_t c = 0; c < channels.size(); c++) {
+                BasicAuroraEmuChannel<T> &streams = channels[c]->streams;
+                burst.clear();
+                while (burst.size() < streams.weight &&
+                       !streams.user_to_remote->empty()) {
+                    burst.push_back(streams.user_to_remote->read());
+                }
+                if (burst.empty()) {
+                    continue;
+                }
+                if (!send_burst(c, burst)) {
+                    return;
+                }
+                progress = true;
+            }
+            idle = progress ? 0 : idle + 1;
+            if (idle > CHANNEL_SPIN_COUNT) {
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(CHANNEL_POLL_INTERVAL));
+            } else if (!progress) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void demultiplex() {
+        while (true) {
+            // wait until the core receives data or the destructor clears
+            // running
+            T header_flit;
+            if (!rx_reader.read(header_flit)) {
+                return;
+            }
+            ChannelHeader header;
+            std::memcpy(&header, static_cast<const void *>(&header_flit.data),
+                        sizeof(header));
+            Channel *channel = header.channel < channels.size()
+                                   ? channels[header.channel].get()
+                                   : nullptr;
+            for (uint16_t i = 0; i < header.count; i++) {
+                T flit;
+                if (!rx_reader.read(flit)) {
+                    return;
+                }
+                if (channel == nullptr) {
+                    dropped++;
+                    continue;
+                }
+                flit.last = ((header.last_mask >> i) & 1) != 0;
+                if (!write(*channel->streams.remote_to_user, flit)) {
+                    return;
+                }
+                int64_t now = now_ns();
+                int64_t latency = now - header.timestamp_ns;
+                channel->latency_sum_ns += latency;
+                if (latency > channel->max_latency_ns) {
+                    channel->max_latency_ns = latency;
+                }
+                if (channel->flits_received++ == 0) {
+                    channel->first_receive_ns = now;
+                }
+                channel->last_receive_ns = now;
+            }
+        }
+    }
+
+   public:
+    /**
+     * Start multiplexing the channels over the user streams of a core
+     *
+     * user_to_remote: stream the core reads the data to send from
+     * remote_to_user: stream the core writes the received data to
+     * channels: user streams and weights of the channels, identified by
+     *           their index. At most 65536 channels
+     */
+    BasicAuroraEmuChannels(
+        hlslib::Stream<T> &user_to_remote, hlslib::Stream<T> &remote_to_user,
+        const std::vector<BasicAuroraEmuChannel<T>> &channels)
+        : user_to_remote(user_to_remote),
+          remote_to_user(remote_to_user),
+          dropped(0),
+          running(true),
+          rx_reader(remote_to_user, running) {
+        if (channels.size() > 65536) {
+            throw std::invalid_argument("Too many channels");
+        }
+        for (const BasicAuroraEmuChannel<T> &c : channels) {
+            if (c.weight == 0 || c.weight > CHANNEL_MAX_BURST) {
+                throw std::invalid_argument(
+                    "Channel weight has to be between 1 and "
+                    "CHANNEL_MAX_BURST");
+            }
+            this->channels.emplace_back(new Channel(c));
+        }
+        mux_thread = std::thread(&BasicAuroraEmuChannels::multiplex, this);
+        demux_thread = std::thread(&BasicAuroraEmuChannels::demultiplex, this);
+    }
+
+    /**
+     * Has to be destroyed before the core
+     */
+    ~BasicAuroraEmuChannels() {
+        running = false;
+        rx_reader.stop();
+        mux_thread.join();
+        demux_thread.join();
+    }
+
+    size_t get_num_channels() const { return channels.size(); }
+
+    AuroraEmuChannelStats get_stats(size_t channel) const {
+        const Channel &c = *channels.at(channel);
+        AuroraEmuChannelStats stats;
+        stats.flits_sent = c.flits_sent;
+        stats.flits_received = c.flits_received;
+        if (stats.flits_received > 1) {
+            stats.flits_per_second =
+                (stats.flits_received - 1) * 1e9 /
+                std::max<int64_t>(1, c.last_receive_ns - c.first_receive_ns);
+        }
+        if (stats.flits_received > 0) {
+            stats.mean_latency_ns =
+                static_cast<double>(c.latency_sum_ns) / stats.flits_received;
+        }
+        stats.max_latency_ns = c.max_latency_ns;
+        return stats;
+    }
+
+    // flits received for channels that do not exist on this side
+    uint64_t get_dropped_count() const { return dropped; }
+};
+
+typedef BasicAuroraEmuChannel<data_stream_t> AuroraEmuChannel;
+typedef BasicAuroraEmuChannels<data_stream_t> AuroraEmuChannels;
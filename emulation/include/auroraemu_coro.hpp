@@ -0,0 +1,527 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "auroraemu_coro.hpp requires C++20 coroutines"
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// default number of worker threads of an AuroraEmuScheduler
+const int SCHEDULER_WORKERS = 2;
+// number of iterations without progress before a worker sleeps
+const int SCHEDULER_SPIN_COUNT = 1000;
+// time in microseconds an idle worker sleeps before it polls the blocked
+// kernels again
+const int SCHEDULER_POLL_INTERVAL = 50;
+// number of kernels a worker resumes before it polls its blocked kernels,
+// even if more kernels are ready
+const int SCHEDULER_POLL_PERIOD = 64;
+
+class AuroraEmuScheduler;
+
+/**
+ * Coroutine of an emulated kernel. A kernel is written like an HLS kernel
+ * with blocking streams, but awaits read_async() and write_async() instead
+ * of calling read() and write():
+ *
+ *     AuroraEmuKernel forward(hlslib::Stream<data_stream_t> &in,
+ *                             hlslib::Stream<data_stream_t> &out, int n) {
+ *         for (int i = 0; i < n; i++) {
+ *             data_stream_t flit = co_await read_async(in);
+ *             co_await write_async(out, flit);
+ *         }
+ *     }
+ *
+ * Kernels are started with AuroraEmuScheduler::spawn(). A kernel can also
+ * co_await another kernel, which runs it like a function call.
+ */
+class AuroraEmuKernel {
+   public:
+    struct promise_type {
+        // kernel to resume once this one finished, set if it is awaited
+        std::coroutine_handle<> continuation;
+        // set for kernels started with spawn()
+        AuroraEmuScheduler *scheduler = nullptr;
+        std::exception_ptr exception;
+
+        AuroraEmuKernel get_return_object() {
+            return AuroraEmuKernel(
+                std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        // kernels only start when they are spawned or awaited
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<promise_type> h) noexcept;
+            void await_resume() noexcept {}
+        };
+
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_void() {}
+
+        void unhandled_exception() { exception = std::current_exception(); }
+    };
+
+    typedef std::coroutine_handle<promise_type> handle_t;
+
+   private:
+    handle_t handle;
+
+    friend class AuroraEmuScheduler;
+
+    explicit AuroraEmuKernel(handle_t handle) : handle(handle) {}
+
+   public:
+    AuroraEmuKernel(AuroraEmuKernel &&other) noexcept
+        : handle(std::exchange(other.handle, nullptr)) {}
+
+    AuroraEmuKernel(const AuroraEmuKernel &) = delete;
+    AuroraEmuKernel &operator=(const AuroraEmuKernel &) = delete;
+
+    ~AuroraEmuKernel() {
+        if (handle) {
+            handle.destroy();
+        }
+    }
+
+    /**
+     * Awaiting a kernel runs it on the current worker and resumes the
+     * awaiting kernel once it finished. Exceptions are passed on.
+     */
+    auto operator co_await() && noexcept {
+        struct Awaiter {
+            handle_t handle;
+
+            bool await_ready() noexcept { return !handle || handle.done(); }
+
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<> awaiting) noexcept {
+                handle.promise().continuation = awaiting;
+                return handle;
+            }
+
+            void await_resume() {
+                if (handle && handle.promise().exception) {
+                    std::rethrow_exception(handle.promise().exception);
+                }
+            }
+        };
+        return Awaiter{handle};
+    }
+};
+
+/**
+ * Worker thread of an AuroraEmuScheduler with its own queue of ready
+ * kernels and a list of kernels that wait for a stream. Ready kernels are
+ * taken from the back of the own queue and stolen from the front of the
+ * queues of other workers. Blocked kernels are only polled by their own
+ * worker and move to its queue once the stream operation succeeded.
+ */
+class AuroraEmuSchedulerWorker {
+   public:
+    /**
+     * Kernel that waits for a stream. poll() retries the stream operation
+     * without blocking and returns true once it succeeded.
+     */
+    struct Blocked {
+        std::coroutine_handle<> handle;
+        bool (*poll)(void *);
+        void *awaiter;
+    };
+
+   private:
+    AuroraEmuScheduler &scheduler;
+    size_t id;
+
+    // guards ready, which is also accessed by stealing workers
+    std::mutex m;
+    std::deque<std::coroutine_handle<>> ready;
+    // only accessed by the worker thread
+    std::vector<Blocked> blocked;
+
+    std::atomic<uint64_t> resumed;
+    std::atomic<uint64_t> stolen;
+    std::thread thread;
+
+    static thread_local AuroraEmuSchedulerWorker *current_worker;
+
+    /**
+     * Move the kernels whose stream operation succeeded to the ready
+     * queue. Returns true if any kernel became ready.
+     */
+    bool poll_blocked() {
+        bool progress = false;
+        size_t kept = 0;
+        for (size_t i = 0; i < blocked.size(); i++) {
+            if (blocked[i].poll(blocked[i].awaiter)) {
+                push(blocked[i].handle);
+                progress = true;
+            } else {
+                blocked[kept++] = blocked[i];
+            }
+        }
+        blocked.resize(kept);
+        return progress;
+    }
+
+    bool pop(std::coroutine_handle<> &handle) {
+        std::lock_guard<std::mutex> lock(m);
+        if (ready.empty()) {
+            return false;
+        }
+        handle = ready.back();
+        ready.pop_back();
+        return true;
+    }
+
+    bool steal_from(std::coroutine_handle<> &handle) {
+        std::lock_guard<std::mutex> lock(m);
+        if (ready.empty()) {
+            return false;
+        }
+        handle = ready.front();
+        ready.pop_front();
+        return true;
+    }
+
+    inline bool steal(std::coroutine_handle<> &handle);
+
+    inline void run();
+
+   public:
+    AuroraEmuSchedulerWorker(AuroraEmuScheduler &scheduler, size_t id)
+        : scheduler(scheduler), id(id), resumed(0), stolen(0) {}
+
+    void start() {
+        thread = std::thread(&AuroraEmuSchedulerWorker::run, this);
+    }
+
+    void join() {
+        if (thread.joinable()) {
+            thread.join();
+        }
+    }
+
+    void push(std::coroutine_handle<> handle) {
+        std::lock_guard<std::mutex> lock(m);
+        ready.push_back(handle);
+    }
+
+    void block(const Blocked &b) { blocked.push_back(b); }
+
+    // worker of the calling thread, nullptr outside of the scheduler
+    static AuroraEmuSchedulerWorker *current() { return current_worker; }
+
+    // number of kernels resumed by this worker
+    uint64_t get_resumed_count() const { return resumed; }
+
+    // number of kernels taken from the queues of other workers
+    uint64_t get_stolen_count() const { return stolen; }
+};
+
+inline thread_local AuroraEmuSchedulerWorker
+    *AuroraEmuSchedulerWorker::current_worker = nullptr;
+
+/**
+ * Runs emulated kernels as coroutines on a small pool of worker threads
+ * instead of one thread per kernel. A kernel that awaits a stream
+ * operation which cannot complete is suspended and polled by its worker
+ * with read_nb() or full(), so thousands of kernels only need a few
+ * threads. Idle workers steal ready kernels from the others, and sleep for
+ * SCHEDULER_POLL_INTERVAL after SCHEDULER_SPIN_COUNT iterations without
+ * progress.
+ *
+ * The kernels communicate with emulated cores through the user streams of
+ * the cores as before. Kernels that still wait for data when the scheduler
+ * is destroyed are destroyed with it.
+ */
+class AuroraEmuScheduler {
+   private:
+    std::vector<std::unique_ptr<AuroraEmuSchedulerWorker>> workers;
+    std::atomic<bool> running;
+
+    // guards the kernels and exception
+    std::mutex m;
+    std::condition_variable finished;
+    // spawned kernels that did not finish
+    std::unordered_set<void *> active;
+    // finished kernels whose frames are destroyed by the next spawn() or
+    // wait()
+    std::vector<AuroraEmuKernel::handle_t> done;
+    // first exception thrown by a spawned kernel
+    std::exception_ptr exception;
+    // worker the next kernel spawned from outside is assigned to
+    size_t next_worker;
+
+    friend class AuroraEmuSchedulerWorker;
+    friend struct AuroraEmuKernel::promise_type::FinalAwaiter;
+
+    void kernel_finished(AuroraEmuKernel::handle_t handle) {
+        std::lock_guard<std::mutex> lock(m);
+        if (handle.promise().exception && !exception) {
+            exception = handle.promise().exception;
+        }
+        active.erase(handle.address());
+        done.push_back(handle);
+        if (active.empty()) {
+            finished.notify_all();
+        }
+    }
+
+    // destroy the frames of finished kernels, called with m held
+    void collect() {
+        for (AuroraEmuKernel::handle_t handle : done) {
+            handle.destroy();
+        }
+        done.clear();
+    }
+
+   public:
+    explicit AuroraEmuScheduler(int num_workers = SCHEDULER_WORKERS)
+        : running(true), next_worker(0) {
+        if (num_workers < 1) {
+            throw std::invalid_argument(
+                "Scheduler needs at least one worker");
+        }
+        for (int i = 0; i < num_workers; i++) {
+            workers.emplace_back(new AuroraEmuSchedulerWorker(*this, i));
+        }
+        for (auto &w : workers) {
+            w->start();
+        }
+    }
+
+    AuroraEmuScheduler(const AuroraEmuScheduler &) = delete;
+    AuroraEmuScheduler &operator=(const AuroraEmuScheduler &) = delete;
+
+    ~AuroraEmuScheduler() {
+        running = false;
+        for (auto &w : workers) {
+            w->join();
+        }
+        collect();
+        for (void *address : active) {
+            std::coroutine_handle<>::from_address(address).destroy();
+        }
+    }
+
+    /**
+     * Start a kernel. Kernels spawned by a kernel are queued on the same
+     * worker, the others are distributed round-robin.
+     */
+    void spawn(AuroraEmuKernel kernel) {
+        AuroraEmuKernel::handle_t handle =
+            std::exchange(kernel.handle, nullptr);
+        handle.promise().scheduler = this;
+        AuroraEmuSchedulerWorker *worker = AuroraEmuSchedulerWorker::current();
+        {
+            std::lock_guard<std::mutex> lock(m);
+            collect();
+            active.insert(handle.address());
+            if (worker == nullptr) {
+                worker = workers[next_worker].get();
+                next_worker = (next_worker + 1) % workers.size();
+            }
+        }
+        worker->push(handle);
+    }
+
+    /**
+     * Block until all spawned kernels finished. Rethrows the first
+     * exception thrown by a kernel.
+     */
+    void wait() {
+        std::unique_lock<std::mutex> lock(m);
+        finished.wait(lock, [this] { return active.empty(); });
+        collect();
+        if (exception) {
+            std::exception_ptr e = exception;
+            exception = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+
+    size_t get_num_workers() const { return workers.size(); }
+
+    const AuroraEmuSchedulerWorker &get_worker(size_t i) const {
+        return *workers.at(i);
+    }
+};
+
+inline std::coroutine_handle<>
+AuroraEmuKernel::promise_type::FinalAwaiter::await_suspend(
+    std::coroutine_handle<promise_type> h) noexcept {
+    promise_type &p = h.promise();
+    if (p.continuation) {
+        return p.continuation;
+    }
+    if (p.scheduler != nullptr) {
+        p.scheduler->kernel_finished(h);
+    }
+    return std::noop_coroutine();
+}
+
+bool AuroraEmuSchedulerWorker::steal(std::coroutine_handle<> &handle) {
+    size_t n = scheduler.workers.size();
+    for (size_t i = 1; i < n; i++) {
+        if (scheduler.workers[(id + i) % n]->steal_from(handle)) {
+            stolen++;
+            return true;
+        }
+    }
+    return false;
+}
+
+void AuroraEmuSchedulerWorker::run() {
+    current_worker = this;
+    int idle = 0;
+    int since_poll = 0;
+    while (scheduler.running) {
+        std::coroutine_handle<> handle;
+        if (since_poll < SCHEDULER_POLL_PERIOD &&
+            (pop(handle) || steal(handle))) {
+            // runs until the kernel awaits a stream that is not ready or
+            // finishes
+            handle.resume();
+            resumed++;
+            since_poll++;
+            idle = 0;
+            continue;
+        }
+        since_poll = 0;
+        if (poll_blocked()) {
+            idle = 0;
+            continue;
+        }
+        idle++;
+        if (idle > SCHEDULER_SPIN_COUNT) {
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(SCHEDULER_POLL_INTERVAL));
+        } else {
+            std::this_thread::yield();
+        }
+    }
+    current_worker = nullptr;
+}
+
+/**
+ * Awaiter of read_async(). Tries read_nb() first and only suspends the
+ * kernel if the stream is empty.
+ */
+template <typename Stream>
+class StreamReadAwaiter {
+   public:
+    typedef typename std::decay<decltype(std::declval<Stream &>().read())>::type
+        value_t;
+
+   private:
+    Stream &stream;
+    value_t value;
+
+    static bool poll(void *self) {
+        StreamReadAwaiter *a = static_cast<StreamReadAwaiter *>(self);
+        return a->stream.read_nb(a->value);
+    }
+
+   public:
+    explicit StreamReadAwaiter(Stream &stream) : stream(stream) {}
+
+    bool await_ready() { return stream.read_nb(value); }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        AuroraEmuSchedulerWorker *worker = AuroraEmuSchedulerWorker::current();
+        if (worker == nullptr) {
+            throw std::logic_error("Kernel is not run by a scheduler");
+        }
+        worker->block({handle, &StreamReadAwaiter::poll, this});
+    }
+
+    value_t await_resume() { return value; }
+};
+
+/**
+ * Awaiter of write_async(). Writes as soon as the stream is not full, so a
+ * stream must only be written by a single kernel.
+ */
+template <typename Stream, typename T>
+class StreamWriteAwaiter {
+   private:
+    Stream &stream;
+    T value;
+
+    static bool poll(void *self) {
+        StreamWriteAwaiter *a = static_cast<StreamWriteAwaiter *>(self);
+        if (a->stream.full()) {
+            return false;
+        }
+        a->stream.write(a->value);
+        return true;
+    }
+
+   public:
+    StreamWriteAwaiter(Stream &stream, const T &value)
+        : stream(stream), value(value) {}
+
+    bool await_ready() { return poll(this); }
+
+    void await_suspend(std::coroutine_handle<> handle) {
+        AuroraEmuSchedulerWorker *worker = AuroraEmuSchedulerWorker::current();
+        if (worker == nullptr) {
+            throw std::logic_error("Kernel is not run by a scheduler");
+        }
+        worker->block({handle, &StreamWriteAwaiter::poll, this});
+    }
+
+    void await_resume() {}
+};
+
+/**
+ * co_await read_async(stream) reads the next value of the stream and
+ * suspends the kernel while the stream is empty
+ */
+template <typename Stream>
+StreamReadAwaiter<Stream> read_async(Stream &stream) {
+    return StreamReadAwaiter<Stream>(stream);
+}
+
+/**
+ * co_await write_async(stream, value) writes the value and suspends the
+ * kernel while the stream is full
+ */
+template <typename Stream, typename T>
+StreamWriteAwaiter<Stream, T> write_async(Stream &stream, const T &value) {
+    return StreamWriteAwaiter<Stream, T>(stream, value);
+}
@@ -0,0 +1,384 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <string>
+#include <zmq.hpp>
+
+// identifies the latency sample frame of a data message
+const uint32_t LATENCY_SAMPLE_MAGIC = 0x4c415453;
+// default number of data messages per latency sample
+const uint32_t LATENCY_SAMPLE_INTERVAL = 64;
+// buckets of a latency histogram. Bucket i > 0 counts the latencies in
+// [2^(i-1), 2^i) ns, the last one all longer latencies
+const int LATENCY_BUCKETS = 48;
+
+/**
+ * Points on the way of a flit at which a latency sample is stamped
+ */
+enum LatencyHop {
+    // the core took the flit from the user stream
+    HOP_USER_ENQUEUE,
+    // the message with the flit was passed to ZMQ
+    HOP_SEND,
+    // only for AuroraEmuCores that use the switch
+    HOP_SWITCH_IN,
+    HOP_SWITCH_OUT,
+    // the receiving core got the message
+    HOP_RECEIVE,
+    // the flits of the message were written to the user stream or the RX
+    // FIFO model
+    HOP_USER_DEQUEUE,
+    LATENCY_HOPS
+};
+
+/**
+ * Parts of the way of a flit between two hops, each with its own histogram
+ */
+enum LatencyStage {
+    // batching, flow control and pacing of the sender
+    STAGE_COLLECT,
+    STAGE_TO_SWITCH,
+    STAGE_SWITCH,
+    STAGE_FROM_SWITCH,
+    // from the sender to the receiver, including the switch
+    STAGE_TRANSPORT,
+    // delivery time of paced links and writing to a full user stream
+    STAGE_DELIVER,
+    STAGE_TOTAL,
+    LATENCY_STAGES
+};
+
+struct LatencyStageInfo {
+    const char *name;
+    LatencyHop from;
+    LatencyHop to;
+};
+
+inline const LatencyStageInfo &latency_stage(int stage) {
+    static const LatencyStageInfo stages[LATENCY_STAGES] = {
+        {"collect", HOP_USER_ENQUEUE, HOP_SEND},
+        {"to_switch", HOP_SEND, HOP_SWITCH_IN},
+        {"switch", HOP_SWITCH_IN, HOP_SWITCH_OUT},
+        {"from_switch", HOP_SWITCH_OUT, HOP_RECEIVE},
+        {"transport", HOP_SEND, HOP_RECEIVE},
+        {"deliver", HOP_RECEIVE, HOP_USER_DEQUEUE},
+        {"total", HOP_USER_ENQUEUE, HOP_USER_DEQUEUE}};
+    return stages[stage];
+}
+
+/**
+ * Timestamps of the first flit of a sampled message, sent as last frame of
+ * the message and stamped by every hop it passes. The system clock is used
+ * like for the delivery time, so hosts need synchronized clocks.
+ */
+struct LatencySample {
+    uint32_t magic;
+    uint32_t reserved;
+    // ns since the epoch, 0 for hops the flit did not pass
+    int64_t hops[LATENCY_HOPS];
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch())
+            .count();
+    }
+
+    static bool is_sample(const zmq::message_t &frame) {
+        return frame.size() == sizeof(LatencySample) &&
+               static_cast<const LatencySample *>(frame.data())->magic ==
+                   LATENCY_SAMPLE_MAGIC;
+    }
+};
+
+/**
+ * Histogram of latencies with logarithmic buckets. Recorded by one thread
+ * and readable by all others at any time.
+ */
+class LatencyHistogram {
+   private:
+    std::atomic<uint64_t> buckets[LATENCY_BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum_ns;
+    std::atomic<int64_t> max_ns;
+
+   public:
+    LatencyHistogram() { reset(); }
+
+    static int bucket_of(int64_t ns) {
+        if (ns <= 0) {
+            return 0;
+        }
+        int bucket = 64 - __builtin_clzll(static_cast<uint64_t>(ns));
+        return std::min(bucket, LATENCY_BUCKETS - 1);
+    }
+
+    // upper bound of the latencies in a bucket
+    static int64_t bucket_limit(int bucket) { return int64_t(1) << bucket; }
+
+    void record(int64_t ns) {
+        ns = std::max<int64_t>(ns, 0);
+        buckets[bucket_of(ns)].fetch_add(1, std::memory_order_relaxed);
+        sum_ns.fetch_add(ns, std::memory_order_relaxed);
+        if (ns > max_ns.load(std::memory_order_relaxed)) {
+            max_ns.store(ns, std::memory_order_relaxed);
+        }
+        count.fetch_add(1, std::memory_order_release);
+    }
+
+    void reset() {
+        for (auto &bucket : buckets) {
+            bucket = 0;
+        }
+        count = 0;
+        sum_ns = 0;
+        max_ns = 0;
+    }
+
+    uint64_t get_count() const { return count.load(std::memory_order_acquire); }
+
+    uint64_t get_bucket(int bucket) const { return buckets[bucket].load(); }
+
+    int64_t get_max_ns() const { return max_ns.load(); }
+
+    double get_mean_ns() const {
+        uint64_t n = get_count();
+        return n == 0 ? 0 : static_cast<double>(sum_ns.load()) / n;
+    }
+
+    /**
+     * Upper bound of the q-quantile, e.g. 0.99. Accurate to a factor of two
+     * and never larger than the maximum.
+     */
+    int64_t get_percentile_ns(double q) const {
+        uint64_t n = get_count();
+        if (n == 0) {
+            return 0;
+        }
+        uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * n));
+        uint64_t seen = 0;
+        for (int i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min(bucket_limit(i), get_max_ns());
+            }
+        }
+        return get_max_ns();
+    }
+};
+
+/**
+ * Latency histograms of all stages of the flits received by a core
+ */
+class LatencyHistograms {
+   private:
+    LatencyHistogram stages[LATENCY_STAGES];
+
+   public:
+    /**
+     * Add the stages a sample passed completely
+     */
+    void record(const LatencySample &sample) {
+        for (int i = 0; i < LATENCY_STAGES; i++) {
+            const LatencyStageInfo &stage = latency_stage(i);
+            if (sample.hops[stage.from] != 0 && sample.hops[stage.to] != 0) {
+                stages[i].record(sample.hops[stage.to] -
+                                 sample.hops[stage.from]);
+            }
+        }
+    }
+
+    const LatencyHistogram &get(LatencyStage stage) const {
+        return stages[stage];
+    }
+
+    void reset() {
+        for (auto &stage : stages) {
+            stage.reset();
+        }
+    }
+
+    /**
+     * Print a table with the samples and latencies of the stages in us
+     */
+    void dump(std::ostream &out) const {
+        out << std::left << std::setw(13) << "stage" << std::setw(10)
+            << "samples" << std::setw(12) << "mean [us]" << std::setw(12)
+            << "p50 [us]" << std::setw(12) << "p99 [us]" << "max [us]"
+            << std::endl;
+        for (int i = 0; i < LATENCY_STAGES; i++) {
+            const LatencyHistogram &h = stages[i];
+            if (h.get_count() == 0) {
+                continue;
+            }
+            out << std::setw(13) << latency_stage(i).name << std::setw(10)
+                << h.get_count() << std::setw(12) << h.get_mean_ns() / 1000
+                << std::setw(12) << h.get_percentile_ns(0.5) / 1000.0
+                << std::setw(12) << h.get_percentile_ns(0.99) / 1000.0
+                << h.get_max_ns() / 1000.0 << std::endl;
+        }
+    }
+};
+
+/**
+ * Latency tracing of the emulator if it is not built with
+ * AURORAEMU_LATENCY_TRACE. Every method does nothing, so the calls in the
+ * send and receive paths are compiled away.
+ */
+class NoLatencyTrace {
+   public:
+    explicit NoLatencyTrace(uint32_t) {}
+
+    void enqueue() {}
+
+    const LatencySample *send() { return nullptr; }
+
+    LatencySample *rx_sample() { return nullptr; }
+
+    void receive() {}
+
+    void dequeue() {}
+
+    const LatencyHistograms *histograms() const { return nullptr; }
+
+    void report(const std::string &, const std::string &) {}
+
+    static int64_t switch_in() { return 0; }
+
+    static void switch_out(zmq::message_t &, int64_t) {}
+};
+
+/**
+ * Latency tracing of a core that samples the first flit of one of interval
+ * data messages. The sender stamps the enqueue and send time into the
+ * sample, which travels as last frame of the message. The receiver stamps
+ * it again and adds it to its LatencyHistograms.
+ *
+ * The methods are called in the order of the hops: enqueue() and send() by
+ * the send path of the sending core, rx_sample(), receive() and dequeue()
+ * by the receive path of the receiving core, and switch_in() and
+ * switch_out() by the switch.
+ */
+class SampledLatencyTrace {
+   private:
+    uint32_t interval;
+    // messages until the next sample
+    uint32_t countdown;
+    bool sampled;
+    LatencySample tx;
+    LatencySample rx;
+    LatencyHistograms stages;
+
+   public:
+    explicit SampledLatencyTrace(uint32_t interval)
+        : interval(std::max<uint32_t>(interval, 1)),
+          countdown(1),
+          sampled(false),
+          tx(),
+          rx() {}
+
+    /**
+     * The core read the first flit of the next message from the user
+     * stream
+     */
+    void enqueue() {
+        if (--countdown > 0) {
+            return;
+        }
+        countdown = interval;
+        sampled = true;
+        tx = LatencySample();
+        tx.magic = LATENCY_SAMPLE_MAGIC;
+        tx.hops[HOP_USER_ENQUEUE] = LatencySample::now();
+    }
+
+    /**
+     * Sample to send as last frame of the next message, nullptr if the
+     * message is not sampled
+     */
+    const LatencySample *send() {
+        if (!sampled) {
+            return nullptr;
+        }
+        sampled = false;
+        tx.hops[HOP_SEND] = LatencySample::now();
+        return &tx;
+    }
+
+    // storage for the sample frame of the next received message
+    LatencySample *rx_sample() { return &rx; }
+
+    void receive() {
+        if (rx.magic == LATENCY_SAMPLE_MAGIC) {
+            rx.hops[HOP_RECEIVE] = LatencySample::now();
+        }
+    }
+
+    /**
+     * The flits of the received message were passed on
+     */
+    void dequeue() {
+        if (rx.magic != LATENCY_SAMPLE_MAGIC) {
+            return;
+        }
+        rx.hops[HOP_USER_DEQUEUE] = LatencySample::now();
+        stages.record(rx);
+        rx.magic = 0;
+    }
+
+    const LatencyHistograms *histograms() const { return &stages; }
+
+    /**
+     * Append the histograms of the core to a file. An empty file name
+     * disables the report.
+     */
+    void report(const std::string &file_name, const std::string &core) {
+        if (file_name.empty()) {
+            return;
+        }
+        std::ofstream f(file_name, std::ios::app);
+        f << "core " << core << std::endl;
+        stages.dump(f);
+    }
+
+    // time the switch received the first frame of a message
+    static int64_t switch_in() { return LatencySample::now(); }
+
+    /**
+     * Stamp a frame that passes the switch if it is a latency sample
+     */
+    static void switch_out(zmq::message_t &frame, int64_t in_ns) {
+        if (LatencySample::is_sample(frame)) {
+            LatencySample *sample = static_cast<LatencySample *>(frame.data());
+            sample->hops[HOP_SWITCH_IN] = in_ns;
+            sample->hops[HOP_SWITCH_OUT] = LatencySample::now();
+        }
+    }
+};
+
+#ifdef AURORAEMU_LATENCY_TRACE
+typedef SampledLatencyTrace AuroraEmuLatencyTrace;
+#else
+typedef NoLatencyTrace AuroraEmuLatencyTrace;
+#endif
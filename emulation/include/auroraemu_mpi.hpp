@@ -0,0 +1,328 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <mpi.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "auroraemu.hpp"
+
+// number of receives a core keeps posted
+const int MPI_RECV_REQUESTS = 4;
+// number of messages a core may have in flight before it waits for the
+// oldest one
+const int MPI_SEND_REQUESTS = 4;
+// number of unsuccessful tests of a request before the thread sleeps
+const int MPI_SPIN_COUNT = 1000;
+// time in microseconds a thread sleeps between two tests of a request
+const int MPI_POLL_INTERVAL = 50;
+
+/**
+ * Emulated Aurora core that exchanges flits with a core in another MPI rank,
+ * or the same one, without ports, host names or a switch. A core is
+ * identified by its rank and a port number that is unique within the rank
+ * and used as MPI tag. All cores send and receive on the communicator given
+ * to the constructor, which should not be used by the application, e.g. a
+ * duplicate of MPI_COMM_WORLD. MPI has to be initialized with
+ * MPI_THREAD_MULTIPLE.
+ *
+ * Messages are batched like on ZMQ links. Receives are persistent requests
+ * that are restarted after every message, sends of full batches use
+ * persistent requests, shorter messages MPI_Isend.
+ */
+template <typename T, typename Stream = hlslib::Stream<T>>
+class BasicAuroraEmuMPICore {
+   private:
+    typedef typename AxiStreamTraits<T>::data_t data_t;
+
+    // state of a send buffer
+    enum SendState { send_idle, send_persistent, send_partial };
+
+    MPI_Comm comm;
+    int port;
+    int remote_rank;
+    int remote_port;
+
+    // streams used to pass data to and from user kernels
+    Stream &remote_to_user;
+    Stream &user_to_remote;
+
+    // batching options
+    AuroraEmuConfig config;
+
+    // cleared by the destructor to terminate the threads
+    std::atomic<bool> running;
+    // blocking reads of the send thread from user_to_remote
+    AuroraEmuStreamReader<T, Stream> tx_reader;
+
+    // size of the largest message in bytes
+    size_t max_message_size;
+
+    // posted receives, the messages are processed in the order of their
+    // buffers to keep the order of the flits
+    std::vector<std::vector<char>> recv_buffers;
+    std::vector<MPI_Request> recv_requests;
+
+    // buffers of the messages in flight. Only accessed by the send thread
+    // and the destructor after it joined
+    std::vector<std::vector<char>> send_buffers;
+    std::vector<MPI_Request> persistent_sends;
+    std::vector<MPI_Request> partial_sends;
+    std::vector<SendState> send_states;
+
+    // send and recv threads used to pass data to and from user kernels
+    std::thread recv_thread;
+    std::thread send_thread;
+
+    // limits the send rate to the line rate of the link
+    LinkPacer pacer;
+
+    // status and counters at the addresses of the hardware core
+    AuroraEmuRegisters registers;
+
+    // records the received flits with the rank of the sender if trace_file
+    // is set
+    std::unique_ptr<FlitTraceWriter<T>> trace;
+
+    /**
+     * Wait for the request without keeping a CPU busy like MPI_Wait does
+     * in most implementations. Returns false if running was cleared.
+     */
+    bool wait_request(MPI_Request &request, MPI_Status &status) {
+        int spins = 0;
+        while (true) {
+            int done = 0;
+            MPI_Test(&request, &done, &status);
+            if (done) {
+                return true;
+            }
+            if (!running) {
+                return false;
+            }
+            if (spins++ < MPI_SPIN_COUNT) {
+                std::this_thread::yield();
+            } else {
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(MPI_POLL_INTERVAL));
+            }
+        }
+    }
+
+    /**
+     * Block until the message in the send buffer is sent and the buffer can
+     * be reused. If block is false, the send thread gives up once running
+     * is cleared.
+     */
+    void complete_send(size_t slot, bool block) {
+        if (send_states[slot] == send_idle) {
+            return;
+        }
+        MPI_Request &request = (send_states[slot] == send_persistent)
+                                   ? persistent_sends[slot]
+                                   : partial_sends[slot];
+        MPI_Status status;
+        if (block) {
+            MPI_Wait(&request, &status);
+        } else if (!wait_request(request, status)) {
+            return;
+        }
+        send_states[slot] = send_idle;
+    }
+
+    void forward_from_remote() {
+        size_t next = 0;
+        while (true) {
+            MPI_Status status;
+            if (!wait_request(recv_requests[next], status)) {
+                return;
+            }
+            int bytes = 0;
+            MPI_Get_count(&status, MPI_BYTE, &bytes);
+            receive_flits(recv_buffers[next].data(), bytes,
+                          static_cast<RxFifo<T> *>(nullptr), remote_to_user,
+                          registers, config.framing, trace.get(),
+                          status.MPI_SOURCE);
+            MPI_Start(&recv_requests[next]);
+            next = (next + 1) % recv_requests.size();
+        }
+    }
+
+    void forward_from_user() {
+        std::vector<data_t> batch;
+        batch.reserve(config.max_batch_size);
+        // flits including their side channels for framing
+        std::vector<T> frame;
+        size_t next = 0;
+        while (true) {
+            // wait until the user kernel writes data or the destructor
+            // clears running
+            T first;
+            if (!tx_reader.read(first)) {
+                return;
+            }
+            if (config.framing) {
+                collect_frame(tx_reader, first, frame, config);
+            } else {
+                collect_batch(user_to_remote, first, batch, config);
+            }
+            if (!running) {
+                return;
+            }
+            size_t count = config.framing ? frame.size() : batch.size();
+            size_t bytes = config.framing ? count * sizeof(T)
+                                          : count * sizeof(data_t);
+            registers.add(AuroraEmuRegisters::TX_COUNT_ADDRESS, count);
+            if (config.pacing) {
+                pacer.pace(count * AxiStreamTraits<T>::width_bytes());
+            }
+            // reuse the buffer of the oldest message
+            complete_send(next, false);
+            if (!running) {
+                return;
+            }
+            std::memcpy(send_buffers[next].data(),
+                        config.framing ? static_cast<const void *>(frame.data())
+                                       : static_cast<const void *>(batch.data()),
+                        bytes);
+            if (bytes == max_message_size) {
+                MPI_Start(&persistent_sends[next]);
+                send_states[next] = send_persistent;
+            } else {
+                MPI_Isend(send_buffers[next].data(), bytes, MPI_BYTE,
+                          remote_rank, remote_port, comm,
+                          &partial_sends[next]);
+                send_states[next] = send_partial;
+            }
+            next = (next + 1) % send_buffers.size();
+        }
+    }
+
+   public:
+    /**
+     * Create a core and start sending and receiving
+     *
+     * comm: communicator used for all messages of the emulated cores
+     * port: port of the core in its rank, used as MPI tag
+     * remote_rank: rank of the core to send to
+     * remote_port: port of the core to send to
+     * user_to_remote: AXI stream to pass data into the aurora core
+     * remote_to_user: AXI stream to read data from the aurora core
+     * config: batching options of the core. Native flow control is not
+     *         modeled, pacing only limits the line rate
+     */
+    BasicAuroraEmuMPICore(MPI_Comm comm, int port, int remote_rank,
+                          int remote_port, Stream &user_to_remote,
+                          Stream &remote_to_user,
+                          AuroraEmuConfig config = AuroraEmuConfig())
+        : comm(comm),
+          port(port),
+          remote_rank(remote_rank),
+          remote_port(remote_port),
+          remote_to_user(remote_to_user),
+          user_to_remote(user_to_remote),
+          config(config),
+          running(true),
+          tx_reader(user_to_remote, running),
+          max_message_size(config.framing
+                               ? config.max_frame_size * sizeof(T)
+                               : config.max_batch_size * sizeof(data_t)),
+          recv_buffers(MPI_RECV_REQUESTS,
+                       std::vector<char>(max_message_size)),
+          recv_requests(MPI_RECV_REQUESTS, MPI_REQUEST_NULL),
+          send_buffers(MPI_SEND_REQUESTS,
+                       std::vector<char>(max_message_size)),
+          persistent_sends(MPI_SEND_REQUESTS, MPI_REQUEST_NULL),
+          partial_sends(MPI_SEND_REQUESTS, MPI_REQUEST_NULL),
+          send_states(MPI_SEND_REQUESTS, send_idle),
+          pacer(config.pacing ? config.line_rate_gbps : 0,
+                config.encoding_efficiency),
+          registers(AxiStreamTraits<T>::width_bytes(), config.rx_fifo_depth,
+                    config.rx_fifo_prog_full, config.rx_fifo_prog_empty,
+                    config.framing, config.framing) {
+        int provided = 0;
+        MPI_Query_thread(&provided);
+        if (provided < MPI_THREAD_MULTIPLE) {
+            throw std::runtime_error(
+                "MPI has to be initialized with MPI_THREAD_MULTIPLE");
+        }
+        // messages that arrive before the receives are posted are buffered
+        // by MPI, so the cores need no handshake
+        if (!config.trace_file.empty()) {
+            trace.reset(new FlitTraceWriter<T>(config.trace_file));
+        }
+        for (int i = 0; i < MPI_RECV_REQUESTS; i++) {
+            MPI_Recv_init(recv_buffers[i].data(), max_message_size, MPI_BYTE,
+                          MPI_ANY_SOURCE, port, comm, &recv_requests[i]);
+            MPI_Start(&recv_requests[i]);
+        }
+        for (int i = 0; i < MPI_SEND_REQUESTS; i++) {
+            MPI_Send_init(send_buffers[i].data(), max_message_size, MPI_BYTE,
+                          remote_rank, remote_port, comm,
+                          &persistent_sends[i]);
+        }
+        std::thread t1(&BasicAuroraEmuMPICore::forward_from_remote, this);
+        std::thread t2(&BasicAuroraEmuMPICore::forward_from_user, this);
+        config.placement.apply(t1);
+        config.placement.apply(t2);
+        recv_thread.swap(t1);
+        send_thread.swap(t2);
+    }
+
+    /**
+     * Has to be called before MPI_Finalize. Messages that are still in
+     * flight are sent, so the remote core has to receive them.
+     */
+    ~BasicAuroraEmuMPICore() {
+        running = false;
+        tx_reader.stop();
+        recv_thread.join();
+        send_thread.join();
+        for (size_t i = 0; i < send_buffers.size(); i++) {
+            complete_send(i, true);
+            MPI_Request_free(&persistent_sends[i]);
+        }
+        for (MPI_Request &request : recv_requests) {
+            MPI_Cancel(&request);
+            MPI_Wait(&request, MPI_STATUS_IGNORE);
+            MPI_Request_free(&request);
+        }
+    }
+
+    int get_port() const { return port; }
+
+    /**
+     * Read the register at the given address of the control s axi interface
+     * of the hardware core, e.g. TX_COUNT_ADDRESS
+     */
+    uint32_t read_register(uint32_t address) {
+        return read_core_register(registers, static_cast<RxFifo<T> *>(nullptr),
+                                  address);
+    }
+
+    void write_register(uint32_t address, uint32_t value) {
+        write_core_register(registers, static_cast<RxFifo<T> *>(nullptr),
+                            address, value);
+    }
+};
+
+typedef BasicAuroraEmuMPICore<data_stream_t> AuroraEmuMPICore;
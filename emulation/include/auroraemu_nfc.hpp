@@ -0,0 +1,276 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+
+// RX FIFO parameters of the default hardware build (see Makefile)
+const uint32_t RX_FIFO_DEPTH = 1024;
+const uint32_t RX_FIFO_PROG_FULL = 512;
+const uint32_t RX_FIFO_PROG_EMPTY = 128;
+
+// payload of the native flow control messages, as sent by the RTL
+const uint16_t NFC_XOFF = 0xffff;
+const uint16_t NFC_XON = 0x0000;
+
+/**
+ * Model of the RX FIFO of the Aurora core together with the native flow
+ * control state machine of aurora_flow_nfc.v. XOFF is requested when the
+ * FIFO reaches prog_full and XON when it drains to prog_empty. The FIFO
+ * never holds more than depth flits: a full FIFO stops the thread that
+ * receives from the link, which in turn stops the remote core.
+ */
+template <typename T>
+class RxFifo {
+   private:
+    enum State { idle, full, empty };
+
+    std::deque<T> fifo;
+    std::mutex m;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    // set by stop(), writers do not wait for space anymore
+    bool stopped;
+    // true while the flit offered to try_write() found the FIFO full, so it
+    // is only counted once when it is offered again
+    bool overflowing;
+
+    uint32_t depth;
+    uint32_t prog_full;
+    uint32_t prog_empty;
+    State state;
+
+    // flits received since the last XOFF
+    uint32_t latency_count;
+
+    // called with NFC_XOFF or NFC_XON while the FIFO is locked, so the
+    // messages leave in the order they were triggered
+    std::function<void(uint16_t)> send_nfc;
+
+    // called with the FIFO locked and not full
+    void push(const T &flit) {
+        fifo.push_back(flit);
+        if (state == full) {
+            latency_count++;
+        }
+        update_state();
+        not_empty.notify_one();
+    }
+
+    // called with the FIFO locked and not empty
+    void pop(T &flit) {
+        flit = fifo.front();
+        fifo.pop_front();
+        update_state();
+        not_full.notify_one();
+    }
+
+    void update_state() {
+        if (state == full && fifo.size() < prog_full) {
+            state = idle;
+            max_latency = std::max<uint32_t>(max_latency, latency_count);
+            latency_count = 0;
+        }
+        if (state == empty && fifo.size() > prog_empty) {
+            state = idle;
+        }
+        if (state == idle && fifo.size() <= prog_empty) {
+            state = empty;
+            empty_trigger_count++;
+            send_nfc(NFC_XON);
+        } else if (state == idle && fifo.size() >= prog_full) {
+            state = full;
+            full_trigger_count++;
+            latency_count = 0;
+            send_nfc(NFC_XOFF);
+        }
+    }
+
+   public:
+    std::atomic<uint32_t> full_trigger_count;
+    std::atomic<uint32_t> empty_trigger_count;
+    std::atomic<uint32_t> max_latency;
+    // flits that found the FIFO full and had to wait, including the flits
+    // that were dropped because the core stopped while they waited
+    std::atomic<uint32_t> overflow_count;
+
+    RxFifo(uint32_t depth, uint32_t prog_full, uint32_t prog_empty,
+           std::function<void(uint16_t)> send_nfc)
+        : stopped(false),
+          overflowing(false),
+          depth(depth),
+          prog_full(prog_full),
+          prog_empty(prog_empty),
+          state(empty),
+          latency_count(0),
+          send_nfc(send_nfc),
+          full_trigger_count(0),
+          empty_trigger_count(0),
+          max_latency(0),
+          overflow_count(0) {}
+
+    /**
+     * Add a flit received from the link. Blocks while the FIFO is full, a
+     * flit that has to wait is counted as overflow. The flit is dropped if
+     * stop() is called while it waits.
+     */
+    void write(const T &flit) {
+        std::unique_lock<std::mutex> lock(m);
+        if (fifo.size() >= depth) {
+            overflow_count++;
+            not_full.wait(lock,
+                          [&]() { return fifo.size() < depth || stopped; });
+            if (fifo.size() >= depth) {
+                return;
+            }
+        }
+        push(flit);
+    }
+
+    /**
+     * Add a flit received from the link if the FIFO is not full, without
+     * blocking. A flit that is offered again after it did not fit is only
+     * counted once as overflow.
+     */
+    bool try_write(const T &flit) {
+        std::lock_guard<std::mutex> lock(m);
+        if (fifo.size() >= depth) {
+            if (!overflowing) {
+                overflowing = true;
+                overflow_count++;
+            }
+            return false;
+        }
+        overflowing = false;
+        push(flit);
+        return true;
+    }
+
+    /**
+     * Take the next flit for the user kernel. Blocks while the FIFO is
+     * empty and returns false once running was cleared.
+     */
+    bool read(T &flit, const std::atomic<bool> &running) {
+        std::unique_lock<std::mutex> lock(m);
+        not_empty.wait(lock, [&]() { return !fifo.empty() || !running; });
+        if (fifo.empty()) {
+            return false;
+        }
+        pop(flit);
+        return true;
+    }
+
+    /**
+     * Take the next flit for the user kernel if the FIFO is not empty,
+     * without blocking
+     */
+    bool try_read(T &flit) {
+        std::lock_guard<std::mutex> lock(m);
+        if (fifo.empty()) {
+            return false;
+        }
+        pop(flit);
+        return true;
+    }
+
+    /**
+     * Wake up the threads blocked in read() and write() when the core
+     * stops. Writes to a full FIFO return immediately afterwards.
+     */
+    void stop() {
+        std::lock_guard<std::mutex> lock(m);
+        stopped = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+
+    // number of flits currently buffered
+    size_t size() {
+        std::lock_guard<std::mutex> lock(m);
+        return fifo.size();
+    }
+
+    bool is_prog_full() { return size() >= prog_full; }
+
+    bool is_prog_empty() { return size() <= prog_empty; }
+
+    void reset_counter() {
+        std::lock_guard<std::mutex> lock(m);
+        full_trigger_count = 0;
+        empty_trigger_count = 0;
+        max_latency = 0;
+        overflow_count = 0;
+        latency_count = 0;
+    }
+};
+
+/**
+ * Sender side of the native flow control. XOFF pauses the transmission
+ * after the configured reaction latency, XON resumes it.
+ */
+class TxFlowControl {
+   private:
+    std::mutex m;
+    std::condition_variable resume;
+    bool xoff;
+    std::chrono::steady_clock::time_point xoff_time;
+    std::chrono::microseconds latency;
+
+   public:
+    explicit TxFlowControl(int latency_us)
+        : xoff(false), latency(latency_us) {}
+
+    void receive(uint16_t nfc) {
+        std::lock_guard<std::mutex> lock(m);
+        if (nfc == NFC_XOFF) {
+            if (!xoff) {
+                xoff = true;
+                xoff_time = std::chrono::steady_clock::now() + latency;
+            }
+        } else {
+            xoff = false;
+            resume.notify_all();
+        }
+    }
+
+    /**
+     * Block before the next transmission while XOFF is in effect
+     */
+    void wait(const std::atomic<bool> &running) {
+        std::unique_lock<std::mutex> lock(m);
+        if (xoff && std::chrono::steady_clock::now() >= xoff_time) {
+            resume.wait(lock, [&]() { return !xoff || !running; });
+        }
+    }
+
+    // true if wait() would block, for senders that must not block
+    bool paused() {
+        std::lock_guard<std::mutex> lock(m);
+        return xoff && std::chrono::steady_clock::now() >= xoff_time;
+    }
+
+    void wake() {
+        std::lock_guard<std::mutex> lock(m);
+        resume.notify_all();
+    }
+};
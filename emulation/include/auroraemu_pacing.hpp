@@ -0,0 +1,136 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <thread>
+
+// line rate of the four QSFP28 lanes in Gbit/s
+const double LINE_RATE_GBPS = 100.0;
+// share of the line rate left for payload with 64b/66b encoding
+const double LINE_ENCODING_EFFICIENCY = 64.0 / 66.0;
+// time in nanoseconds an idle link may transmit back-to-back to catch up
+const int PACING_BURST_NS = 10000;
+
+/**
+ * Token bucket that limits the payload throughput of a link to its line
+ * rate. Departure times are kept on an absolute time line, so the average
+ * rate is exact even if the thread oversleeps.
+ */
+class LinkPacer {
+   private:
+    // payload bytes per nanosecond, 0 disables pacing
+    double bytes_per_ns;
+    std::chrono::steady_clock::time_point start;
+    // time in nanoseconds since start when the link is free again
+    double next_free_ns;
+    // time in nanoseconds since start when pace() returned the last time
+    double last_return_ns;
+
+    double now_ns() const {
+        return std::chrono::duration<double, std::nano>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+    }
+
+   public:
+    LinkPacer(double line_rate_gbps, double encoding_efficiency)
+        : bytes_per_ns(line_rate_gbps * encoding_efficiency / 8.0),
+          start(std::chrono::steady_clock::now()),
+          next_free_ns(0),
+          last_return_ns(0) {}
+
+    bool enabled() const { return bytes_per_ns > 0; }
+
+    /**
+     * Reserve the link for the given number of payload bytes without
+     * blocking. Returns the time the last byte leaves the link, the caller
+     * has to hold the data back until then.
+     */
+    std::chrono::steady_clock::time_point reserve(size_t bytes) {
+        if (!enabled()) {
+            return std::chrono::steady_clock::now();
+        }
+        double now = now_ns();
+        // limit the saved up time if the sender had no data. Late wake ups
+        // of the last call must not be lost
+        if (now - last_return_ns > PACING_BURST_NS) {
+            next_free_ns = std::max(next_free_ns, now - PACING_BURST_NS);
+        }
+        next_free_ns += bytes / bytes_per_ns;
+        last_return_ns = std::max(now, next_free_ns);
+        return start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::duration<double, std::nano>(
+                               next_free_ns));
+    }
+
+    /**
+     * Block until the link can carry the given number of payload bytes and
+     * reserve it. Returns the time the last byte left the link.
+     */
+    std::chrono::steady_clock::time_point pace(size_t bytes) {
+        if (!enabled()) {
+            return std::chrono::steady_clock::now();
+        }
+        auto departure = reserve(bytes);
+        if (departure > std::chrono::steady_clock::now()) {
+            std::this_thread::sleep_until(departure);
+        }
+        last_return_ns = now_ns();
+        return departure;
+    }
+};
+
+/**
+ * Time the flits of a message may be passed to the receiving user kernel.
+ * It is sent as an optional trailing frame of data messages. The system
+ * clock is used so cores in different processes and on synchronized hosts
+ * agree on the time.
+ */
+struct MessageDelivery {
+    int64_t deliver_at_ns;
+
+    /**
+     * Deliver the message latency after it left the sending link
+     */
+    static MessageDelivery after(std::chrono::steady_clock::time_point departure,
+                                 std::chrono::nanoseconds latency) {
+        auto deliver_at = std::chrono::system_clock::now() +
+                          std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              departure - std::chrono::steady_clock::now()) +
+                          latency;
+        MessageDelivery d;
+        d.deliver_at_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                              deliver_at.time_since_epoch())
+                              .count();
+        return d;
+    }
+
+    bool due() const {
+        return std::chrono::system_clock::now().time_since_epoch() >=
+               std::chrono::nanoseconds(deliver_at_ns);
+    }
+
+    void wait() const {
+        std::this_thread::sleep_until(
+            std::chrono::system_clock::time_point(
+                std::chrono::duration_cast<
+                    std::chrono::system_clock::duration>(
+                    std::chrono::nanoseconds(deliver_at_ns))));
+    }
+};
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <zmq.hpp>
+
+#include "auroraemu_affinity.hpp"
+
+// number of free buffers a message pool keeps for reuse
+const size_t MESSAGE_POOL_BUFFERS = 16;
+
+/**
+ * Buffers for the data messages of a core, which ZMQ sends without copying
+ * them and returns to the pool with the free callback of the message. New
+ * buffers are only allocated while more messages are in flight than ever
+ * before, so the send path does not allocate once it reached its steady
+ * state. Up to max_buffers free buffers are kept.
+ *
+ * ZMQ may free a message after the core that sent it is gone, e.g. when the
+ * context lingers. The pool is therefore created with create() and deletes
+ * itself once it was closed and all buffers are back, see MessagePoolPtr.
+ * The buffers are allocated on the NUMA node given to create(), or by the
+ * default policy of the OS.
+ */
+class MessagePool {
+   private:
+    size_t buffer_size;
+    size_t max_buffers;
+    // NUMA node of the buffers, -1 for the default policy
+    int numa_node;
+    std::mutex m;
+    std::vector<char *> free_buffers;
+    // buffers handed out and not yet released
+    size_t in_flight;
+    // set by close(), the last release deletes the pool
+    bool closed;
+
+    MessagePool(size_t buffer_size, size_t max_buffers, int numa_node)
+        : buffer_size(buffer_size),
+          max_buffers(max_buffers),
+          numa_node(numa_node),
+          in_flight(0),
+          closed(false) {
+        free_buffers.reserve(max_buffers);
+    }
+
+    ~MessagePool() {
+        for (char *buffer : free_buffers) {
+            free_on_node(buffer, buffer_size);
+        }
+    }
+
+    static void free_message(void *data, void *hint) {
+        static_cast<MessagePool *>(hint)->release(static_cast<char *>(data));
+    }
+
+   public:
+    static MessagePool *create(size_t buffer_size,
+                               size_t max_buffers = MESSAGE_POOL_BUFFERS,
+                               int numa_node = -1) {
+        return new MessagePool(buffer_size, max_buffers, numa_node);
+    }
+
+    size_t get_buffer_size() const { return buffer_size; }
+
+    // buffer of buffer_size bytes, has to be passed to release() or sent
+    // with message()
+    char *acquire() {
+        std::lock_guard<std::mutex> lock(m);
+        in_flight++;
+        if (free_buffers.empty()) {
+            return static_cast<char *>(
+                allocate_on_node(buffer_size, numa_node));
+        }
+        char *buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return buffer;
+    }
+
+    void release(char *buffer) {
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if (free_buffers.size() < max_buffers) {
+                free_buffers.push_back(buffer);
+            } else {
+                free_on_node(buffer, buffer_size);
+            }
+            in_flight--;
+            last = closed && in_flight == 0;
+        }
+        if (last) {
+            delete this;
+        }
+    }
+
+    /**
+     * Message with the first bytes of the buffer as content. The buffer is
+     * released once ZMQ is done with the message.
+     */
+    zmq::message_t message(char *buffer, size_t bytes) {
+        return zmq::message_t(buffer, bytes, &MessagePool::free_message, this);
+    }
+
+    // delete the pool once all buffers are released
+    void close() {
+        bool last = false;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            closed = true;
+            last = in_flight == 0;
+        }
+        if (last) {
+            delete this;
+        }
+    }
+};
+
+struct MessagePoolCloser {
+    void operator()(MessagePool *pool) const { pool->close(); }
+};
+
+typedef std::unique_ptr<MessagePool, MessagePoolCloser> MessagePoolPtr;
+
+/**
+ * Flits of the next message, collected in a buffer of a MessagePool. Has the
+ * part of the std::vector interface used by collect_batch() and
+ * collect_frame(). The buffer is acquired with the first flit.
+ */
+template <typename Flit>
+class PooledFlits {
+   private:
+    MessagePool &pool;
+    Flit *flits;
+    size_t count;
+
+   public:
+    explicit PooledFlits(MessagePool &pool)
+        : pool(pool), flits(nullptr), count(0) {}
+
+    PooledFlits(const PooledFlits &) = delete;
+    PooledFlits &operator=(const PooledFlits &) = delete;
+
+    ~PooledFlits() {
+        if (flits != nullptr) {
+            pool.release(reinterpret_cast<char *>(flits));
+        }
+    }
+
+    // maximum number of flits in a message
+    size_t capacity() const { return pool.get_buffer_size() / sizeof(Flit); }
+
+    size_t size() const { return count; }
+
+    bool empty() const { return count == 0; }
+
+    void clear() { count = 0; }
+
+    void push_back(const Flit &flit) {
+        if (flits == nullptr) {
+            flits = reinterpret_cast<Flit *>(pool.acquire());
+        }
+        flits[count++] = flit;
+    }
+
+    Flit &back() { return flits[count - 1]; }
+
+    /**
+     * Message that contains the collected flits without copying them. The
+     * next flit is collected in a new buffer.
+     */
+    zmq::message_t message() {
+        zmq::message_t msg = pool.message(reinterpret_cast<char *>(flits),
+                                          count * sizeof(Flit));
+        flits = nullptr;
+        count = 0;
+        return msg;
+    }
+};
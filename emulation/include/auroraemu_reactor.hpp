@@ -0,0 +1,233 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include <zmq.hpp>
+
+// default number of threads of an AuroraEmuReactor
+const int REACTOR_THREADS = 2;
+// number of iterations without progress before a reactor thread sleeps
+const int REACTOR_SPIN_COUNT = 1000;
+// time in milliseconds an idle reactor thread sleeps before it checks the
+// user streams again. Incoming messages wake it up earlier
+const int REACTOR_POLL_INTERVAL = 1;
+
+/**
+ * Work of an emulated core that is executed by an AuroraEmuReactor. All
+ * methods of a task are called by the same reactor thread and must not
+ * block.
+ */
+class AuroraEmuReactorTask {
+   public:
+    virtual ~AuroraEmuReactorTask() {}
+
+    // sockets an idle reactor thread waits on for incoming messages
+    virtual std::vector<zmq::socket_t *> reactor_sockets() = 0;
+
+    /**
+     * Move data between the sockets and the user streams as far as
+     * possible without blocking. Returns true if data was moved or the task
+     * waits for a deadline, so the thread should not go to sleep.
+     */
+    virtual bool reactor_step() = 0;
+};
+
+/**
+ * Thread of an AuroraEmuReactor that steps through its tasks in a loop.
+ * After REACTOR_SPIN_COUNT iterations without progress, it sleeps in a poll
+ * on the sockets of all tasks for up to REACTOR_POLL_INTERVAL.
+ */
+class AuroraEmuReactorThread {
+   private:
+    // guards tasks. Held by the thread while it steps through the tasks
+    std::mutex m;
+    std::vector<AuroraEmuReactorTask *> tasks;
+    // set if tasks changed and the poll items have to be rebuilt
+    bool changed;
+    // number of threads that wait for the mutex to add or remove a task
+    std::atomic<int> waiting;
+    // wakes the thread up from poll if tasks are added or removed
+    int wake_fd;
+    std::atomic<bool> running;
+    std::thread thread;
+
+    void run() {
+        // the first item is the wake up event
+        std::vector<zmq::pollitem_t> items;
+        int idle = 0;
+        while (running) {
+            std::unique_lock<std::mutex> lock(m);
+            if (changed) {
+                items.clear();
+                items.push_back({nullptr, wake_fd, ZMQ_POLLIN, 0});
+                for (AuroraEmuReactorTask *task : tasks) {
+                    for (zmq::socket_t *socket : task->reactor_sockets()) {
+                        items.push_back({*socket, 0, ZMQ_POLLIN, 0});
+                    }
+                }
+                changed = false;
+            }
+            if (idle >= REACTOR_SPIN_COUNT) {
+                zmq::poll(items.data(), items.size(),
+                          std::chrono::milliseconds(REACTOR_POLL_INTERVAL));
+                if (items[0].revents & ZMQ_POLLIN) {
+                    uint64_t value;
+                    // only resets the event
+                    (void)::read(wake_fd, &value, sizeof(value));
+                }
+            }
+            bool progress = false;
+            for (AuroraEmuReactorTask *task : tasks) {
+                progress |= task->reactor_step();
+            }
+            idle = progress ? 0 : idle + 1;
+            lock.unlock();
+            // let threads that add or remove tasks take the mutex
+            while (waiting > 0) {
+                std::this_thread::yield();
+            }
+            if (!progress) {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    void wake() {
+        uint64_t value = 1;
+        // fails only if the counter would overflow, the thread is woken up
+        // anyway then
+        (void)::write(wake_fd, &value, sizeof(value));
+    }
+
+    /**
+     * Take the mutex while the thread is between two iterations
+     */
+    std::unique_lock<std::mutex> interrupt() {
+        waiting++;
+        wake();
+        std::unique_lock<std::mutex> lock(m);
+        waiting--;
+        return lock;
+    }
+
+   public:
+    AuroraEmuReactorThread()
+        : changed(true),
+          waiting(0),
+          wake_fd(eventfd(0, EFD_NONBLOCK)),
+          running(true) {
+        if (wake_fd < 0) {
+            throw std::runtime_error("Could not create reactor event");
+        }
+        thread = std::thread(&AuroraEmuReactorThread::run, this);
+    }
+
+    ~AuroraEmuReactorThread() {
+        running = false;
+        wake();
+        thread.join();
+        ::close(wake_fd);
+    }
+
+    void add(AuroraEmuReactorTask &task) {
+        std::unique_lock<std::mutex> lock = interrupt();
+        tasks.push_back(&task);
+        changed = true;
+    }
+
+    /**
+     * Remove the task. The thread does not access the task anymore after
+     * this returns.
+     */
+    void remove(AuroraEmuReactorTask &task) {
+        std::unique_lock<std::mutex> lock = interrupt();
+        tasks.erase(std::remove(tasks.begin(), tasks.end(), &task),
+                    tasks.end());
+        changed = true;
+    }
+};
+
+/**
+ * Small pool of threads that runs the send and receive paths of many
+ * emulated cores, together with a ZMQ context shared by their sockets.
+ * Without a reactor, every core has its own context and up to four
+ * threads. With a reactor, the number of threads stays the same
+ * independent of the number of cores. Every core is assigned to the thread
+ * with the fewest cores. The reactor has to outlive its cores.
+ */
+class AuroraEmuReactor {
+   private:
+    zmq::context_t ctx;
+    std::vector<std::unique_ptr<AuroraEmuReactorThread>> threads;
+    // thread index of every task and the number of tasks per thread
+    std::map<AuroraEmuReactorTask *, size_t> assignment;
+    std::vector<size_t> load;
+    std::mutex m;
+
+   public:
+    /**
+     * num_threads: number of threads that step through the cores
+     * io_threads: number of I/O threads of the shared ZMQ context
+     */
+    explicit AuroraEmuReactor(int num_threads = REACTOR_THREADS,
+                              int io_threads = 1)
+        : ctx(io_threads), load(num_threads, 0) {
+        if (num_threads < 1) {
+            throw std::invalid_argument("Reactor needs at least one thread");
+        }
+        for (int i = 0; i < num_threads; i++) {
+            threads.emplace_back(new AuroraEmuReactorThread());
+        }
+    }
+
+    // context for all sockets of the tasks
+    zmq::context_t &context() { return ctx; }
+
+    int get_num_threads() const { return threads.size(); }
+
+    void add(AuroraEmuReactorTask &task) {
+        std::lock_guard<std::mutex> lock(m);
+        size_t thread =
+            std::min_element(load.begin(), load.end()) - load.begin();
+        assignment[&task] = thread;
+        load[thread]++;
+        threads[thread]->add(task);
+    }
+
+    void remove(AuroraEmuReactorTask &task) {
+        std::lock_guard<std::mutex> lock(m);
+        auto it = assignment.find(&task);
+        if (it == assignment.end()) {
+            return;
+        }
+        threads[it->second]->remove(task);
+        load[it->second]--;
+        assignment.erase(it);
+    }
+};
@@ -0,0 +1,143 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Status and counter registers of an emulated Aurora core. The addresses
+ * match the control s axi interface of the hardware (see host/Aurora.hpp),
+ * so the host code can read the registers of emulated and real cores the
+ * same way. Counters are updated lock-free by the forwarding threads.
+ */
+class AuroraEmuRegisters {
+   public:
+    // control s axi addresses
+    enum Address : uint32_t {
+        CORE_RESET_ADDRESS = 0x10,
+        COUNTER_RESET_ADDRESS = 0x14,
+        CONFIGURATION_ADDRESS = 0x18,
+        FIFO_THRESHOLDS_ADDRESS = 0x1c,
+        CORE_STATUS_ADDRESS = 0x20,
+        STATUS_NOT_OK_COUNT_ADDRESS = 0x24,
+        FIFO_STATUS_ADDRESS = 0x28,
+        FIFO_RX_OVERFLOW_COUNT_ADDRESS = 0x2c,
+        FIFO_TX_OVERFLOW_COUNT_ADDRESS = 0x30,
+        NFC_FULL_TRIGGER_COUNT_ADDRESS = 0x34,
+        NFC_EMPTY_TRIGGER_COUNT_ADDRESS = 0x38,
+        NFC_LATENCY_COUNT_ADDRESS = 0x3c,
+        TX_COUNT_ADDRESS = 0x40,
+        RX_COUNT_ADDRESS = 0x44,
+        GT_NOT_READY_0_COUNT_ADDRESS = 0x48,
+        GT_NOT_READY_1_COUNT_ADDRESS = 0x4c,
+        GT_NOT_READY_2_COUNT_ADDRESS = 0x50,
+        GT_NOT_READY_3_COUNT_ADDRESS = 0x54,
+        LINE_DOWN_0_COUNT_ADDRESS = 0x58,
+        LINE_DOWN_1_COUNT_ADDRESS = 0x5c,
+        LINE_DOWN_2_COUNT_ADDRESS = 0x60,
+        LINE_DOWN_3_COUNT_ADDRESS = 0x64,
+        PLL_NOT_LOCKED_COUNT_ADDRESS = 0x68,
+        MMCM_NOT_LOCKED_COUNT_ADDRESS = 0x6c,
+        HARD_ERR_COUNT_ADDRESS = 0x70,
+        SOFT_ERR_COUNT_ADDRESS = 0x74,
+        CHANNEL_DOWN_COUNT_ADDRESS = 0x78,
+        FRAMES_RECEIVED_ADDRESS = 0x7c,
+        FRAMES_WITH_ERRORS_ADDRESS = 0x80
+    };
+
+    // core status of a healthy link: power good, all lanes up, PLL locked
+    // and channel up
+    enum CoreStatus : uint32_t { CORE_STATUS_OK = 0x000011ff };
+
+    // masks for fifo status bits
+    enum FifoStatus : uint32_t {
+        FIFO_TX_PROG_EMPTY = 0x01,
+        FIFO_TX_ALMOST_EMPTY = 0x02,
+        FIFO_TX_PROG_FULL = 0x04,
+        FIFO_TX_ALMOST_FULL = 0x08,
+        FIFO_RX_PROG_EMPTY = 0x10,
+        FIFO_RX_ALMOST_EMPTY = 0x20,
+        FIFO_RX_PROG_FULL = 0x40,
+        FIFO_RX_ALMOST_FULL = 0x80
+    };
+
+   private:
+    static const uint32_t NUM_REGISTERS = (FRAMES_WITH_ERRORS_ADDRESS >> 2) + 1;
+
+    std::atomic<uint32_t> registers[NUM_REGISTERS];
+
+    static bool valid(uint32_t address) {
+        return (address & 0x3) == 0 && (address >> 2) < NUM_REGISTERS;
+    }
+
+   public:
+    /**
+     * fifo_width: width of the user streams in bytes
+     * fifo_depth: number of flits of the RX FIFO, a power of two
+     */
+    AuroraEmuRegisters(uint32_t fifo_width, uint32_t fifo_depth,
+                       uint32_t prog_full, uint32_t prog_empty, bool has_tkeep,
+                       bool has_tlast) {
+        for (uint32_t i = 0; i < NUM_REGISTERS; i++) {
+            registers[i].store(0, std::memory_order_relaxed);
+        }
+        uint32_t log_depth = 0;
+        while ((1u << (log_depth + 1)) <= fifo_depth) {
+            log_depth++;
+        }
+        registers[CONFIGURATION_ADDRESS >> 2] =
+            (has_tkeep ? 0x1 : 0x0) | (has_tlast ? 0x2 : 0x0) |
+            ((fifo_width << 2) & 0x7fc) | ((log_depth << 11) & 0x7800);
+        registers[FIFO_THRESHOLDS_ADDRESS >> 2] =
+            ((prog_full & 0xffff) << 16) | (prog_empty & 0xffff);
+        registers[CORE_STATUS_ADDRESS >> 2] = CORE_STATUS_OK;
+    }
+
+    AuroraEmuRegisters(const AuroraEmuRegisters &) = delete;
+    AuroraEmuRegisters &operator=(const AuroraEmuRegisters &) = delete;
+
+    /**
+     * Increment a counter. Called by the forwarding threads on every
+     * message, so it only uses a relaxed atomic add.
+     */
+    void add(uint32_t address, uint32_t count) {
+        registers[address >> 2].fetch_add(count, std::memory_order_relaxed);
+    }
+
+    /**
+     * Returns 0 for addresses outside of the register file like the
+     * hardware does
+     */
+    uint32_t read(uint32_t address) const {
+        if (!valid(address)) {
+            return 0;
+        }
+        return registers[address >> 2].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Set all counters back to 0. Configuration and status are kept.
+     */
+    void reset_counter() {
+        for (uint32_t address = STATUS_NOT_OK_COUNT_ADDRESS;
+             address <= FRAMES_WITH_ERRORS_ADDRESS; address += 4) {
+            if (address != FIFO_STATUS_ADDRESS) {
+                registers[address >> 2].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+};
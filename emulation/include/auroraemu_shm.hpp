@@ -0,0 +1,284 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <string>
+
+// default number of flit slots of a shared memory ring
+const uint32_t SHM_RING_SLOTS = 4096;
+// number of empty polls before a waiting thread is parked on the futex
+const int SHM_RING_SPIN_COUNT = 1000;
+// upper bound in microseconds a parked thread sleeps without notification
+const int SHM_RING_WAIT_TIMEOUT = 1000;
+// marks a fully initialized ring
+const uint32_t SHM_RING_MAGIC = 0x41555241;
+
+/**
+ * Control block at the beginning of the shared memory region. Producer and
+ * consumer indices live on separate cache lines. The sequence counters are
+ * used as futex words to park and wake the other side.
+ */
+struct ShmRingHeader {
+    alignas(64) std::atomic<uint64_t> head;
+    alignas(64) std::atomic<uint64_t> tail;
+    alignas(64) std::atomic<uint32_t> data_seq;
+    std::atomic<uint32_t> consumer_waiting;
+    alignas(64) std::atomic<uint32_t> space_seq;
+    std::atomic<uint32_t> producer_waiting;
+    alignas(64) uint32_t slots;
+    // size of a slot in bytes, checked by the consumer
+    uint32_t slot_size;
+    std::atomic<uint32_t> magic;
+};
+
+inline void shm_futex_wait(std::atomic<uint32_t> &word, uint32_t expected) {
+    struct timespec timeout = {0, SHM_RING_WAIT_TIMEOUT * 1000};
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAIT,
+            expected, &timeout, nullptr, 0);
+}
+
+inline void shm_futex_wake(std::atomic<uint32_t> &word) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(&word), FUTEX_WAKE,
+            INT_MAX, nullptr, nullptr, 0);
+}
+
+/**
+ * Lock-free single-producer/single-consumer ring of flits in a named POSIX
+ * shared memory object. The sending core creates the ring, the receiving
+ * core opens it by name, which also works across processes on one host.
+ * T has to be trivially copyable.
+ */
+template <typename T>
+class ShmRing {
+   private:
+    ShmRingHeader *header;
+    T *slots;
+    size_t mapped_size;
+    // the creator of the ring removes the shared memory object
+    bool owner;
+    std::string shm_name;
+
+    static std::string to_shm_name(const std::string &name) {
+        std::string shm_name = "/auroraemu_" + name;
+        std::replace(shm_name.begin() + 1, shm_name.end(), '/', '_');
+        return shm_name;
+    }
+
+    static size_t region_size(uint32_t slots) {
+        return sizeof(ShmRingHeader) + slots * sizeof(T);
+    }
+
+    void map(int fd, size_t size) {
+        void *region =
+            mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (region == MAP_FAILED) {
+            ::close(fd);
+            throw std::runtime_error("Could not map shared memory " +
+                                     shm_name);
+        }
+        mapped_size = size;
+        header = static_cast<ShmRingHeader *>(region);
+        slots = reinterpret_cast<T *>(header + 1);
+    }
+
+   public:
+    ShmRing()
+        : header(nullptr), slots(nullptr), mapped_size(0), owner(false) {}
+
+    ShmRing(const ShmRing &) = delete;
+    ShmRing &operator=(const ShmRing &) = delete;
+
+    ~ShmRing() { close(); }
+
+    /**
+     * Create a new ring as producer. An existing object with the same name
+     * is replaced.
+     */
+    void create(const std::string &name, uint32_t num_slots) {
+        shm_name = to_shm_name(name);
+        shm_unlink(shm_name.c_str());
+        int fd = shm_open(shm_name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0 || ftruncate(fd, region_size(num_slots)) != 0) {
+            throw std::runtime_error("Could not create shared memory " +
+                                     shm_name);
+        }
+        map(fd, region_size(num_slots));
+        ::close(fd);
+        owner = true;
+        new (header) ShmRingHeader();
+        header->head.store(0);
+        header->tail.store(0);
+        header->data_seq.store(0);
+        header->consumer_waiting.store(0);
+        header->space_seq.store(0);
+        header->producer_waiting.store(0);
+        header->slots = num_slots;
+        header->slot_size = sizeof(T);
+        header->magic.store(SHM_RING_MAGIC, std::memory_order_release);
+    }
+
+    /**
+     * Open an existing ring as consumer. Returns false if the ring was not
+     * created and initialized yet.
+     */
+    bool open(const std::string &name) {
+        shm_name = to_shm_name(name);
+        int fd = shm_open(shm_name.c_str(), O_RDWR, 0600);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 ||
+            static_cast<size_t>(st.st_size) < sizeof(ShmRingHeader)) {
+            ::close(fd);
+            return false;
+        }
+        map(fd, st.st_size);
+        ::close(fd);
+        if (header->magic.load(std::memory_order_acquire) != SHM_RING_MAGIC ||
+            header->slot_size != sizeof(T) ||
+            mapped_size < region_size(header->slots)) {
+            close();
+            return false;
+        }
+        return true;
+    }
+
+    void close() {
+        if (header != nullptr) {
+            munmap(header, mapped_size);
+            header = nullptr;
+            slots = nullptr;
+            if (owner) {
+                shm_unlink(shm_name.c_str());
+                owner = false;
+            }
+        }
+    }
+
+    bool is_open() const { return header != nullptr; }
+
+    /**
+     * Write count flits into the ring. Blocks while the ring is full.
+     * Returns the number of written flits, which is only less than count if
+     * running was cleared.
+     */
+    size_t push(const T *flits, size_t count,
+                const std::atomic<bool> &running) {
+        size_t written = 0;
+        int spins = 0;
+        uint64_t head = header->head.load(std::memory_order_relaxed);
+        while (written < count) {
+            uint64_t tail = header->tail.load(std::memory_order_acquire);
+            size_t space = header->slots - (head - tail);
+            if (space > 0) {
+                size_t n = std::min(space, count - written);
+                for (size_t i = 0; i < n; i++) {
+                    std::memcpy(&slots[(head + i) % header->slots],
+                                &flits[written + i], sizeof(T));
+                }
+                head += n;
+                written += n;
+                header->head.store(head, std::memory_order_seq_cst);
+                if (header->consumer_waiting.load(std::memory_order_seq_cst)) {
+                    header->data_seq.fetch_add(1);
+                    shm_futex_wake(header->data_seq);
+                }
+                spins = 0;
+                continue;
+            }
+            if (!running) {
+                break;
+            }
+            if (spins++ < SHM_RING_SPIN_COUNT) {
+                continue;
+            }
+            uint32_t seq = header->space_seq.load(std::memory_order_seq_cst);
+            header->producer_waiting.store(1, std::memory_order_seq_cst);
+            if (header->tail.load(std::memory_order_seq_cst) == tail &&
+                running) {
+                shm_futex_wait(header->space_seq, seq);
+            }
+            header->producer_waiting.store(0, std::memory_order_relaxed);
+        }
+        return written;
+    }
+
+    /**
+     * Read up to max_count flits from the ring. Blocks while the ring is
+     * empty. Returns 0 only if running was cleared.
+     */
+    size_t pop(T *flits, size_t max_count,
+               const std::atomic<bool> &running) {
+        int spins = 0;
+        uint64_t tail = header->tail.load(std::memory_order_relaxed);
+        while (true) {
+            uint64_t head = header->head.load(std::memory_order_acquire);
+            if (head != tail) {
+                size_t n = std::min(static_cast<size_t>(head - tail), max_count);
+                for (size_t i = 0; i < n; i++) {
+                    std::memcpy(&flits[i], &slots[(tail + i) % header->slots],
+                                sizeof(T));
+                }
+                header->tail.store(tail + n, std::memory_order_seq_cst);
+                if (header->producer_waiting.load(std::memory_order_seq_cst)) {
+                    header->space_seq.fetch_add(1);
+                    shm_futex_wake(header->space_seq);
+                }
+                return n;
+            }
+            if (!running) {
+                return 0;
+            }
+            if (spins++ < SHM_RING_SPIN_COUNT) {
+                continue;
+            }
+            uint32_t seq = header->data_seq.load(std::memory_order_seq_cst);
+            header->consumer_waiting.store(1, std::memory_order_seq_cst);
+            if (header->head.load(std::memory_order_seq_cst) == tail &&
+                running) {
+                shm_futex_wait(header->data_seq, seq);
+            }
+            header->consumer_waiting.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * Wake up producer and consumer so they can check their running flag
+     */
+    void wake() {
+        if (header != nullptr) {
+            header->data_seq.fetch_add(1);
+            shm_futex_wake(header->data_seq);
+            header->space_seq.fetch_add(1);
+            shm_futex_wake(header->space_seq);
+        }
+    }
+};
@@ -0,0 +1,519 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+// default clock frequency of the user kernels in MHz
+const double SIM_KERNEL_CLOCK_MHZ = 300.0;
+// time in microseconds without new flits from the user kernels after which
+// they are considered to be waiting for data and virtual time advances, if
+// no kernel threads were added to the simulation
+const int SIM_QUIESCENCE_US = 1000;
+// directory of the status files of the threads of the process
+const std::string SIM_TASK_PATH = "/proc/self/task/";
+// time in microseconds the simulation thread sleeps between two polls of
+// the user streams
+const int SIM_POLL_INTERVAL = 10;
+
+/**
+ * Emulated core seen by an AuroraEmuSimulation. The flits are passed as raw
+ * bytes, so the simulation does not depend on the stream type.
+ */
+class AuroraEmuSimulationPort {
+   public:
+    virtual ~AuroraEmuSimulationPort() {}
+
+    // read the next flit the user kernel wrote without blocking. Returns
+    // false if there is none
+    virtual bool sim_read(std::string &flit) = 0;
+
+    /**
+     * Pass a flit to the user kernel without blocking. Returns false if the
+     * stream is full. source is the id of the sending core and time_ns the
+     * virtual arrival time.
+     */
+    virtual bool sim_write(const std::string &flit, const std::string &source,
+                           double time_ns) = 0;
+};
+
+/**
+ * Link parameters of a port, taken from the AuroraEmuConfig of the core
+ */
+struct AuroraEmuSimulationLink {
+    double line_rate_gbps;
+    double encoding_efficiency;
+    int link_latency_ns;
+    // pause the senders while more than rx_fifo_prog_full flits wait for
+    // the user kernel, until it drained to rx_fifo_prog_empty
+    bool nfc;
+    uint32_t rx_fifo_prog_full;
+    uint32_t rx_fifo_prog_empty;
+    int nfc_latency_us;
+};
+
+/**
+ * Deterministic discrete-event model of emulated cores in virtual time.
+ * Cores created with a simulation in their AuroraEmuConfig do not use ZMQ,
+ * the simulation thread moves their flits instead. The user kernels keep
+ * running as threads on the same streams, so existing host code runs
+ * unchanged.
+ *
+ * The simulation alternates between two phases. First, it collects the
+ * flits the kernels write in reaction to the last delivered flits, until
+ * all kernels wait for data. Each flit is stamped with the virtual time
+ * plus the initiation interval of its kernel and transmitted at the line
+ * rate of its link, one flit after the other. Then, virtual time advances
+ * to the next arrival and the flits arriving at that time are passed to
+ * the receiving kernels. Events at the same time are processed in the
+ * order of the sending cores.
+ *
+ * Kernel threads that call add_kernel() are known to wait once all of them
+ * are blocked and did not run between two polls, see kernels_parked(). The
+ * virtual time then does not depend on the load of the host, as long as
+ * the kernels only block on their streams. Without added kernels, the
+ * kernels are assumed to wait once no kernel wrote a flit for
+ * quiescence_us, which only holds if every kernel reacts within that time.
+ *
+ * Cores are matched by id like on the switch, so several cores with the
+ * same id all receive the flits. Batching, framing and pacing of the
+ * config are ignored, every flit is modeled individually.
+ */
+class AuroraEmuSimulation {
+   private:
+    struct PortState {
+        AuroraEmuSimulationPort *port;
+        std::string id;
+        std::string remote_id;
+        // serialization time of a flit in ps
+        int64_t flit_ps;
+        int64_t latency_ps;
+        AuroraEmuSimulationLink link;
+        // virtual time in ps the link and the kernel are busy until
+        int64_t link_free_ps;
+        int64_t kernel_free_ps;
+        // flits held back while the port is paused by NFC
+        std::deque<std::string> tx_queue;
+        bool paused;
+        // arrived flits that did not fit into the user stream, with the
+        // index of their source port
+        std::deque<std::pair<std::string, size_t>> rx_backlog;
+        // ports paused by this port
+        std::vector<size_t> paused_sources;
+    };
+
+    enum EventType { ARRIVAL, RESUME };
+
+    struct Event {
+        int64_t time_ps;
+        size_t source;
+        uint64_t seq;
+        EventType type;
+        size_t destination;
+        std::string flit;
+
+        // order of the priority queue, the earliest event first
+        bool operator<(const Event &other) const {
+            if (time_ps != other.time_ps) {
+                return time_ps > other.time_ps;
+            }
+            if (source != other.source) {
+                return source > other.source;
+            }
+            return seq > other.seq;
+        }
+    };
+
+    int64_t kernel_ii_ps;
+    double kernel_clock_mhz;
+    std::chrono::microseconds quiescence;
+
+    // thread ids of the kernels added by add_kernel(). Guarded by m
+    std::vector<pid_t> kernels;
+    // context switches of the kernels at the last poll at which all of them
+    // were blocked, empty if they were not. Only used by the simulation
+    // thread
+    std::vector<uint64_t> kernel_switches;
+
+    // guards everything below, held by the simulation thread while it
+    // processes events
+    std::mutex m;
+    // removed ports stay in the vector, so the indices stay valid
+    std::vector<std::unique_ptr<PortState>> ports;
+    std::priority_queue<Event> events;
+    uint64_t next_seq;
+    int64_t now_ps;
+    uint64_t dropped;
+
+    // set while the kernels wait and no events are left
+    std::atomic<bool> idle;
+    std::atomic<bool> running;
+    std::thread thread;
+
+    static int64_t to_ps(double ns) { return std::llround(ns * 1000.0); }
+
+    // send a flit that is ready at the given time over the link of the
+    // source port
+    void transmit(size_t source, const std::string &flit, int64_t ready_ps) {
+        PortState &p = *ports[source];
+        p.link_free_ps = std::max(p.link_free_ps, ready_ps) + p.flit_ps;
+        int64_t arrival = p.link_free_ps + p.latency_ps;
+        bool delivered = false;
+        for (size_t d = 0; d < ports.size(); d++) {
+            if (ports[d] && ports[d]->id == p.remote_id) {
+                events.push({arrival, source, next_seq++, ARRIVAL, d, flit});
+                delivered = true;
+            }
+        }
+        if (!delivered) {
+            dropped++;
+        }
+    }
+
+    // read and transmit the new flits of all kernels. Returns true if any
+    // flit was read
+    bool collect() {
+        bool progress = false;
+        std::string flit;
+        for (size_t i = 0; i < ports.size(); i++) {
+            if (!ports[i]) {
+                continue;
+            }
+            PortState &p = *ports[i];
+            while (p.port->sim_read(flit)) {
+                progress = true;
+                // the kernel writes one flit per initiation interval
+                p.kernel_free_ps =
+                    std::max(p.kernel_free_ps, now_ps) + kernel_ii_ps;
+                if (p.paused) {
+                    p.tx_queue.push_back(flit);
+                } else {
+                    transmit(i, flit, p.kernel_free_ps);
+                }
+            }
+        }
+        return progress;
+    }
+
+    // pass waiting flits to the kernels. Returns true if any flit was
+    // passed
+    bool deliver() {
+        bool progress = false;
+        for (size_t i = 0; i < ports.size(); i++) {
+            if (!ports[i]) {
+                continue;
+            }
+            PortState &p = *ports[i];
+            while (!p.rx_backlog.empty()) {
+                const std::pair<std::string, size_t> &f = p.rx_backlog.front();
+                const std::string &source =
+                    ports[f.second] ? ports[f.second]->id : p.remote_id;
+                if (!p.port->sim_write(f.first, source, now_ps / 1000.0)) {
+                    break;
+                }
+                p.rx_backlog.pop_front();
+                progress = true;
+            }
+            if (p.link.nfc && !p.paused_sources.empty() &&
+                p.rx_backlog.size() <= p.link.rx_fifo_prog_empty) {
+                // XON reaches the senders after the NFC latency
+                for (size_t s : p.paused_sources) {
+                    events.push({now_ps + to_ps(p.link.nfc_latency_us * 1000.0),
+                                 i, next_seq++, RESUME, s, std::string()});
+                }
+                p.paused_sources.clear();
+            }
+        }
+        return progress;
+    }
+
+    bool has_backlog() const {
+        for (const auto &p : ports) {
+            if (p && !p->rx_backlog.empty()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void process(Event &e) {
+        if (!ports[e.destination]) {
+            dropped++;
+            return;
+        }
+        PortState &p = *ports[e.destination];
+        if (e.type == RESUME) {
+            p.paused = false;
+            for (const std::string &flit : p.tx_queue) {
+                transmit(e.destination, flit, now_ps);
+            }
+            p.tx_queue.clear();
+            return;
+        }
+        p.rx_backlog.emplace_back(std::move(e.flit), e.source);
+        if (p.link.nfc && p.rx_backlog.size() >= p.link.rx_fifo_prog_full &&
+            ports[e.source] && !ports[e.source]->paused) {
+            // XOFF stops the sender immediately in the model
+            ports[e.source]->paused = true;
+            p.paused_sources.push_back(e.source);
+        }
+    }
+
+    /**
+     * Read the scheduler state of a thread of the process. Returns true if
+     * it is blocked, and its number of context switches in switches. A
+     * thread that exited is blocked as well.
+     */
+    static bool thread_blocked(pid_t tid, uint64_t &switches) {
+        std::ifstream f(SIM_TASK_PATH + std::to_string(tid) + "/status");
+        if (!f.good()) {
+            switches = 0;
+            return true;
+        }
+        bool blocked = false;
+        switches = 0;
+        std::string key;
+        while (f >> key) {
+            if (key == "State:") {
+                std::string state;
+                f >> state;
+                // sleeping in a wait on a condition variable or a mutex
+                blocked = state == "S";
+            } else if (key == "voluntary_ctxt_switches:" ||
+                       key == "nonvoluntary_ctxt_switches:") {
+                uint64_t count;
+                f >> count;
+                switches += count;
+            }
+            f.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        }
+        return blocked;
+    }
+
+    /**
+     * Returns true if all added kernels were blocked at this and the last
+     * poll and did not run in between. A kernel that is preempted by the
+     * host is runnable, so a loaded host only delays the decision.
+     */
+    bool kernels_parked() {
+        std::vector<uint64_t> switches(kernels.size());
+        bool blocked = true;
+        for (size_t i = 0; i < kernels.size() && blocked; i++) {
+            blocked = thread_blocked(kernels[i], switches[i]);
+        }
+        bool parked = blocked && switches == kernel_switches;
+        if (blocked) {
+            kernel_switches = switches;
+        } else {
+            kernel_switches.clear();
+        }
+        return parked;
+    }
+
+    void run() {
+        auto last_activity = std::chrono::steady_clock::now();
+        while (running) {
+            std::unique_lock<std::mutex> lock(m);
+            bool progress = deliver();
+            progress |= collect();
+            auto now = std::chrono::steady_clock::now();
+            if (progress) {
+                last_activity = now;
+                kernel_switches.clear();
+            }
+            bool quiet = kernels.empty()
+                             ? now - last_activity >= quiescence
+                             : !progress && kernels_parked();
+            idle = quiet && events.empty() && !has_backlog();
+            if (!quiet || events.empty()) {
+                lock.unlock();
+                std::this_thread::sleep_for(
+                    std::chrono::microseconds(SIM_POLL_INTERVAL));
+                continue;
+            }
+            // all kernels wait, advance to the next event
+            now_ps = events.top().time_ps;
+            while (!events.empty() && events.top().time_ps == now_ps) {
+                Event e = events.top();
+                events.pop();
+                process(e);
+            }
+            deliver();
+            last_activity = std::chrono::steady_clock::now();
+            kernel_switches.clear();
+        }
+    }
+
+   public:
+    /**
+     * Start the simulation thread
+     *
+     * kernel_clock_mhz: clock frequency of the user kernels
+     * kernel_ii: initiation interval of the kernels in cycles, the time
+     *            between two flits a kernel writes
+     * quiescence_us: time without new flits after which the kernels are
+     *                considered to wait for data, if no kernels were added
+     */
+    explicit AuroraEmuSimulation(double kernel_clock_mhz = SIM_KERNEL_CLOCK_MHZ,
+                                 int kernel_ii = 1,
+                                 int quiescence_us = SIM_QUIESCENCE_US)
+        : kernel_ii_ps(to_ps(kernel_ii * 1000.0 / kernel_clock_mhz)),
+          kernel_clock_mhz(kernel_clock_mhz),
+          quiescence(quiescence_us),
+          next_seq(0),
+          now_ps(0),
+          dropped(0),
+          idle(false),
+          running(true) {
+        thread = std::thread(&AuroraEmuSimulation::run, this);
+    }
+
+    AuroraEmuSimulation(const AuroraEmuSimulation &) = delete;
+    AuroraEmuSimulation &operator=(const AuroraEmuSimulation &) = delete;
+
+    ~AuroraEmuSimulation() {
+        running = false;
+        thread.join();
+    }
+
+    /**
+     * Add a core. The flits of the core are sent to all cores with the id
+     * remote_id. flit_bytes is the payload of a flit on the link.
+     */
+    void add(AuroraEmuSimulationPort &port, const std::string &id,
+             const std::string &remote_id, size_t flit_bytes,
+             const AuroraEmuSimulationLink &link) {
+        std::unique_ptr<PortState> p(new PortState());
+        p->port = &port;
+        p->id = id;
+        p->remote_id = remote_id;
+        p->flit_ps = to_ps(flit_bytes * 8.0 /
+                           (link.line_rate_gbps * link.encoding_efficiency));
+        p->latency_ps = to_ps(link.link_latency_ns);
+        p->link = link;
+        p->link_free_ps = 0;
+        p->kernel_free_ps = 0;
+        p->paused = false;
+        std::lock_guard<std::mutex> lock(m);
+        ports.push_back(std::move(p));
+    }
+
+    /**
+     * Add the calling thread as user kernel. Virtual time only advances
+     * while all added kernels are blocked, instead of after quiescence_us
+     * without new flits. The kernels must not block on anything but their
+     * streams, e.g. sleep, while they still have flits to write.
+     */
+    void add_kernel() {
+        pid_t tid = syscall(SYS_gettid);
+        std::lock_guard<std::mutex> lock(m);
+        kernels.push_back(tid);
+    }
+
+    /**
+     * Remove the calling thread from the user kernels. Kernel threads that
+     * exit without calling it count as blocked.
+     */
+    void remove_kernel() {
+        pid_t tid = syscall(SYS_gettid);
+        std::lock_guard<std::mutex> lock(m);
+        kernels.erase(std::remove(kernels.begin(), kernels.end(), tid),
+                      kernels.end());
+    }
+
+    /**
+     * Remove a core. The simulation does not access the core anymore after
+     * this returns, flits still on the way to it are dropped.
+     */
+    void remove(AuroraEmuSimulationPort &port) {
+        std::lock_guard<std::mutex> lock(m);
+        for (auto &p : ports) {
+            if (p && p->port == &port) {
+                dropped += p->rx_backlog.size();
+                p.reset();
+            }
+        }
+    }
+
+    // current virtual time in ns, the arrival time of the last event
+    double get_time_ns() {
+        std::lock_guard<std::mutex> lock(m);
+        return now_ps / 1000.0;
+    }
+
+    // current virtual time in cycles of the kernel clock
+    uint64_t get_cycles() {
+        return std::llround(get_time_ns() * kernel_clock_mhz / 1000.0);
+    }
+
+    /**
+     * Block until all flits written by the kernels were passed to the
+     * receiving kernels and the kernels wait for data. The calling thread
+     * must not be an added kernel.
+     */
+    void wait_idle() {
+        // the flag may still be set from before the kernels were started
+        std::this_thread::sleep_for(quiescence);
+        while (!idle) {
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(SIM_POLL_INTERVAL));
+        }
+    }
+
+    // flits of removed cores and of unknown destinations
+    uint64_t get_dropped_count() {
+        std::lock_guard<std::mutex> lock(m);
+        return dropped;
+    }
+
+    void print_summary(std::ostream &out) {
+        out << "Simulated time: " << get_time_ns() << " ns, " << get_cycles()
+            << " cycles at " << kernel_clock_mhz << " MHz" << std::endl;
+    }
+};
+
+#ifdef AURORAEMU_SIMULATION
+/**
+ * Simulation used by all cores of a process built with
+ * AURORAEMU_SIMULATION. The simulated time is printed at exit.
+ */
+inline AuroraEmuSimulation *default_simulation() {
+    struct ProcessSimulation : AuroraEmuSimulation {
+        ~ProcessSimulation() { print_summary(std::cout); }
+    };
+    static ProcessSimulation simulation;
+    return &simulation;
+}
+#else
+inline AuroraEmuSimulation *default_simulation() { return nullptr; }
+#endif
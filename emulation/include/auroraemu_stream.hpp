@@ -0,0 +1,440 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "auroraemu_affinity.hpp"
+
+// default depth of an AuroraEmuStream, the same as for hlslib::Stream
+const size_t SPSC_STREAM_DEPTH = 2;
+// number of failed attempts before a blocking read or write parks the
+// thread
+const int SPSC_SPIN_COUNT = 1000;
+// size of a cache line, the indices of reader and writer are kept apart
+const size_t SPSC_CACHE_LINE = 64;
+// number of failed writes before write_while() sleeps
+const int STREAM_SPIN_COUNT = 1000;
+// time in microseconds write_while() sleeps between polls of a full stream
+const int STREAM_POLL_INTERVAL = 20;
+
+/**
+ * Bounded lock-free stream for a single reader and a single writer thread,
+ * with the interface of hlslib::Stream that is used by the emulator. Reads
+ * and writes only touch the index of the other side if the locally cached
+ * copy says the stream is empty or full, so no lock is taken as long as
+ * data flows. Blocking operations spin for SPSC_SPIN_COUNT attempts and
+ * then park the thread on a condition variable until the other side makes
+ * progress.
+ *
+ * read_n() and write_n() move bursts of flits and publish them at once.
+ * interrupt() wakes up a reader blocked in read_interruptible(), so the
+ * emulator can stop its threads without writing to the stream, which must
+ * only have a single writer.
+ * The ring is allocated on the given NUMA node, which should be the node of
+ * the user kernel and the core that use the stream, see AuroraEmuPlacement.
+ * The emulator cores accept the stream as second template parameter, e.g.
+ * BasicAuroraEmuCore<data_stream_t, AuroraEmuStream<data_stream_t>>.
+ */
+template <typename T>
+class AuroraEmuStream {
+   private:
+    std::string name;
+    size_t depth;
+    // capacity of the ring is the next power of two of the depth
+    size_t mask;
+    NodeArray<T> buffer;
+
+    char pad0[SPSC_CACHE_LINE];
+    // index of the next read, written by the reader
+    std::atomic<size_t> head;
+    // last tail seen by the reader
+    size_t reader_tail;
+    char pad1[SPSC_CACHE_LINE];
+    // index of the next write, written by the writer
+    std::atomic<size_t> tail;
+    // last head seen by the writer
+    size_t writer_head;
+    char pad2[SPSC_CACHE_LINE];
+
+    // only used to park and wake up the threads
+    std::mutex m;
+    std::condition_variable cv;
+    std::atomic<bool> reader_parked;
+    std::atomic<bool> writer_parked;
+    // set by interrupt() until the reader returns from read_interruptible()
+    std::atomic<bool> interrupted;
+
+    // number of flits the reader can read without waiting
+    size_t readable() {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == reader_tail) {
+            reader_tail = tail.load(std::memory_order_acquire);
+        }
+        return reader_tail - h;
+    }
+
+    // number of flits the writer can write without waiting
+    size_t writable() {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - writer_head >= depth) {
+            writer_head = head.load(std::memory_order_acquire);
+        }
+        return depth - (t - writer_head);
+    }
+
+    // wake up the other side if it is parked. Called after publishing
+    void wake(std::atomic<bool> &parked) {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (parked.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(m);
+            cv.notify_all();
+        }
+    }
+
+    /**
+     * Wait until available() returns a value greater than zero, first
+     * spinning and then parked. Returns the value, or zero if stop()
+     * returned true before.
+     */
+    template <typename Available, typename Stop>
+    size_t wait(std::atomic<bool> &parked, Available available, Stop stop) {
+        for (int i = 0; i < SPSC_SPIN_COUNT; i++) {
+            size_t n = available();
+            if (n > 0 || stop()) {
+                return n;
+            }
+            std::this_thread::yield();
+        }
+        parked.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        size_t n = 0;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [&] { return (n = available()) > 0 || stop(); });
+        }
+        parked.store(false, std::memory_order_relaxed);
+        return n;
+    }
+
+    size_t wait_readable() {
+        return wait(reader_parked, [this] { return readable(); },
+                    [] { return false; });
+    }
+
+    size_t wait_writable() {
+        return wait(writer_parked, [this] { return writable(); },
+                    [] { return false; });
+    }
+
+    static size_t capacity_of(size_t depth) {
+        size_t capacity = 1;
+        while (capacity < depth) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+   public:
+    explicit AuroraEmuStream(const std::string &name = "(unnamed)",
+                             size_t depth = SPSC_STREAM_DEPTH,
+                             int numa_node = -1)
+        : name(name),
+          depth(std::max<size_t>(depth, 1)),
+          mask(capacity_of(this->depth) - 1),
+          buffer(mask + 1, numa_node),
+          head(0),
+          reader_tail(0),
+          tail(0),
+          writer_head(0),
+          reader_parked(false),
+          writer_parked(false),
+          interrupted(false) {}
+
+    explicit AuroraEmuStream(const char *name,
+                             size_t depth = SPSC_STREAM_DEPTH,
+                             int numa_node = -1)
+        : AuroraEmuStream(std::string(name), depth, numa_node) {}
+
+    AuroraEmuStream(const AuroraEmuStream &) = delete;
+    AuroraEmuStream &operator=(const AuroraEmuStream &) = delete;
+
+    /**
+     * Read without blocking, only called by the reader. Returns false if
+     * the stream is empty.
+     */
+    bool read_nb(T &value) {
+        if (readable() == 0) {
+            return false;
+        }
+        size_t h = head.load(std::memory_order_relaxed);
+        value = buffer[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        wake(writer_parked);
+        return true;
+    }
+
+    /**
+     * Write without blocking, only called by the writer. Returns false if
+     * the stream is full.
+     */
+    bool write_nb(const T &value) {
+        if (writable() == 0) {
+            return false;
+        }
+        size_t t = tail.load(std::memory_order_relaxed);
+        buffer[t & mask] = value;
+        tail.store(t + 1, std::memory_order_release);
+        wake(reader_parked);
+        return true;
+    }
+
+    T read() {
+        T value;
+        while (!read_nb(value)) {
+            wait_readable();
+        }
+        return value;
+    }
+
+    void read(T &value) { value = read(); }
+
+    /**
+     * Read like read(), but return false without a flit if interrupt() was
+     * called since the last call. Only called by the reader.
+     */
+    bool read_interruptible(T &value) {
+        while (!read_nb(value)) {
+            if (interrupted.exchange(false)) {
+                return false;
+            }
+            wait(reader_parked, [this] { return readable(); },
+                 [this] { return interrupted.load(); });
+        }
+        return true;
+    }
+
+    /**
+     * Wake up the reader blocked in read_interruptible(). May be called by
+     * any thread.
+     */
+    void interrupt() {
+        interrupted.store(true);
+        std::lock_guard<std::mutex> lock(m);
+        cv.notify_all();
+    }
+
+    void write(const T &value) {
+        while (!write_nb(value)) {
+            wait_writable();
+        }
+    }
+
+    /**
+     * Read n flits into values, blocks until all are read. Flits that are
+     * available together are taken out of the stream at once.
+     */
+    void read_n(T *values, size_t n) {
+        while (n > 0) {
+            size_t count = std::min(wait_readable(), n);
+            size_t h = head.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < count; i++) {
+                values[i] = buffer[(h + i) & mask];
+            }
+            head.store(h + count, std::memory_order_release);
+            wake(writer_parked);
+            values += count;
+            n -= count;
+        }
+    }
+
+    /**
+     * Write n flits, blocks until all are written. Flits that fit into the
+     * stream together are published at once.
+     */
+    void write_n(const T *values, size_t n) {
+        while (n > 0) {
+            size_t count = std::min(wait_writable(), n);
+            size_t t = tail.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < count; i++) {
+                buffer[(t + i) & mask] = values[i];
+            }
+            tail.store(t + count, std::memory_order_release);
+            wake(reader_parked);
+            values += count;
+            n -= count;
+        }
+    }
+
+    // may be called by both sides and other threads
+    size_t size() const {
+        size_t h = head.load(std::memory_order_acquire);
+        return tail.load(std::memory_order_acquire) - h;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    bool full() const { return size() >= depth; }
+
+    size_t get_depth() const { return depth; }
+
+    const std::string &get_name() const { return name; }
+};
+
+/**
+ * Write n flits to a stream. Streams with a burst write publish them at
+ * once.
+ */
+template <typename Stream, typename T>
+void write_flits(Stream &stream, const T *flits, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        stream.write(flits[i]);
+    }
+}
+
+template <typename T>
+void write_flits(AuroraEmuStream<T> &stream, const T *flits, size_t n) {
+    stream.write_n(flits, n);
+}
+
+/**
+ * Blocking reads of a thread of the emulator from a stream that it shares
+ * with the user, which stop() can interrupt. hlslib::Stream has no timed
+ * read and nothing that wakes up a blocked reader, so the thread blocks in
+ * read() once the stream is empty and stop() writes a single wake-up flit,
+ * but only while the thread is blocked on the empty stream. The thread
+ * drops the wake-up flit, so the stream is left with the flits the user
+ * wrote. Flits written to the stream while it is stopped may be dropped.
+ */
+template <typename T, typename Stream>
+class AuroraEmuStreamReader {
+    Stream &stream;
+    const std::atomic<bool> &running;
+    // guards the state below between the reader and stop()
+    std::mutex mutex;
+    // the reader blocks in read() or is about to
+    bool parked;
+    // set by stop(), reads do not block anymore
+    bool stopped;
+    // stop() wrote the wake-up flit
+    bool woken;
+
+   public:
+    AuroraEmuStreamReader(Stream &stream, const std::atomic<bool> &running)
+        : stream(stream),
+          running(running),
+          parked(false),
+          stopped(false),
+          woken(false) {}
+
+    /**
+     * Read a flit, blocks until a flit arrives. Returns false once running
+     * is cleared.
+     */
+    bool read(T &value) {
+        if (!running) {
+            return false;
+        }
+        if (stream.read_nb(value)) {
+            return true;
+        }
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (stopped) {
+                return false;
+            }
+            parked = true;
+        }
+        value = stream.read();
+        std::lock_guard<std::mutex> lock(mutex);
+        parked = false;
+        if (woken) {
+            // the wake-up flit is still there if a flit of the user came
+            // first
+            T wake_up;
+            stream.read_nb(wake_up);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Wake up the reader after running was cleared
+     */
+    void stop() {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopped = true;
+        if (parked && stream.empty()) {
+            stream.write(T());
+            woken = true;
+        }
+    }
+};
+
+/**
+ * An AuroraEmuStream wakes up its reader without a flit, so the reader only
+ * parks in the stream.
+ */
+template <typename T>
+class AuroraEmuStreamReader<T, AuroraEmuStream<T>> {
+    AuroraEmuStream<T> &stream;
+    const std::atomic<bool> &running;
+
+   public:
+    AuroraEmuStreamReader(AuroraEmuStream<T> &stream,
+                          const std::atomic<bool> &running)
+        : stream(stream), running(running) {}
+
+    bool read(T &value) {
+        while (running) {
+            if (stream.read_interruptible(value)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void stop() { stream.interrupt(); }
+};
+
+/**
+ * Write a flit in a thread of the emulator as long as keep_writing()
+ * returns true, polling the stream with write_nb(). Returns false if the
+ * flit was not written.
+ */
+template <typename Stream, typename T, typename Predicate>
+bool write_while(Stream &stream, const T &value, Predicate keep_writing) {
+    int spins = 0;
+    while (keep_writing()) {
+        if (stream.write_nb(value)) {
+            return true;
+        }
+        if (spins++ < STREAM_SPIN_COUNT) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(
+                std::chrono::microseconds(STREAM_POLL_INTERVAL));
+        }
+    }
+    return false;
+}
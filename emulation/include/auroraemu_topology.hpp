@@ -0,0 +1,291 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <exception>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "auroraemu.hpp"
+
+// default depth of the user streams created for a network
+const unsigned TOPOLOGY_STREAM_DEPTH = 1024;
+
+// ports of a node in a 2D torus
+const int TORUS_EAST = 0;
+const int TORUS_WEST = 1;
+const int TORUS_SOUTH = 2;
+const int TORUS_NORTH = 3;
+
+/**
+ * Aurora core of an emulated FPGA, identified by the node and the index of
+ * the port on the node
+ */
+struct AuroraEmuPort {
+    int node;
+    int port;
+};
+
+/**
+ * The core at from sends its data to the core at to
+ */
+struct AuroraEmuEdge {
+    AuroraEmuPort from;
+    AuroraEmuPort to;
+};
+
+/**
+ * Description of an emulated Aurora network: nodes with the same number of
+ * ports and the directed edges between the ports. Every port sends to at
+ * most one other port, like the Aurora core it represents. Ports without any
+ * edge get no core, ports that only receive drop the data they send.
+ */
+struct AuroraEmuTopology {
+    int num_nodes;
+    int ports_per_node;
+    std::vector<AuroraEmuEdge> edges;
+
+    AuroraEmuTopology(int num_nodes, int ports_per_node)
+        : num_nodes(num_nodes), ports_per_node(ports_per_node) {}
+
+    /**
+     * Connect two ports with a cable, so both send to each other. A cable
+     * from a port to itself is a loopback.
+     */
+    void add_cable(AuroraEmuPort a, AuroraEmuPort b) {
+        edges.push_back({a, b});
+        if (a.node != b.node || a.port != b.port) {
+            edges.push_back({b, a});
+        }
+    }
+
+    /**
+     * Throws std::invalid_argument if an edge uses a port outside of the
+     * nodes or a port sends to more than one port
+     */
+    void validate() const {
+        std::vector<bool> used(num_nodes * ports_per_node, false);
+        for (const AuroraEmuEdge &e : edges) {
+            if (!valid(e.from) || !valid(e.to)) {
+                throw std::invalid_argument("Port outside of the topology");
+            }
+            if (used[index(e.from)]) {
+                throw std::invalid_argument("Port " + core_id(e.from) +
+                                            " sends to more than one port");
+            }
+            used[index(e.from)] = true;
+        }
+    }
+
+    bool valid(AuroraEmuPort p) const {
+        return p.node >= 0 && p.node < num_nodes && p.port >= 0 &&
+               p.port < ports_per_node;
+    }
+
+    size_t index(AuroraEmuPort p) const {
+        return p.node * ports_per_node + p.port;
+    }
+
+    /**
+     * ID of the core at the given port on the switch, so cores of other
+     * processes can join the network
+     */
+    static std::string core_id(AuroraEmuPort p) {
+        return "n" + std::to_string(p.node) + "p" + std::to_string(p.port);
+    }
+
+    /**
+     * Every port sends to itself
+     */
+    static AuroraEmuTopology loopback(int num_nodes, int ports_per_node = 2) {
+        AuroraEmuTopology t(num_nodes, ports_per_node);
+        for (int n = 0; n < num_nodes; n++) {
+            for (int p = 0; p < ports_per_node; p++) {
+                t.add_cable({n, p}, {n, p});
+            }
+        }
+        return t;
+    }
+
+    /**
+     * The two ports of every node are connected to each other
+     */
+    static AuroraEmuTopology pair(int num_nodes) {
+        AuroraEmuTopology t(num_nodes, 2);
+        for (int n = 0; n < num_nodes; n++) {
+            t.add_cable({n, 0}, {n, 1});
+        }
+        return t;
+    }
+
+    /**
+     * Port 1 of every node is connected to port 0 of the next node, like the
+     * ring mode of the host code
+     */
+    static AuroraEmuTopology ring(int num_nodes) {
+        AuroraEmuTopology t(num_nodes, 2);
+        for (int n = 0; n < num_nodes; n++) {
+            t.add_cable({n, 1}, {(n + 1) % num_nodes, 0});
+        }
+        return t;
+    }
+
+    /**
+     * 2D torus with four ports per node, see TORUS_EAST and so on. Node
+     * r * columns + c is in row r and column c.
+     */
+    static AuroraEmuTopology torus(int rows, int columns) {
+        AuroraEmuTopology t(rows * columns, 4);
+        for (int r = 0; r < rows; r++) {
+            for (int c = 0; c < columns; c++) {
+                int node = r * columns + c;
+                t.add_cable({node, TORUS_EAST},
+                            {r * columns + (c + 1) % columns, TORUS_WEST});
+                t.add_cable({node, TORUS_SOUTH},
+                            {((r + 1) % rows) * columns + c, TORUS_NORTH});
+            }
+        }
+        return t;
+    }
+
+    static AuroraEmuTopology from_edges(int num_nodes, int ports_per_node,
+                                        std::vector<AuroraEmuEdge> edges) {
+        AuroraEmuTopology t(num_nodes, ports_per_node);
+        t.edges = edges;
+        return t;
+    }
+};
+
+/**
+ * Emulated Aurora network of a topology in one process. All cores and their
+ * user streams are created in one call and connected to a shared switch.
+ * Cores and streams are accessed by node and port.
+ */
+template <typename T, unsigned depth = TOPOLOGY_STREAM_DEPTH>
+class BasicAuroraEmuNetwork {
+   private:
+    typedef hlslib::Stream<T, depth> stream_t;
+
+    AuroraEmuTopology topology;
+    AuroraEmuSwitch aurora_switch;
+    // indexed by AuroraEmuTopology::index(), empty for ports without core.
+    // The streams have to outlive the cores
+    std::vector<std::unique_ptr<stream_t>> user_to_remote_streams;
+    std::vector<std::unique_ptr<stream_t>> remote_to_user_streams;
+    std::vector<std::unique_ptr<BasicAuroraEmuCore<T>>> cores;
+
+    size_t checked_index(AuroraEmuPort p) const {
+        if (!topology.valid(p) || !cores[topology.index(p)]) {
+            throw std::out_of_range("No core at port " +
+                                    AuroraEmuTopology::core_id(p));
+        }
+        return topology.index(p);
+    }
+
+   public:
+    /**
+     * Create all cores of the topology. The switch uses the given port and
+     * the ports after it, see AuroraEmuSwitch.
+     */
+    BasicAuroraEmuNetwork(const AuroraEmuTopology &topology,
+                          std::string host_address = "127.0.0.1",
+                          int port = 20000,
+                          AuroraEmuConfig config = AuroraEmuConfig())
+        : topology(topology) {
+        topology.validate();
+        aurora_switch.listen(host_address, port, config.switch_workers,
+                             AuroraEmuPlacement(), config.direct_links);
+        size_t num_ports = topology.num_nodes * topology.ports_per_node;
+        user_to_remote_streams.resize(num_ports);
+        remote_to_user_streams.resize(num_ports);
+        cores.resize(num_ports);
+        // ports that are part of an edge and the id they send to
+        std::vector<bool> used(num_ports, false);
+        std::vector<std::string> remote_ids(num_ports);
+        for (const AuroraEmuEdge &e : topology.edges) {
+            used[topology.index(e.from)] = true;
+            used[topology.index(e.to)] = true;
+            remote_ids[topology.index(e.from)] =
+                AuroraEmuTopology::core_id(e.to);
+        }
+        // the constructors of the cores wait for their subscription, so
+        // they are created in parallel
+        std::vector<std::thread> threads;
+        std::vector<std::exception_ptr> errors(num_ports);
+        for (int n = 0; n < topology.num_nodes; n++) {
+            for (int p = 0; p < topology.ports_per_node; p++) {
+                size_t i = topology.index({n, p});
+                if (!used[i]) {
+                    continue;
+                }
+                std::string id = AuroraEmuTopology::core_id({n, p});
+                user_to_remote_streams[i].reset(new stream_t(id + "_tx"));
+                remote_to_user_streams[i].reset(new stream_t(id + "_rx"));
+                threads.emplace_back([&, i, id]() {
+                    try {
+                        cores[i].reset(new BasicAuroraEmuCore<T>(
+                            host_address, port, id, remote_ids[i],
+                            *user_to_remote_streams[i],
+                            *remote_to_user_streams[i], config));
+                    } catch (...) {
+                        errors[i] = std::current_exception();
+                    }
+                });
+            }
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        for (auto &error : errors) {
+            if (error) {
+                std::rethrow_exception(error);
+            }
+        }
+    }
+
+    const AuroraEmuTopology &get_topology() const { return topology; }
+
+    // true if the port is part of an edge and has a core
+    bool has_core(int node, int port) const {
+        AuroraEmuPort p = {node, port};
+        return topology.valid(p) && cores[topology.index(p)];
+    }
+
+    BasicAuroraEmuCore<T> &core(int node, int port) {
+        return *cores[checked_index({node, port})];
+    }
+
+    /**
+     * Stream the user kernel of the node writes to, to send data over the
+     * port
+     */
+    hlslib::Stream<T> &user_to_remote(int node, int port) {
+        return *user_to_remote_streams[checked_index({node, port})];
+    }
+
+    /**
+     * Stream the user kernel of the node reads the data received on the
+     * port from
+     */
+    hlslib::Stream<T> &remote_to_user(int node, int port) {
+        return *remote_to_user_streams[checked_index({node, port})];
+    }
+};
+
+typedef BasicAuroraEmuNetwork<data_stream_t> AuroraEmuNetwork;
@@ -0,0 +1,342 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+#include <hlslib/xilinx/Stream.h>
+
+// identifies a flit trace file and its format
+const uint32_t TRACE_MAGIC = 0x52544541;
+const uint32_t TRACE_VERSION = 1;
+// offset of the first record in the file, so records are cache line aligned
+const size_t TRACE_DATA_OFFSET = 64;
+// number of records a trace file grows by when it is full
+const size_t TRACE_GROW_RECORDS = 65536;
+
+/**
+ * Header at the beginning of a trace file
+ */
+struct FlitTraceHeader {
+    uint32_t magic;
+    uint32_t version;
+    // size of a record and of the flit in it, checked by the reader
+    uint32_t record_size;
+    uint32_t flit_size;
+    // system clock at the start of the recording in ns since the epoch
+    int64_t start_ns;
+    // number of valid records, updated after every record
+    uint64_t count;
+};
+
+/**
+ * Flit received by a core, with its arrival time and its source. The flit
+ * includes TLAST and TKEEP, even if the link only transferred the data.
+ */
+template <typename T>
+struct FlitTraceRecord {
+    // arrival time in ns since the start of the recording
+    int64_t timestamp_ns;
+    // see flit_trace_source()
+    uint32_t source;
+    uint32_t last;
+    T flit;
+};
+
+/**
+ * Source id of a core in a trace: the FNV-1a hash of the id of the sending
+ * AuroraEmuCore or the address of the sending AuroraEmu. MPI cores record
+ * the rank of the sender instead.
+ */
+inline uint32_t flit_trace_source(const std::string &id) {
+    uint32_t hash = 2166136261u;
+    for (char c : id) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * Appends flits to a binary trace file that is mapped into memory. The file
+ * grows by TRACE_GROW_RECORDS records when it is full and is truncated to
+ * the recorded flits when the writer is destroyed. The header always
+ * contains the number of complete records, so the trace of a crashed
+ * process stays readable. T has to be trivially copyable.
+ */
+template <typename T>
+class FlitTraceWriter {
+   private:
+    typedef FlitTraceRecord<T> record_t;
+
+    int fd;
+    char *region;
+    size_t mapped_size;
+    // number of records that fit into the file
+    size_t capacity;
+    std::chrono::steady_clock::time_point start;
+    std::mutex m;
+
+    FlitTraceHeader *header() {
+        return reinterpret_cast<FlitTraceHeader *>(region);
+    }
+
+    record_t *records() {
+        return reinterpret_cast<record_t *>(region + TRACE_DATA_OFFSET);
+    }
+
+    static size_t file_size(size_t records) {
+        return TRACE_DATA_OFFSET + records * sizeof(record_t);
+    }
+
+    void grow() {
+        size_t new_capacity = capacity + TRACE_GROW_RECORDS;
+        size_t new_size = file_size(new_capacity);
+        if (ftruncate(fd, new_size) != 0) {
+            throw std::runtime_error("Could not grow trace file");
+        }
+        void *new_region = (region == nullptr)
+                               ? mmap(nullptr, new_size, PROT_READ | PROT_WRITE,
+                                      MAP_SHARED, fd, 0)
+                               : mremap(region, mapped_size, new_size,
+                                        MREMAP_MAYMOVE);
+        if (new_region == MAP_FAILED) {
+            throw std::runtime_error("Could not map trace file");
+        }
+        region = static_cast<char *>(new_region);
+        mapped_size = new_size;
+        capacity = new_capacity;
+    }
+
+   public:
+    /**
+     * Create the trace file, an existing file is replaced
+     */
+    explicit FlitTraceWriter(const std::string &file_name)
+        : region(nullptr),
+          mapped_size(0),
+          capacity(0),
+          start(std::chrono::steady_clock::now()) {
+        fd = open(file_name.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            throw std::runtime_error("Could not create trace file " +
+                                     file_name);
+        }
+        grow();
+        FlitTraceHeader *h = header();
+        h->magic = TRACE_MAGIC;
+        h->version = TRACE_VERSION;
+        h->record_size = sizeof(record_t);
+        h->flit_size = sizeof(T);
+        h->start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+        h->count = 0;
+    }
+
+    FlitTraceWriter(const FlitTraceWriter &) = delete;
+    FlitTraceWriter &operator=(const FlitTraceWriter &) = delete;
+
+    ~FlitTraceWriter() {
+        size_t count = header()->count;
+        munmap(region, mapped_size);
+        // remove the unused records at the end
+        if (ftruncate(fd, file_size(count)) != 0) {
+            std::cerr << "Could not truncate trace file" << std::endl;
+        }
+        close(fd);
+    }
+
+    // time in ns since the start of the recording, used as arrival time
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - start)
+            .count();
+    }
+
+    void append(const T &flit, uint32_t source, int64_t timestamp_ns) {
+        std::lock_guard<std::mutex> lock(m);
+        if (header()->count == capacity) {
+            grow();
+        }
+        record_t &r = records()[header()->count];
+        r.timestamp_ns = timestamp_ns;
+        r.source = source;
+        r.last = flit.last ? 1 : 0;
+        r.flit = flit;
+        header()->count++;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> lock(m);
+        return header()->count;
+    }
+};
+
+/**
+ * Read-only view of a trace file that is mapped into memory
+ */
+template <typename T>
+class FlitTraceReader {
+   private:
+    typedef FlitTraceRecord<T> record_t;
+
+    char *region;
+    size_t mapped_size;
+
+    const FlitTraceHeader *header() const {
+        return reinterpret_cast<const FlitTraceHeader *>(region);
+    }
+
+   public:
+    /**
+     * Map the trace file. Throws std::runtime_error if the file is not a
+     * trace of flits of type T.
+     */
+    explicit FlitTraceReader(const std::string &file_name) {
+        int fd = open(file_name.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0 ||
+            static_cast<size_t>(st.st_size) < TRACE_DATA_OFFSET) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            throw std::runtime_error("Could not open trace file " + file_name);
+        }
+        mapped_size = st.st_size;
+        void *r = mmap(nullptr, mapped_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (r == MAP_FAILED) {
+            throw std::runtime_error("Could not map trace file " + file_name);
+        }
+        region = static_cast<char *>(r);
+        if (header()->magic != TRACE_MAGIC ||
+            header()->version != TRACE_VERSION ||
+            header()->record_size != sizeof(record_t) ||
+            mapped_size < TRACE_DATA_OFFSET + size() * sizeof(record_t)) {
+            munmap(region, mapped_size);
+            throw std::runtime_error("Invalid trace file " + file_name);
+        }
+    }
+
+    FlitTraceReader(const FlitTraceReader &) = delete;
+    FlitTraceReader &operator=(const FlitTraceReader &) = delete;
+
+    ~FlitTraceReader() { munmap(region, mapped_size); }
+
+    size_t size() const { return header()->count; }
+
+    // system clock at the start of the recording in ns since the epoch
+    int64_t get_start_ns() const { return header()->start_ns; }
+
+    const record_t &operator[](size_t i) const {
+        return reinterpret_cast<const record_t *>(region +
+                                                  TRACE_DATA_OFFSET)[i];
+    }
+};
+
+/**
+ * Source of flits that writes a recorded trace into the remote_to_user
+ * stream of a user kernel, so the kernel can be run without the cores and
+ * kernels that sent the data. The flits are written either with the
+ * recorded gaps between them or as fast as the kernel reads them.
+ */
+template <typename T>
+class BasicAuroraEmuReplay {
+   private:
+    FlitTraceReader<T> trace;
+    hlslib::Stream<T> &remote_to_user;
+    bool recorded_timing;
+
+    // cleared by the destructor to terminate the replay thread
+    std::atomic<bool> running;
+    std::atomic<size_t> replayed;
+    std::thread replay_thread;
+
+    void replay() {
+        if (trace.size() == 0) {
+            return;
+        }
+        auto start = std::chrono::steady_clock::now();
+        int64_t first_ns = trace[0].timestamp_ns;
+        for (size_t i = 0; i < trace.size(); i++) {
+            if (recorded_timing) {
+                std::this_thread::sleep_until(
+                    start + std::chrono::nanoseconds(trace[i].timestamp_ns -
+                                                     first_ns));
+            }
+            // do not block on a full stream, so the destructor can stop the
+            // replay if the kernel does not read anymore
+            while (remote_to_user.full()) {
+                if (!running) {
+                    return;
+                }
+                std::this_thread::yield();
+            }
+            remote_to_user.write(trace[i].flit);
+            replayed++;
+        }
+    }
+
+   public:
+    /**
+     * Start writing the flits of the trace file into remote_to_user
+     *
+     * recorded_timing: keep the gaps between the arrival times of the
+     *                  flits. Otherwise, the flits are written as fast as
+     *                  possible
+     */
+    BasicAuroraEmuReplay(const std::string &file_name,
+                         hlslib::Stream<T> &remote_to_user,
+                         bool recorded_timing = false)
+        : trace(file_name),
+          remote_to_user(remote_to_user),
+          recorded_timing(recorded_timing),
+          running(true),
+          replayed(0) {
+        replay_thread = std::thread(&BasicAuroraEmuReplay::replay, this);
+    }
+
+    ~BasicAuroraEmuReplay() {
+        running = false;
+        wait();
+    }
+
+    /**
+     * Block until all flits of the trace were written
+     */
+    void wait() {
+        if (replay_thread.joinable()) {
+            replay_thread.join();
+        }
+    }
+
+    size_t size() const { return trace.size(); }
+
+    // number of flits written into the stream so far
+    size_t get_replayed_count() const { return replayed; }
+};
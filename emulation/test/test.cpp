@@ -14,12 +14,40 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <dirent.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <stdexcept>
+#include <string>
 
 #include "auroraemu.hpp"
+#include "auroraemu_affinity.hpp"
+#include "auroraemu_channels.hpp"
+#include "auroraemu_sim.hpp"
+#include "auroraemu_stream.hpp"
+#include "auroraemu_topology.hpp"
+#include "auroraemu_trace.hpp"
 #include "gtest/gtest.h"
 #include "hlslib/xilinx/Stream.h"
 
+/**
+ * Create an empty file with a unique name in /tmp, so tests that run at the
+ * same time do not share their trace files
+ */
+std::string unique_temp_file(const std::string &prefix) {
+    std::string name = "/tmp/" + prefix + "_XXXXXX";
+    int fd = mkstemp(&name[0]);
+    if (fd < 0) {
+        throw std::runtime_error("Could not create a file for " + prefix);
+    }
+    close(fd);
+    return name;
+}
+
 struct AuroraEmuTest : public ::testing::Test {
     AuroraEmuTest() {
         // Empty
@@ -54,6 +82,34 @@ TEST_F(AuroraEmuTest, ConnectLoopback) {
     EXPECT_EQ(data.data, data2.data);
 }
 
+TEST_F(AuroraEmuTest, ConnectLoopbackWithoutData) {
+    hlslib::Stream<data_stream_t> in, out;
+    // destroyed right after connect, before the recv thread may have
+    // subscribed to the kill signal
+    AuroraEmu e("hans", in, out);
+    e.connect(e);
+}
+
+TEST_F(AuroraEmuTest, DestroyBlockedSendThread) {
+    hlslib::Stream<data_stream_t> in, out;
+    AuroraEmuConfig config;
+    config.framing = true;
+    config.local_links = false;
+    {
+        AuroraEmu e("hans", in, out, config);
+        e.connect(e);
+        // the send thread blocks in the middle of a frame
+        data_stream_t data;
+        data.data = ap_uint<512>(7);
+        data.last = 0;
+        in.write(data);
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    // the wake-up flit of the destructor was taken out again
+    EXPECT_TRUE(in.empty());
+    EXPECT_TRUE(out.empty());
+}
+
 TEST_F(AuroraEmuTest, ConstructorSwitch) {
     AuroraEmuSwitch s("127.0.0.1", 20000);
     zmq::context_t ctx(1);
@@ -96,6 +152,14 @@ TEST_F(AuroraEmuTest, ConnectSwitchLoopback) {
     EXPECT_EQ(data.data, data2.data);
 }
 
+TEST_F(AuroraEmuTest, ConnectSwitchWithoutData) {
+    hlslib::Stream<data_stream_t> in, out;
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    // destroyed right after construction, before the recv thread may have
+    // subscribed to the kill signal
+    AuroraEmuCore e("127.0.0.1", 20000, "hans", "hans", in, out);
+}
+
 TEST_F(AuroraEmuTest, SwitchConnectTwo) {
     hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
         out2("out2");
@@ -234,6 +298,1601 @@ TEST_F(AuroraEmuTest, SwitchDefaultConstructorSend) {
     }
 }
 
+double measure_loopback_throughput(std::string name, AuroraEmuConfig config,
+                                  int num_flits) {
+    hlslib::Stream<data_stream_t, 1024> in("in"), out("out");
+    AuroraEmu e(name, in, out, config);
+    e.connect(e);
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&in, num_flits]() {
+        for (int i = 0; i < num_flits; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(i);
+            in.write(data);
+        }
+    });
+    int errors = 0;
+    for (int i = 0; i < num_flits; i++) {
+        if (out.read().data != ap_uint<512>(i)) {
+            errors++;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    producer.join();
+    EXPECT_EQ(errors, 0);
+    return num_flits / std::chrono::duration<double>(end - start).count();
+}
+
+TEST_F(AuroraEmuTest, BatchingThroughput) {
+    AuroraEmuConfig unbatched;
+    unbatched.max_batch_size = 1;
+    unbatched.local_links = false;
+    AuroraEmuConfig batched;
+    batched.max_batch_size = 64;
+    batched.flush_timeout_us = 10;
+    batched.local_links = false;
+    double unbatched_rate =
+        measure_loopback_throughput("unbatched", unbatched, 100000);
+    double batched_rate =
+        measure_loopback_throughput("batched", batched, 100000);
+    std::cout << "Unbatched: " << unbatched_rate << " flits/s" << std::endl;
+    std::cout << "Batched: " << batched_rate << " flits/s" << std::endl;
+}
+
+TEST_F(AuroraEmuTest, SwitchBatchedPartialFlush) {
+    // batch size larger than the number of flits, so only the flush timeout
+    // sends the data
+    hlslib::Stream<data_stream_t, 200> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.max_batch_size = 128;
+    config.flush_timeout_us = 1000;
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+}
+
+TEST_F(AuroraEmuTest, SwitchWorkers) {
+    // cores whose ids are routed by different workers
+    hlslib::Stream<data_stream_t, 200> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.switch_workers = 4;
+    EXPECT_NE(switch_worker("a1", 4), switch_worker("a2", 4));
+    AuroraEmuSwitch s("127.0.0.1", 20000, 4);
+    EXPECT_EQ(s.get_num_workers(), 4);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data = out2.read();
+        EXPECT_EQ(data.data, ap_uint<512>(i));
+        in2.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+    }
+}
+
+TEST_F(AuroraEmuTest, SwitchHandshakeTimeout) {
+    hlslib::Stream<data_stream_t> in("in"), out("out");
+    AuroraEmuConfig config;
+    config.handshake_timeout_ms = 50;
+    // no switch is listening
+    EXPECT_THROW(
+        AuroraEmuCore("127.0.0.1", 20000, "a1", "a2", in, out, config),
+        std::runtime_error);
+    AuroraEmu e("shm://hans", in, out, config);
+    EXPECT_THROW(e.connect("shm://missing"), std::runtime_error);
+}
+
+TEST_F(AuroraEmuTest, SwitchWorkerMismatch) {
+    hlslib::Stream<data_stream_t> in("in"), out("out");
+    AuroraEmuSwitch s("127.0.0.1", 20000, 2);
+    // the core expects a single worker on the first port of the switch
+    EXPECT_THROW(AuroraEmuCore("127.0.0.1", 20000, "a1", "a2", in, out),
+                 std::runtime_error);
+    // the switch does not serve the directory of direct links
+    AuroraEmuConfig config;
+    config.switch_workers = 2;
+    config.direct_links = true;
+    EXPECT_THROW(
+        AuroraEmuCore("127.0.0.1", 20000, "a1", "a2", in, out, config),
+        std::runtime_error);
+}
+
+/**
+ * Mean round trip time in microseconds of single flits between two cores
+ * connected to a switch
+ */
+double measure_switch_rtt(AuroraEmuConfig config, int round_trips) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuSwitch s("127.0.0.1", 20000, 1, AuroraEmuPlacement(),
+                      config.direct_links);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < round_trips; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        in2.write(out2.read());
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+    }
+    auto end = std::chrono::steady_clock::now();
+    EXPECT_EQ(a1.has_direct_link(), config.direct_links);
+    EXPECT_EQ(a2.has_direct_link(), config.direct_links);
+    return std::chrono::duration<double, std::micro>(end - start).count() /
+           round_trips;
+}
+
+TEST_F(AuroraEmuTest, SwitchDirectLinks) {
+    AuroraEmuConfig switched;
+    AuroraEmuConfig direct;
+    direct.direct_links = true;
+    direct.direct_address = "127.0.0.1";
+    // first round trip includes the directory lookup
+    measure_switch_rtt(direct, 1);
+    double switched_rtt = measure_switch_rtt(switched, 1000);
+    double direct_rtt = measure_switch_rtt(direct, 1000);
+    std::cout << "Round trip time switched: " << switched_rtt << " us"
+              << std::endl;
+    std::cout << "Round trip time direct: " << direct_rtt << " us"
+              << std::endl;
+}
+
+TEST_F(AuroraEmuTest, SwitchDirectLinksMulticast) {
+    // two cores share the id m, so a1 has to send over the switch
+    hlslib::Stream<data_stream_t, 200> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2"), in3("in3"), out3("out3");
+    AuroraEmuConfig config;
+    config.direct_links = true;
+    AuroraEmuSwitch s("127.0.0.1", 20000, 1, AuroraEmuPlacement(), true);
+    AuroraEmuCore m1("127.0.0.1", 20000, "m", "a1", in2, out2, config);
+    AuroraEmuCore m2("127.0.0.1", 20000, "m", "a1", in3, out3, config);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "m", in1, out1, config);
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+        EXPECT_EQ(out3.read().data, ap_uint<512>(i));
+    }
+    EXPECT_FALSE(a1.has_direct_link());
+}
+
+TEST_F(AuroraEmuTest, SwitchStartupTime) {
+    const int num_cores = 64;
+    typedef hlslib::Stream<data_stream_t> stream_t;
+    std::vector<std::unique_ptr<stream_t>> in(num_cores), out(num_cores);
+    std::vector<std::unique_ptr<AuroraEmuCore>> cores(num_cores);
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_cores; i++) {
+        in[i].reset(new stream_t("in"));
+        out[i].reset(new stream_t("out"));
+        cores[i].reset(new AuroraEmuCore(
+            "127.0.0.1", 20000, "c" + std::to_string(i),
+            "c" + std::to_string((i + 1) % num_cores), *in[i], *out[i]));
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Startup of " << num_cores << " cores in a ring: "
+              << std::chrono::duration<double, std::milli>(end - start).count()
+              << " ms" << std::endl;
+    // send right away, no flit may get lost
+    for (int i = 0; i < num_cores; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in[i]->write(data);
+    }
+    for (int i = 0; i < num_cores; i++) {
+        EXPECT_EQ(out[(i + 1) % num_cores]->read().data, ap_uint<512>(i));
+    }
+}
+
+TEST_F(AuroraEmuTest, ConnectStartupTime) {
+    const int num_pairs = 16;
+    typedef hlslib::Stream<data_stream_t> stream_t;
+    std::vector<std::unique_ptr<stream_t>> in(2 * num_pairs),
+        out(2 * num_pairs);
+    std::vector<std::unique_ptr<AuroraEmu>> cores(2 * num_pairs);
+    AuroraEmuConfig config;
+    config.local_links = false;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 2 * num_pairs; i++) {
+        in[i].reset(new stream_t("in"));
+        out[i].reset(new stream_t("out"));
+        cores[i].reset(
+            new AuroraEmu("127.0.0.1", 20000 + i, *in[i], *out[i], config));
+        if (i % 2 == 1) {
+            cores[i]->connect(*cores[i - 1]);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Startup of " << num_pairs << " connected pairs: "
+              << std::chrono::duration<double, std::milli>(end - start).count()
+              << " ms" << std::endl;
+    // send right away, no flit may get lost
+    for (int i = 0; i < 2 * num_pairs; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in[i]->write(data);
+    }
+    for (int i = 0; i < 2 * num_pairs; i++) {
+        EXPECT_EQ(out[i ^ 1]->read().data, ap_uint<512>(i));
+    }
+}
+
+TEST_F(AuroraEmuTest, PingPongLatency) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.local_links = false;
+    AuroraEmu a1("pingpong1", in1, out1, config);
+    AuroraEmu a2("pingpong2", in2, out2, config);
+    a1.connect(a2);
+    const int round_trips = 100;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < round_trips; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        in2.write(out2.read());
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+    }
+    auto end = std::chrono::steady_clock::now();
+    double rtt_us =
+        std::chrono::duration<double, std::micro>(end - start).count() /
+        round_trips;
+    std::cout << "Round trip time: " << rtt_us << " us" << std::endl;
+    // a polling send path needs at least RECV_POLL_INTERVAL per round trip
+    EXPECT_LT(rtt_us, RECV_POLL_INTERVAL * 1000);
+}
+
+TEST_F(AuroraEmuTest, ConstructorSharedMemory) {
+    hlslib::Stream<data_stream_t> in, out;
+    AuroraEmu e("shm://hans", in, out);
+    EXPECT_EQ(e.get_address(), "shm://hans");
+}
+
+TEST_F(AuroraEmuTest, ConnectLoopbackSharedMemory) {
+    hlslib::Stream<data_stream_t> in, out;
+    AuroraEmuConfig config;
+    config.local_links = false;
+    AuroraEmu e("shm://hans", in, out, config);
+    e.connect(e);
+
+    data_stream_t data;
+    data.data = ap_uint<512>(7);
+    in.write(data);
+    data_stream_t data2 = out.read();
+    EXPECT_EQ(data.data, data2.data);
+}
+
+TEST_F(AuroraEmuTest, ConnectTwoSharedMemory) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.local_links = false;
+    AuroraEmu a1("shm://20000", in1, out1, config);
+    AuroraEmu a2("shm://20001", in2, out2, config);
+    a1.connect(a2);
+    for (int i = 0; i < 100; i += 10) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        in2.write(out2.read());
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+    }
+    EXPECT_TRUE(in1.empty());
+    EXPECT_TRUE(in2.empty());
+    EXPECT_TRUE(out1.empty());
+    EXPECT_TRUE(out2.empty());
+}
+
+TEST_F(AuroraEmuTest, ConnectTwoProcessesSharedMemory) {
+    const int num_flits = 10000;
+    pid_t pid = fork();
+    if (pid == 0) {
+        {
+            // echo all flits back to the parent process
+            hlslib::Stream<data_stream_t> in("in"), out("out");
+            AuroraEmu child("shm://child", in, out);
+            child.connect("shm://parent");
+            for (int i = 0; i < num_flits; i++) {
+                in.write(out.read());
+            }
+            // give the send thread time to forward the last flits
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        _exit(0);
+    }
+    hlslib::Stream<data_stream_t, 64> in("in"), out("out");
+    AuroraEmu parent("shm://parent", in, out);
+    parent.connect("shm://child");
+    std::thread producer([&in]() {
+        for (int i = 0; i < num_flits; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(i);
+            in.write(data);
+        }
+    });
+    for (int i = 0; i < num_flits; i++) {
+        EXPECT_EQ(out.read().data, ap_uint<512>(i));
+    }
+    producer.join();
+    int status;
+    waitpid(pid, &status, 0);
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST_F(AuroraEmuTest, ConnectTwoZMQ) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.local_links = false;
+    AuroraEmu a1("20000", in1, out1, config);
+    AuroraEmu a2("20001", in2, out2, config);
+    a1.connect(a2);
+    for (int i = 0; i < 100; i += 10) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        in2.write(out2.read());
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+    }
+    EXPECT_TRUE(in1.empty());
+    EXPECT_TRUE(in2.empty());
+    EXPECT_TRUE(out1.empty());
+    EXPECT_TRUE(out2.empty());
+}
+
+TEST_F(AuroraEmuTest, DestructorLeavesUserStreamsUntouched) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.local_links = false;
+    AuroraEmu a2("20001", in2, out2, config);
+    {
+        AuroraEmu a1("20000", in1, out1, config);
+        // a2 never subscribes, so the send thread of a1 does not block on
+        // the user stream when a1 is destroyed
+        a1.connect(a2.get_address());
+        data_stream_t data;
+        in1.write(data);
+        while (!in1.empty()) {
+            std::this_thread::yield();
+        }
+    }
+    // the stream can be reused by the next core
+    EXPECT_TRUE(in1.empty());
+}
+
+TEST_F(AuroraEmuTest, ConnectTwoLocalLargeMessage) {
+    // 1 MB message
+    const int num_flits = 16384;
+    hlslib::Stream<data_stream_t, 256> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    // cores of the same process use a local link by default
+    AuroraEmu a1("20000", in1, out1);
+    AuroraEmu a2("20001", in2, out2);
+    a1.connect(a2);
+    auto start = std::chrono::steady_clock::now();
+    std::thread producer([&in1, num_flits]() {
+        for (int i = 0; i < num_flits; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(i);
+            data.last = (i == num_flits - 1);
+            in1.write(data);
+        }
+    });
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data = out2.read();
+        EXPECT_EQ(data.data, ap_uint<512>(i));
+        // flits are passed unchanged, including the side channels
+        EXPECT_EQ(data.last, ap_uint<1>(i == num_flits - 1));
+    }
+    auto end = std::chrono::steady_clock::now();
+    producer.join();
+    std::cout << "1 MB over local link: "
+              << std::chrono::duration<double, std::milli>(end - start).count()
+              << " ms" << std::endl;
+}
+
+TEST_F(AuroraEmuTest, LocalLinkDetachedWhenReceiverDestroyed) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmu a1("20000", in1, out1);
+    {
+        AuroraEmu a2("20001", in2, out2);
+        a1.connect(a2);
+        data_stream_t data;
+        data.data = ap_uint<512>(1);
+        in1.write(data);
+        EXPECT_EQ(out2.read().data, ap_uint<512>(1));
+    }
+    // the flit is not passed to the destroyed core
+    data_stream_t data;
+    in1.write(data);
+    while (!in1.empty()) {
+        std::this_thread::yield();
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    EXPECT_TRUE(out2.empty());
+}
+
+TEST_F(AuroraEmuTest, RegisterFileCounters) {
+    const int num_flits = 100;
+    hlslib::Stream<data_stream_t, 256> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmu a1("20000", in1, out1);
+    AuroraEmu a2("20001", in2, out2);
+    a1.connect(a2);
+    EXPECT_EQ(a1.read_register(AuroraEmuRegisters::CORE_STATUS_ADDRESS),
+              AuroraEmuRegisters::CORE_STATUS_OK);
+    // 64 byte wide FIFO with 1024 flits
+    uint32_t configuration =
+        a1.read_register(AuroraEmuRegisters::CONFIGURATION_ADDRESS);
+    EXPECT_EQ((configuration & 0x7fc) >> 2, 64);
+    EXPECT_EQ((configuration & 0x7800) >> 11, 10);
+    EXPECT_EQ(a1.read_register(AuroraEmuRegisters::FIFO_THRESHOLDS_ADDRESS),
+              (RX_FIFO_PROG_FULL << 16) | RX_FIFO_PROG_EMPTY);
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    for (int i = 0; i < num_flits; i++) {
+        out2.read();
+    }
+    EXPECT_EQ(a1.read_register(AuroraEmuRegisters::TX_COUNT_ADDRESS),
+              num_flits);
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::RX_COUNT_ADDRESS),
+              num_flits);
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::TX_COUNT_ADDRESS), 0);
+    a1.write_register(AuroraEmuRegisters::COUNTER_RESET_ADDRESS, 1);
+    a1.write_register(AuroraEmuRegisters::COUNTER_RESET_ADDRESS, 0);
+    EXPECT_EQ(a1.read_register(AuroraEmuRegisters::TX_COUNT_ADDRESS), 0);
+    EXPECT_EQ(a1.read_register(AuroraEmuRegisters::CORE_STATUS_ADDRESS),
+              AuroraEmuRegisters::CORE_STATUS_OK);
+}
+
+// send frames of 1 to num_frames flits with a partial last flit and
+// check that TLAST and TKEEP arrive unchanged
+void check_frames(hlslib::Stream<data_stream_t> &in,
+                  hlslib::Stream<data_stream_t> &out, int num_frames) {
+    std::thread producer([&in, num_frames]() {
+        for (int f = 1; f <= num_frames; f++) {
+            for (int i = 0; i < f; i++) {
+                data_stream_t data;
+                data.data = ap_uint<512>(f * 100 + i);
+                data.last = (i == f - 1);
+                data.keep = (i == f - 1) ? ap_uint<64>(0xff) : ap_uint<64>(-1);
+                in.write(data);
+            }
+        }
+    });
+    for (int f = 1; f <= num_frames; f++) {
+        for (int i = 0; i < f; i++) {
+            data_stream_t data = out.read();
+            EXPECT_EQ(data.data, ap_uint<512>(f * 100 + i));
+            EXPECT_EQ(data.last, ap_uint<1>(i == f - 1));
+            EXPECT_EQ(data.keep,
+                      (i == f - 1) ? ap_uint<64>(0xff) : ap_uint<64>(-1));
+        }
+    }
+    producer.join();
+}
+
+TEST_F(AuroraEmuTest, SwitchFraming) {
+    const int num_frames = 20;
+    hlslib::Stream<data_stream_t, 256> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.framing = true;
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    check_frames(in1, out2, num_frames);
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS),
+              num_frames);
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::RX_COUNT_ADDRESS),
+              num_frames * (num_frames + 1) / 2);
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::CONFIGURATION_ADDRESS) & 0x3,
+              0x3);
+}
+
+TEST_F(AuroraEmuTest, ConnectTwoSharedMemoryFraming) {
+    const int num_frames = 20;
+    hlslib::Stream<data_stream_t, 256> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.framing = true;
+    config.local_links = false;
+    AuroraEmu a1("shm://a1", in1, out1, config);
+    AuroraEmu a2("shm://a2", in2, out2, config);
+    a1.connect(a2);
+    check_frames(in1, out2, num_frames);
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS),
+              num_frames);
+}
+
+TEST_F(AuroraEmuTest, NarrowStreamZMQ) {
+    // 32 byte wide FIFO
+    typedef ap_axiu<256, 0, 0, 0> narrow_stream_t;
+    hlslib::Stream<narrow_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.local_links = false;
+    BasicAuroraEmu<narrow_stream_t> a1("20000", in1, out1, config);
+    BasicAuroraEmu<narrow_stream_t> a2("20001", in2, out2, config);
+    a1.connect(a2);
+    for (int i = 0; i < 100; i += 10) {
+        narrow_stream_t data;
+        data.data = ap_uint<256>(i);
+        in1.write(data);
+        in2.write(out2.read());
+        EXPECT_EQ(out1.read().data, ap_uint<256>(i));
+    }
+    EXPECT_EQ(
+        (a1.read_register(AuroraEmuRegisters::CONFIGURATION_ADDRESS) & 0x7fc) >>
+            2,
+        32);
+}
+
+TEST_F(AuroraEmuTest, NarrowStreamSwitchFraming) {
+    typedef ap_axiu<256, 0, 0, 0> narrow_stream_t;
+    const int num_flits = 10;
+    hlslib::Stream<narrow_stream_t, 256> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.framing = true;
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    BasicAuroraEmuCore<narrow_stream_t> a1("127.0.0.1", 20000, "a1", "a2", in1,
+                                           out1, config);
+    BasicAuroraEmuCore<narrow_stream_t> a2("127.0.0.1", 20000, "a2", "a1", in2,
+                                           out2, config);
+    for (int i = 0; i < num_flits; i++) {
+        narrow_stream_t data;
+        data.data = ap_uint<256>(i);
+        data.keep = -1;
+        data.last = (i == num_flits - 1);
+        in1.write(data);
+    }
+    for (int i = 0; i < num_flits; i++) {
+        narrow_stream_t data = out2.read();
+        EXPECT_EQ(data.data, ap_uint<256>(i));
+        EXPECT_EQ(data.last, ap_uint<1>(i == num_flits - 1));
+    }
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS),
+              1);
+}
+
+/**
+ * Every core of the network sends its index, which has to arrive at the
+ * core it is connected to
+ */
+void check_topology(AuroraEmuNetwork &net) {
+    const AuroraEmuTopology &t = net.get_topology();
+    for (const AuroraEmuEdge &e : t.edges) {
+        data_stream_t data;
+        data.data = ap_uint<512>(static_cast<int>(t.index(e.from)));
+        net.user_to_remote(e.from.node, e.from.port).write(data);
+    }
+    for (const AuroraEmuEdge &e : t.edges) {
+        EXPECT_EQ(net.remote_to_user(e.to.node, e.to.port).read().data,
+                  ap_uint<512>(static_cast<int>(t.index(e.from))));
+    }
+}
+
+TEST_F(AuroraEmuTest, TopologyRing) {
+    const int num_nodes = 24;
+    auto start = std::chrono::steady_clock::now();
+    AuroraEmuNetwork net(AuroraEmuTopology::ring(num_nodes));
+    auto end = std::chrono::steady_clock::now();
+    std::cout << "Startup of a ring of " << num_nodes << " nodes: "
+              << std::chrono::duration<double, std::milli>(end - start).count()
+              << " ms" << std::endl;
+    check_topology(net);
+    // port 1 of the last node is connected to port 0 of the first node
+    data_stream_t data;
+    data.data = ap_uint<512>(42);
+    net.user_to_remote(num_nodes - 1, 1).write(data);
+    EXPECT_EQ(net.remote_to_user(0, 0).read().data, ap_uint<512>(42));
+}
+
+TEST_F(AuroraEmuTest, TopologyLoopbackAndPair) {
+    AuroraEmuNetwork loopback(AuroraEmuTopology::loopback(2));
+    check_topology(loopback);
+    AuroraEmuNetwork pair(AuroraEmuTopology::pair(2), "127.0.0.1", 20010);
+    check_topology(pair);
+}
+
+TEST_F(AuroraEmuTest, TopologyTorus) {
+    AuroraEmuNetwork net(AuroraEmuTopology::torus(3, 4));
+    check_topology(net);
+    // east of node 3 in the first row wraps around to the west of node 0
+    data_stream_t data;
+    data.data = ap_uint<512>(7);
+    net.user_to_remote(3, TORUS_EAST).write(data);
+    EXPECT_EQ(net.remote_to_user(0, TORUS_WEST).read().data,
+              ap_uint<512>(7));
+}
+
+TEST_F(AuroraEmuTest, TopologyEdges) {
+    // directed triangle, port 1 of node 2 only receives
+    AuroraEmuNetwork net(AuroraEmuTopology::from_edges(
+        3, 2, {{{0, 0}, {1, 0}}, {{1, 0}, {2, 0}}, {{2, 0}, {0, 0}},
+               {{0, 1}, {2, 1}}}));
+    check_topology(net);
+    EXPECT_TRUE(net.has_core(2, 1));
+    EXPECT_FALSE(net.has_core(1, 1));
+    EXPECT_THROW(net.core(1, 1), std::out_of_range);
+    EXPECT_THROW(AuroraEmuNetwork(AuroraEmuTopology::from_edges(
+                     1, 2, {{{0, 0}, {0, 1}}, {{0, 0}, {0, 0}}})),
+                 std::invalid_argument);
+}
+
+// number of threads of this process
+int count_threads() {
+    int count = 0;
+    DIR *dir = opendir("/proc/self/task");
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] != '.') {
+            count++;
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+TEST_F(AuroraEmuTest, ReactorThreadCount) {
+    AuroraEmuReactor reactor(2);
+    AuroraEmuConfig config;
+    config.reactor = &reactor;
+    int threads_before = count_threads();
+    AuroraEmuNetwork small(AuroraEmuTopology::ring(4), "127.0.0.1", 20000,
+                           config);
+    int threads_small = count_threads();
+    AuroraEmuNetwork large(AuroraEmuTopology::ring(32), "127.0.0.1", 20010,
+                           config);
+    int threads_large = count_threads();
+    std::cout << "Threads for 8 cores: " << threads_small - threads_before
+              << ", for 72 cores: " << threads_large - threads_before
+              << std::endl;
+    check_topology(small);
+    check_topology(large);
+    // only the threads of the second switch are added
+    EXPECT_LE(threads_large - threads_small, threads_small - threads_before);
+}
+
+TEST_F(AuroraEmuTest, ReactorDirectLinksFraming) {
+    AuroraEmuReactor reactor(1);
+    AuroraEmuConfig config;
+    config.reactor = &reactor;
+    config.direct_links = true;
+    config.direct_address = "127.0.0.1";
+    double rtt = measure_switch_rtt(config, 1000);
+    std::cout << "Round trip time on reactor: " << rtt << " us" << std::endl;
+
+    config.direct_links = false;
+    config.framing = true;
+    hlslib::Stream<data_stream_t, 100> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        data.last = (i % 10 == 9);
+        in1.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data = out2.read();
+        EXPECT_EQ(data.data, ap_uint<512>(i));
+        EXPECT_EQ(data.last, ap_uint<1>(i % 10 == 9));
+    }
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS),
+              10);
+}
+
+TEST_F(AuroraEmuTest, RxFifoNFCStateMachine) {
+    std::vector<uint16_t> sent;
+    RxFifo<data_stream_t> fifo(64, 32, 8,
+                               [&sent](uint16_t nfc) { sent.push_back(nfc); });
+    std::atomic<bool> running(true);
+    data_stream_t data;
+    // fill up to prog_full and receive 5 more in-flight flits
+    for (int i = 0; i < 37; i++) {
+        fifo.write(data);
+    }
+    ASSERT_EQ(sent.size(), 1);
+    EXPECT_EQ(sent[0], NFC_XOFF);
+    EXPECT_EQ(fifo.full_trigger_count, 1);
+    // drain down to prog_empty
+    for (int i = 0; i < 29; i++) {
+        EXPECT_TRUE(fifo.read(data, running));
+    }
+    ASSERT_EQ(sent.size(), 2);
+    EXPECT_EQ(sent[1], NFC_XON);
+    EXPECT_EQ(fifo.empty_trigger_count, 1);
+    EXPECT_EQ(fifo.max_latency, 5);
+    EXPECT_EQ(fifo.overflow_count, 0);
+    // a full FIFO stops the writer until a flit is read
+    for (int i = 0; i < 56; i++) {
+        fifo.write(data);
+    }
+    EXPECT_FALSE(fifo.try_write(data));
+    EXPECT_FALSE(fifo.try_write(data));
+    EXPECT_EQ(fifo.overflow_count, 1);
+    std::thread writer([&fifo, data]() { fifo.write(data); });
+    while (fifo.overflow_count < 2) {
+        std::this_thread::yield();
+    }
+    EXPECT_EQ(fifo.size(), 64);
+    EXPECT_TRUE(fifo.read(data, running));
+    writer.join();
+    EXPECT_EQ(fifo.size(), 64);
+    // flits that wait when the core stops are dropped
+    fifo.stop();
+    fifo.write(data);
+    EXPECT_EQ(fifo.overflow_count, 3);
+    for (int i = 0; i < 64; i++) {
+        EXPECT_TRUE(fifo.read(data, running));
+    }
+    running = false;
+    EXPECT_FALSE(fifo.read(data, running));
+}
+
+TEST_F(AuroraEmuTest, SwitchNFC) {
+    const int num_flits = 2000;
+    // only the TX stream holds all data, so the RX FIFO model has to buffer
+    hlslib::Stream<data_stream_t, num_flits> in1("in1");
+    hlslib::Stream<data_stream_t> out1("out1"), in2("in2"), out2("out2");
+    AuroraEmuConfig config;
+    config.nfc = true;
+    config.rx_fifo_depth = 256;
+    config.rx_fifo_prog_full = 128;
+    config.rx_fifo_prog_empty = 32;
+    config.max_batch_size = 16;
+    // slow link, so XOFF arrives before all flits are handed over to ZMQ
+    config.pacing = true;
+    config.line_rate_gbps = 0.1;
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    // receiver is not reading, so the RX FIFO fills up and XOFF stops a1
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(a2.get_nfc_full_trigger_count(), 1);
+    EXPECT_FALSE(in1.empty());
+    for (int i = 0; i < num_flits; i++) {
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    EXPECT_GT(a2.get_nfc_empty_trigger_count(), 0);
+    std::cout << "Max in-flight flits: " << a2.get_nfc_latency_count()
+              << std::endl;
+}
+
+TEST_F(AuroraEmuTest, ReactorNFC) {
+    const int num_flits = 2000;
+    hlslib::Stream<data_stream_t, num_flits> in1("in1");
+    hlslib::Stream<data_stream_t> out1("out1"), in2("in2"), out2("out2");
+    AuroraEmuReactor reactor(1);
+    AuroraEmuConfig config;
+    config.reactor = &reactor;
+    config.nfc = true;
+    config.rx_fifo_depth = 256;
+    config.rx_fifo_prog_full = 128;
+    config.rx_fifo_prog_empty = 32;
+    config.max_batch_size = 16;
+    config.pacing = true;
+    config.line_rate_gbps = 0.1;
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    // both cores share the reactor thread, which must not block on the
+    // full stream of a2 or the XOFF of a1
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    EXPECT_EQ(a2.get_nfc_full_trigger_count(), 1);
+    EXPECT_FALSE(in1.empty());
+    for (int i = 0; i < num_flits; i++) {
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    EXPECT_GT(a2.get_nfc_empty_trigger_count(), 0);
+}
+
+TEST_F(AuroraEmuTest, LinkPacerRate) {
+    // 1 Gbit/s without encoding overhead: 64 bytes take 512 ns
+    LinkPacer pacer(1.0, 1.0);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < 10000; i++) {
+        pacer.pace(64);
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    EXPECT_GE(elapsed_ms, 5.12 - PACING_BURST_NS / 1e6);
+    EXPECT_LT(elapsed_ms, 5.12 * 1.5);
+}
+
+TEST_F(AuroraEmuTest, SwitchPacing) {
+    const int num_flits = 10000;
+    hlslib::Stream<data_stream_t, num_flits> in1("in1"), out1("out1"),
+        in2("in2"), out2("out2");
+    AuroraEmuConfig config;
+    config.pacing = true;
+    // 10000 flits take 100 ms at 50 Mbit/s with 64b/66b encoding
+    config.line_rate_gbps = 0.05;
+    config.link_latency_ns = 1000000;
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    for (int i = 0; i < num_flits; i++) {
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    double elapsed_ms = std::chrono::duration<double, std::milli>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+    double expected_ms =
+        num_flits * 512 / (0.05 * LINE_ENCODING_EFFICIENCY) / 1e6 + 1;
+    std::cout << "Paced transfer: " << elapsed_ms << " ms, expected "
+              << expected_ms << " ms" << std::endl;
+    EXPECT_GE(elapsed_ms, expected_ms * 0.95);
+}
+
+TEST_F(AuroraEmuTest, TraceRecordAndReplay) {
+    // two bursts of frames separated by a gap are recorded by the receiver
+    const int num_flits = 1000;
+    const std::string file_name = unique_temp_file("auroraemu_test_trace");
+    hlslib::Stream<data_stream_t, num_flits> in1("in1"), out1("out1"),
+        in2("in2"), out2("out2");
+    {
+        AuroraEmuConfig config;
+        config.framing = true;
+        AuroraEmuSwitch s("127.0.0.1", 20000);
+        AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+        config.trace_file = file_name;
+        AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+        for (int i = 0; i < num_flits; i++) {
+            if (i == num_flits / 2) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+            data_stream_t data;
+            data.data = ap_uint<512>(i);
+            data.last = (i % 10 == 9);
+            in1.write(data);
+        }
+        for (int i = 0; i < num_flits; i++) {
+            out2.read();
+        }
+    }
+    {
+        FlitTraceReader<data_stream_t> trace(file_name);
+        ASSERT_EQ(trace.size(), num_flits);
+        for (int i = 0; i < num_flits; i++) {
+            EXPECT_EQ(trace[i].flit.data, ap_uint<512>(i));
+            EXPECT_EQ(trace[i].last, i % 10 == 9 ? 1u : 0u);
+            EXPECT_EQ(trace[i].source, flit_trace_source("a1"));
+            if (i > 0) {
+                EXPECT_GE(trace[i].timestamp_ns, trace[i - 1].timestamp_ns);
+            }
+        }
+        EXPECT_GE(trace[num_flits / 2].timestamp_ns -
+                      trace[num_flits / 2 - 1].timestamp_ns,
+                  40000000);
+    }
+    // replay time at full speed and with the recorded timing
+    double elapsed_ms[2];
+    for (bool recorded_timing : {false, true}) {
+        auto start = std::chrono::steady_clock::now();
+        AuroraEmuReplay replay(file_name, out2, recorded_timing);
+        for (int i = 0; i < num_flits; i++) {
+            data_stream_t data = out2.read();
+            EXPECT_EQ(data.data, ap_uint<512>(i));
+            EXPECT_EQ(data.last, ap_uint<1>(i % 10 == 9));
+        }
+        replay.wait();
+        EXPECT_EQ(replay.get_replayed_count(), num_flits);
+        elapsed_ms[recorded_timing] =
+            std::chrono::duration<double, std::milli>(
+                std::chrono::steady_clock::now() - start)
+                .count();
+        std::cout << (recorded_timing ? "Timed" : "Full speed")
+                  << " replay: " << elapsed_ms[recorded_timing] << " ms"
+                  << std::endl;
+    }
+    // the gap is kept by the timed replay only. The full speed replay is
+    // not compared to a fixed time, which depends on the load of the host
+    EXPECT_GE(elapsed_ms[true], 40);
+    EXPECT_LT(elapsed_ms[false], elapsed_ms[true]);
+    unlink(file_name.c_str());
+}
+
+TEST_F(AuroraEmuTest, TraceLocalAndSharedMemoryLinks) {
+    const int num_flits = 100;
+    hlslib::Stream<data_stream_t, num_flits> in1("in1"), out1("out1"),
+        in2("in2"), out2("out2");
+    for (bool local_links : {true, false}) {
+        const std::string file_name =
+            unique_temp_file("auroraemu_test_trace_shm");
+        {
+            AuroraEmuConfig config;
+            config.local_links = local_links;
+            AuroraEmu a1("shm://a1", in1, out1, config);
+            config.trace_file = file_name;
+            AuroraEmu a2("shm://a2", in2, out2, config);
+            a1.connect(a2);
+            for (int i = 0; i < num_flits; i++) {
+                data_stream_t data;
+                data.data = ap_uint<512>(i);
+                in1.write(data);
+            }
+            for (int i = 0; i < num_flits; i++) {
+                out2.read();
+            }
+        }
+        FlitTraceReader<data_stream_t> trace(file_name);
+        ASSERT_EQ(trace.size(), num_flits);
+        for (int i = 0; i < num_flits; i++) {
+            EXPECT_EQ(trace[i].flit.data, ap_uint<512>(i));
+            EXPECT_EQ(trace[i].source, flit_trace_source("shm://a1"));
+        }
+        unlink(file_name.c_str());
+    }
+}
+
+TEST_F(AuroraEmuTest, TraceInvalidFile) {
+    typedef ap_axiu<256, 0, 0, 0> narrow_stream_t;
+    EXPECT_THROW(FlitTraceReader<data_stream_t> trace("/tmp/does_not_exist"),
+                 std::runtime_error);
+    const std::string file_name = unique_temp_file("auroraemu_test_trace");
+    {
+        FlitTraceWriter<data_stream_t> writer(file_name);
+    }
+    // records of a different size
+    EXPECT_THROW(FlitTraceReader<narrow_stream_t> trace(file_name),
+                 std::runtime_error);
+    FlitTraceReader<data_stream_t> trace(file_name);
+    EXPECT_EQ(trace.size(), 0u);
+    unlink(file_name.c_str());
+}
+
+TEST_F(AuroraEmuTest, MessagePoolReuse) {
+    MessagePoolPtr pool(MessagePool::create(64, 2));
+    char *buffer;
+    {
+        PooledFlits<uint64_t> flits(*pool);
+        EXPECT_EQ(flits.capacity(), 8u);
+        flits.push_back(1);
+        flits.push_back(2);
+        zmq::message_t msg = flits.message();
+        EXPECT_EQ(msg.size(), 2 * sizeof(uint64_t));
+        EXPECT_EQ(static_cast<const uint64_t *>(msg.data())[1], 2u);
+        buffer = static_cast<char *>(msg.data());
+    }
+    // the buffer of the freed message is used again
+    char *next = pool->acquire();
+    EXPECT_EQ(next, buffer);
+    pool->release(next);
+    // messages may outlive the pool handle
+    zmq::message_t msg = pool->message(pool->acquire(), 64);
+    pool.reset();
+}
+
+TEST_F(AuroraEmuTest, ChannelsWeightedRoundRobin) {
+    // the two sides are connected by streams instead of a core. The bulk
+    // channel is filled before the control channel, but cannot delay it by
+    // more than its weight per control flit
+    const int bulk_flits = 10000;
+    const int control_flits = 100;
+    hlslib::Stream<data_stream_t, 2 * bulk_flits> link("link"),
+        forwarded("forwarded"), unused("unused"), bulk_in("bulk_in"),
+        bulk_out("bulk_out");
+    hlslib::Stream<data_stream_t, control_flits> control_in("control_in"),
+        control_out("control_out");
+    for (int i = 0; i < bulk_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        data.last = (i % 8 == 7);
+        bulk_in.write(data);
+    }
+    for (int i = 0; i < control_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        data.last = 1;
+        control_in.write(data);
+    }
+    {
+        AuroraEmuChannels sender(
+            link, unused,
+            {{&control_in, &unused, 1}, {&bulk_in, &unused, 16}});
+        while (sender.get_stats(0).flits_sent < control_flits ||
+               sender.get_stats(1).flits_sent < bulk_flits) {
+            std::this_thread::yield();
+        }
+    }
+    // bulk flits sent before the last control flit, read from the headers
+    int bulk_before_control = 0;
+    int bulk_sent = 0;
+    while (!link.empty()) {
+        data_stream_t header_flit = link.read();
+        forwarded.write(header_flit);
+        ChannelHeader header;
+        std::memcpy(&header, static_cast<const void *>(&header_flit.data),
+                    sizeof(header));
+        if (header.channel == 0) {
+            EXPECT_EQ(header.count, 1);
+            bulk_before_control = bulk_sent;
+        } else {
+            EXPECT_LE(header.count, 16);
+            bulk_sent += header.count;
+        }
+        for (int i = 0; i < header.count; i++) {
+            forwarded.write(link.read());
+        }
+    }
+    // 100 rounds with one control and up to 16 bulk flits
+    EXPECT_LE(bulk_before_control, control_flits * 16);
+    AuroraEmuChannels receiver(
+        unused, forwarded,
+        {{&unused, &control_out, 1}, {&unused, &bulk_out, 16}});
+    for (int i = 0; i < control_flits; i++) {
+        data_stream_t data = control_out.read();
+        EXPECT_EQ(data.data, ap_uint<512>(i));
+        EXPECT_EQ(data.last, ap_uint<1>(1));
+    }
+    for (int i = 0; i < bulk_flits; i++) {
+        data_stream_t data = bulk_out.read();
+        EXPECT_EQ(data.data, ap_uint<512>(i));
+        EXPECT_EQ(data.last, ap_uint<1>(i % 8 == 7));
+    }
+    AuroraEmuChannelStats control = receiver.get_stats(0);
+    AuroraEmuChannelStats bulk = receiver.get_stats(1);
+    EXPECT_EQ(control.flits_received, control_flits);
+    EXPECT_EQ(bulk.flits_received, bulk_flits);
+    EXPECT_GT(bulk.flits_per_second, 0);
+    EXPECT_GE(bulk.max_latency_ns, bulk.mean_latency_ns);
+    EXPECT_EQ(receiver.get_dropped_count(), 0u);
+}
+
+TEST_F(AuroraEmuTest, ChannelsSwitchFraming) {
+    // the channels keep TLAST with and without framing of the link
+    const int num_flits = 1000;
+    for (bool framing : {false, true}) {
+        hlslib::Stream<data_stream_t, num_flits> in1("in1"), out1("out1"),
+            in2("in2"), out2("out2");
+        std::vector<std::unique_ptr<hlslib::Stream<data_stream_t, num_flits>>>
+            streams;
+        for (int i = 0; i < 8; i++) {
+            streams.emplace_back(
+                new hlslib::Stream<data_stream_t, num_flits>("channel"));
+        }
+        AuroraEmuConfig config;
+        config.framing = framing;
+        AuroraEmuSwitch s("127.0.0.1", 20000);
+        AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+        AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+        // three channels from a1 to a2, the fourth channel is only known by
+        // a1, so a2 drops its flits
+        AuroraEmuChannels c1(in1, out1,
+                             {{streams[0].get(), streams[1].get(), 1},
+                              {streams[2].get(), streams[3].get(), 4},
+                              {streams[4].get(), streams[5].get(), 64},
+                              {streams[6].get(), streams[7].get(), 2}});
+        hlslib::Stream<data_stream_t, num_flits> r0("r0"), r1("r1"), r2("r2"),
+            unused("unused");
+        AuroraEmuChannels c2(in2, out2,
+                             {{&unused, &r0, 1},
+                              {&unused, &r1, 4},
+                              {&unused, &r2, 64}});
+        for (int i = 0; i < num_flits; i++) {
+            for (int c = 0; c < 4; c++) {
+                data_stream_t data;
+                data.data = ap_uint<512>(c * num_flits + i);
+                data.last = (i % (c + 2) == 0);
+                streams[2 * c]->write(data);
+            }
+        }
+        hlslib::Stream<data_stream_t, num_flits> *received[] = {&r0, &r1,
+                                                                &r2};
+        for (int c = 0; c < 3; c++) {
+            for (int i = 0; i < num_flits; i++) {
+                data_stream_t data = received[c]->read();
+                EXPECT_EQ(data.data, ap_uint<512>(c * num_flits + i));
+                EXPECT_EQ(data.last, ap_uint<1>(i % (c + 2) == 0));
+            }
+        }
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(1);
+        while (c2.get_dropped_count() < num_flits &&
+               std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::yield();
+        }
+        EXPECT_EQ(c2.get_dropped_count(), num_flits);
+    }
+}
+
+TEST_F(AuroraEmuTest, SimulationStreamingTime) {
+    const int num_flits = 100;
+    hlslib::Stream<data_stream_t, num_flits> in1("in1"), out1("out1"),
+        in2("in2"), out2("out2");
+    AuroraEmuSimulation sim(300.0, 1);
+    AuroraEmuConfig config;
+    config.simulation = &sim;
+    config.link_latency_ns = 100;
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    // the kernels are not added, the simulation waits for quiescence
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    for (int i = 0; i < num_flits; i++) {
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    sim.wait_idle();
+    // the link is slower than the kernel: the first flit is written after
+    // one cycle of 3.333 ns, every flit needs 5.28 ns on the link
+    EXPECT_DOUBLE_EQ(sim.get_time_ns(), 3.333 + num_flits * 5.28 + 100);
+    EXPECT_EQ(sim.get_cycles(), 189u);
+    EXPECT_EQ(a1.read_register(AuroraEmuRegisters::TX_COUNT_ADDRESS),
+              num_flits);
+    EXPECT_EQ(a2.read_register(AuroraEmuRegisters::RX_COUNT_ADDRESS),
+              num_flits);
+    EXPECT_EQ(sim.get_dropped_count(), 0u);
+}
+
+/**
+ * Virtual time of round_trips flits that are sent back and forth between
+ * two cores by two threads
+ */
+double simulate_ping_pong(int round_trips) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuSimulation sim;
+    AuroraEmuConfig config;
+    config.simulation = &sim;
+    config.link_latency_ns = 100;
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2, config);
+    // both kernels are added, so virtual time advances as soon as both
+    // wait for a flit
+    std::thread reflector([&]() {
+        sim.add_kernel();
+        for (int i = 0; i < round_trips; i++) {
+            in2.write(out2.read());
+        }
+        sim.remove_kernel();
+    });
+    sim.add_kernel();
+    for (int i = 0; i < round_trips; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+    }
+    sim.remove_kernel();
+    reflector.join();
+    sim.wait_idle();
+    return sim.get_time_ns();
+}
+
+TEST_F(AuroraEmuTest, SimulationIsDeterministic) {
+    double time = simulate_ping_pong(20);
+    // one kernel cycle, the flit on the link and the latency per direction
+    EXPECT_DOUBLE_EQ(time, 20 * 2 * (3.333 + 5.28 + 100));
+    EXPECT_EQ(simulate_ping_pong(20), time);
+}
+
+TEST_F(AuroraEmuTest, SpscStreamInterface) {
+    AuroraEmuStream<data_stream_t> s("s", 3);
+    EXPECT_TRUE(s.empty());
+    EXPECT_FALSE(s.full());
+    data_stream_t data;
+    EXPECT_FALSE(s.read_nb(data));
+    for (int i = 0; i < 3; i++) {
+        data.data = ap_uint<512>(i);
+        EXPECT_TRUE(s.write_nb(data));
+    }
+    // the depth is kept, although the ring has four slots
+    EXPECT_TRUE(s.full());
+    EXPECT_FALSE(s.write_nb(data));
+    EXPECT_EQ(s.size(), 3u);
+    EXPECT_EQ(s.read().data, ap_uint<512>(0));
+    EXPECT_TRUE(s.read_nb(data));
+    EXPECT_EQ(data.data, ap_uint<512>(1));
+    data_stream_t burst[2];
+    burst[0].data = ap_uint<512>(3);
+    burst[1].data = ap_uint<512>(4);
+    s.write_n(burst, 2);
+    data_stream_t received[3];
+    s.read_n(received, 3);
+    for (int i = 0; i < 3; i++) {
+        EXPECT_EQ(received[i].data, ap_uint<512>(i + 2));
+    }
+    EXPECT_TRUE(s.empty());
+}
+
+TEST_F(AuroraEmuTest, SpscStreamInterrupt) {
+    AuroraEmuStream<data_stream_t> s("s", 2);
+    data_stream_t data;
+    // the reader parks on the empty stream until it is interrupted
+    std::thread reader([&]() { EXPECT_FALSE(s.read_interruptible(data)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    s.interrupt();
+    reader.join();
+    // the interrupt is consumed, flits are read again
+    data.data = ap_uint<512>(7);
+    s.write(data);
+    data_stream_t received;
+    EXPECT_TRUE(s.read_interruptible(received));
+    EXPECT_EQ(received.data, ap_uint<512>(7));
+}
+
+TEST_F(AuroraEmuTest, SpscStreamBlocking) {
+    // small depth, so both sides spin and park many times
+    const int num_flits = 100000;
+    AuroraEmuStream<data_stream_t> s("s", 16);
+    std::thread writer([&]() {
+        std::vector<data_stream_t> burst(7);
+        int i = 0;
+        while (i < num_flits) {
+            if (i % 3 == 0) {
+                data_stream_t data;
+                data.data = ap_uint<512>(i++);
+                s.write(data);
+                continue;
+            }
+            size_t n = std::min<size_t>(burst.size(), num_flits - i);
+            for (size_t j = 0; j < n; j++) {
+                burst[j].data = ap_uint<512>(i++);
+            }
+            s.write_n(burst.data(), n);
+        }
+    });
+    std::vector<data_stream_t> burst(5);
+    int i = 0;
+    while (i < num_flits) {
+        if (i % 2 == 0) {
+            EXPECT_EQ(s.read().data, ap_uint<512>(i++));
+            continue;
+        }
+        size_t n = std::min<size_t>(burst.size(), num_flits - i);
+        s.read_n(burst.data(), n);
+        for (size_t j = 0; j < n; j++) {
+            EXPECT_EQ(burst[j].data, ap_uint<512>(i++));
+        }
+    }
+    writer.join();
+    EXPECT_TRUE(s.empty());
+}
+
+TEST_F(AuroraEmuTest, CoresWithSpscStreams) {
+    typedef AuroraEmuStream<data_stream_t> stream_t;
+    const int num_flits = 10000;
+    stream_t in1("in1", 64), out1("out1", 64), in2("in2", 64),
+        out2("out2", 64), in3("in3", 64), out3("out3", 64);
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuConfig config;
+    config.framing = true;
+    BasicAuroraEmuCore<data_stream_t, stream_t> c1("127.0.0.1", 20000, "c1",
+                                                   "c2", in1, out1, config);
+    BasicAuroraEmuCore<data_stream_t, stream_t> c2("127.0.0.1", 20000, "c2",
+                                                   "c1", in2, out2, config);
+    // point-to-point link over ZMQ, framing is off
+    config.framing = false;
+    config.local_links = false;
+    BasicAuroraEmu<data_stream_t, stream_t> e("spsc_loopback", in3, out3,
+                                              config);
+    e.connect(e);
+    std::thread writer([&]() {
+        for (int i = 0; i < num_flits; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(i);
+            data.last = (i % 4 == 3);
+            in1.write(data);
+            in3.write(data);
+        }
+    });
+    std::thread loopback([&]() {
+        for (int i = 0; i < num_flits; i++) {
+            EXPECT_EQ(out3.read().data, ap_uint<512>(i));
+        }
+    });
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data = out2.read();
+        EXPECT_EQ(data.data, ap_uint<512>(i));
+        EXPECT_EQ(data.last, ap_uint<1>(i % 4 == 3));
+    }
+    writer.join();
+    loopback.join();
+    EXPECT_EQ(c2.read_register(AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS),
+              num_flits / 4);
+}
+
+// number of threads of the process that may only run on the given CPU
+int count_threads_pinned_to(int cpu) {
+    int count = 0;
+    DIR *dir = opendir("/proc/self/task");
+    while (struct dirent *entry = readdir(dir)) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        std::ifstream status(std::string("/proc/self/task/") +
+                             entry->d_name + "/status");
+        std::string line;
+        while (std::getline(status, line)) {
+            if (line == "Cpus_allowed_list:\t" + std::to_string(cpu)) {
+                count++;
+            }
+        }
+    }
+    closedir(dir);
+    return count;
+}
+
+TEST_F(AuroraEmuTest, PlacementCpuList) {
+    EXPECT_EQ(parse_cpu_list("0-2,5,8-9"),
+              std::vector<int>({0, 1, 2, 5, 8, 9}));
+    EXPECT_TRUE(parse_cpu_list("").empty());
+    EXPECT_FALSE(online_cpus().empty());
+    EXPECT_GE(numa_node_count(), 1);
+    EXPECT_FALSE(numa_node_cpus(0).empty());
+    EXPECT_TRUE(AuroraEmuPlacement().empty());
+    EXPECT_EQ(AuroraEmuPlacement().memory_node(), -1);
+    EXPECT_EQ(AuroraEmuPlacement::node(0).memory_node(), 0);
+}
+
+TEST_F(AuroraEmuTest, PlacementPinsForwardingThreads) {
+    int cpu = online_cpus().back();
+    int before = count_threads_pinned_to(cpu);
+    // the user kernel is pinned first and the cores follow it
+    std::thread kernel([&]() {
+        AuroraEmuPlacement::cpu(cpu).apply();
+        AuroraEmuConfig config;
+        config.placement = AuroraEmuPlacement::current();
+        ASSERT_EQ(config.placement.cpus, std::vector<int>({cpu}));
+        config.local_links = false;
+        AuroraEmuStream<data_stream_t> in1("in1", 16,
+                                           config.placement.memory_node());
+        AuroraEmuStream<data_stream_t> out1("out1", 16,
+                                            config.placement.memory_node());
+        hlslib::Stream<data_stream_t> in2("in2"), out2("out2");
+        BasicAuroraEmu<data_stream_t, AuroraEmuStream<data_stream_t>> a1(
+            "placement1", in1, out1, config);
+        AuroraEmu a2("placement2", in2, out2, config);
+        a1.connect(a2.get_address());
+        a2.connect(a1.get_address());
+        // recv and send threads of both cores and the kernel itself
+        EXPECT_GE(count_threads_pinned_to(cpu) - before, 5);
+        for (int i = 0; i < 100; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(i);
+            in1.write(data);
+            in2.write(out2.read());
+            EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+        }
+    });
+    kernel.join();
+    AuroraEmuSwitch s("127.0.0.1", 20000, 2, AuroraEmuPlacement::cpu(cpu));
+    EXPECT_GE(count_threads_pinned_to(cpu) - before, 2);
+}
+
+TEST_F(AuroraEmuTest, SwitchFederationTwoHosts) {
+    hlslib::Stream<data_stream_t, 200> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2"), in3("in3"), out3("out3"), in4("in4"), out4("out4");
+    // one switch per host, only the traffic between the hosts passes both
+    AuroraEmuSwitch s1("127.0.0.1", 20000);
+    AuroraEmuSwitch s2("127.0.0.1", 20100);
+    s1.peer("127.0.0.1", 20100);
+    s2.peer("127.0.0.1", 20000);
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1);
+    AuroraEmuCore a2("127.0.0.1", 20000, "a2", "a1", in2, out2);
+    AuroraEmuCore b1("127.0.0.1", 20000, "b1", "b2", in3, out3);
+    AuroraEmuCore b2("127.0.0.1", 20100, "b2", "b1", in4, out4);
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        in2.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    EXPECT_EQ(s1.get_peer_message_count(), 0u);
+    EXPECT_EQ(s2.get_peer_message_count(), 0u);
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in3.write(data);
+        in4.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(out3.read().data, ap_uint<512>(i));
+        EXPECT_EQ(out4.read().data, ap_uint<512>(i));
+    }
+    EXPECT_GT(s1.get_peer_message_count(), 0u);
+    EXPECT_GT(s2.get_peer_message_count(), 0u);
+    EXPECT_TRUE(out1.empty());
+    EXPECT_TRUE(out2.empty());
+}
+
+TEST_F(AuroraEmuTest, SwitchFederationLearnsRoutes) {
+    const int num_switches = 3;
+    const int num_flits = 100;
+    typedef hlslib::Stream<data_stream_t> stream_t;
+    std::vector<std::unique_ptr<AuroraEmuSwitch>> switches(num_switches);
+    std::vector<std::unique_ptr<stream_t>> in(num_switches),
+        out(num_switches);
+    std::vector<std::unique_ptr<AuroraEmuCore>> cores(num_switches);
+    for (int i = 0; i < num_switches; i++) {
+        switches[i].reset(
+            new AuroraEmuSwitch("127.0.0.1", 20000 + 100 * i, 2));
+    }
+    for (int i = 0; i < num_switches; i++) {
+        for (int j = 0; j < num_switches; j++) {
+            if (i != j) {
+                switches[i]->peer("127.0.0.1", 20000 + 100 * j);
+            }
+        }
+    }
+    AuroraEmuConfig config;
+    config.switch_workers = 2;
+    // every flit is its own message
+    config.max_batch_size = 1;
+    for (int i = 0; i < num_switches; i++) {
+        in[i].reset(new stream_t("in"));
+        out[i].reset(new stream_t("out"));
+        cores[i].reset(new AuroraEmuCore(
+            "127.0.0.1", 20000 + 100 * i, "c" + std::to_string(i),
+            "c" + std::to_string((i + 1) % num_switches), *in[i], *out[i],
+            config));
+    }
+    auto flooded = [&]() {
+        uint64_t count = 0;
+        for (auto &s : switches) {
+            count += s->get_flooded_message_count();
+        }
+        return count;
+    };
+    auto peer_messages = [&]() {
+        uint64_t count = 0;
+        for (auto &s : switches) {
+            count += s->get_peer_message_count();
+        }
+        return count;
+    };
+    auto send_round = [&](int value) {
+        for (int i = 0; i < num_switches; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(value);
+            in[i]->write(data);
+            EXPECT_EQ(out[(i + 1) % num_switches]->read().data,
+                      ap_uint<512>(value));
+        }
+    };
+    // the ids are flooded until the switches learned their routes
+    uint64_t before = flooded();
+    send_round(0);
+    for (int round = 0; round < 1000; round++) {
+        before = flooded();
+        send_round(0);
+        if (flooded() == before) {
+            break;
+        }
+    }
+    uint64_t sent = peer_messages();
+    for (int i = 0; i < num_flits; i++) {
+        send_round(i);
+    }
+    EXPECT_EQ(flooded(), before);
+    // every message passed exactly one peer
+    EXPECT_EQ(peer_messages() - sent, num_switches * num_flits);
+}
+
+TEST_F(AuroraEmuTest, SwitchFederationSharedId) {
+    hlslib::Stream<data_stream_t, 200> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2"), in3("in3"), out3("out3"), in4("in4"), out4("out4"),
+        in5("in5"), out5("out5");
+    AuroraEmuSwitch s1("127.0.0.1", 20000);
+    AuroraEmuSwitch s2("127.0.0.1", 20100);
+    s1.peer("127.0.0.1", 20100);
+    s2.peer("127.0.0.1", 20000);
+    AuroraEmuConfig config;
+    config.max_batch_size = 1;
+    // a core with the id m on each switch
+    AuroraEmuCore m1("127.0.0.1", 20000, "m", "x", in1, out1, config);
+    AuroraEmuCore m2("127.0.0.1", 20100, "m", "x", in2, out2, config);
+    AuroraEmuCore x("127.0.0.1", 20000, "x", "m", in3, out3, config);
+    // y is announced after m, so s1 knows the route to m once it stops
+    // flooding the messages to y. The routes of s2 only reach s1 once it
+    // reconnected to the route socket s2 bound when it peered
+    AuroraEmuCore y("127.0.0.1", 20100, "y", "z", in4, out4, config);
+    AuroraEmuCore z("127.0.0.1", 20000, "z", "y", in5, out5, config);
+    data_stream_t data;
+    for (int round = 0; round < 1000; round++) {
+        uint64_t before = s1.get_flooded_message_count();
+        in5.write(data);
+        out4.read();
+        if (s1.get_flooded_message_count() == before) {
+            break;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    for (int i = 0; i < 100; i++) {
+        data.data = ap_uint<512>(i);
+        in3.write(data);
+    }
+    // the local core and the core on the peer receive all flits
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+}
+
+TEST_F(AuroraEmuTest, SwitchFederationDirectLinks) {
+    hlslib::Stream<data_stream_t, 200> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.direct_links = true;
+    config.direct_address = "127.0.0.1";
+    AuroraEmuSwitch s1("127.0.0.1", 20000, 1, AuroraEmuPlacement(), true);
+    AuroraEmuSwitch s2("127.0.0.1", 20100, 1, AuroraEmuPlacement(), true);
+    s1.peer("127.0.0.1", 20100);
+    s2.peer("127.0.0.1", 20000);
+    // the directories look up the cores of their peers
+    AuroraEmuCore a1("127.0.0.1", 20000, "a1", "a2", in1, out1, config);
+    AuroraEmuCore a2("127.0.0.1", 20100, "a2", "a1", in2, out2, config);
+    for (int i = 0; i < 100; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        in2.write(data);
+    }
+    for (int i = 0; i < 100; i++) {
+        EXPECT_EQ(out1.read().data, ap_uint<512>(i));
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    EXPECT_TRUE(a1.has_direct_link());
+    EXPECT_TRUE(a2.has_direct_link());
+    EXPECT_EQ(s1.get_peer_message_count(), 0u);
+    EXPECT_EQ(s2.get_peer_message_count(), 0u);
+}
+
 int main(int argc, char *argv[]) {
     ::testing::InitGoogleTest(&argc, argv);
 
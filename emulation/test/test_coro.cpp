@@ -0,0 +1,193 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include "auroraemu.hpp"
+#include "auroraemu_coro.hpp"
+#include "gtest/gtest.h"
+#include "hlslib/xilinx/Stream.h"
+
+struct AuroraEmuCoroTest : public ::testing::Test {
+    AuroraEmuCoroTest() {
+        // Empty
+    }
+
+    void SetUp() {
+        // Empty
+    }
+};
+
+AuroraEmuKernel produce(hlslib::Stream<data_stream_t> &out, int n) {
+    for (int i = 0; i < n; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        data.last = (i == n - 1);
+        co_await write_async(out, data);
+    }
+}
+
+AuroraEmuKernel forward(hlslib::Stream<data_stream_t> &in,
+                        hlslib::Stream<data_stream_t> &out, int n) {
+    for (int i = 0; i < n; i++) {
+        data_stream_t data = co_await read_async(in);
+        co_await write_async(out, data);
+    }
+}
+
+AuroraEmuKernel consume(hlslib::Stream<data_stream_t> &in, int n,
+                        std::vector<uint64_t> &received) {
+    for (int i = 0; i < n; i++) {
+        data_stream_t data = co_await read_async(in);
+        received.push_back(data.data.to_uint64());
+    }
+}
+
+AuroraEmuKernel fail(hlslib::Stream<data_stream_t> &in) {
+    co_await read_async(in);
+    throw std::runtime_error("Kernel failed");
+}
+
+TEST_F(AuroraEmuCoroTest, PipelineOfManyKernels) {
+    // more kernels than a process should run as threads
+    const int num_kernels = 2000;
+    const int num_flits = 100;
+    std::vector<std::unique_ptr<hlslib::Stream<data_stream_t>>> streams;
+    for (int i = 0; i < num_kernels + 1; i++) {
+        streams.emplace_back(new hlslib::Stream<data_stream_t>());
+    }
+    std::vector<uint64_t> received;
+    AuroraEmuScheduler scheduler(2);
+    scheduler.spawn(produce(*streams[0], num_flits));
+    for (int i = 0; i < num_kernels; i++) {
+        scheduler.spawn(forward(*streams[i], *streams[i + 1], num_flits));
+    }
+    scheduler.spawn(consume(*streams[num_kernels], num_flits, received));
+    scheduler.wait();
+    ASSERT_EQ(received.size(), num_flits);
+    for (int i = 0; i < num_flits; i++) {
+        EXPECT_EQ(received[i], i);
+    }
+    uint64_t resumed = 0;
+    for (size_t w = 0; w < scheduler.get_num_workers(); w++) {
+        resumed += scheduler.get_worker(w).get_resumed_count();
+    }
+    EXPECT_GE(resumed, num_kernels + 2);
+}
+
+AuroraEmuKernel sum(hlslib::Stream<data_stream_t, 1000> &in, int n,
+                    std::atomic<uint64_t> &result) {
+    uint64_t s = 0;
+    for (int i = 0; i < n; i++) {
+        data_stream_t data = co_await read_async(in);
+        s += data.data.to_uint64();
+    }
+    result += s;
+}
+
+AuroraEmuKernel spawn_all(
+    AuroraEmuScheduler &scheduler,
+    std::vector<std::unique_ptr<hlslib::Stream<data_stream_t, 1000>>> &in,
+    int n, std::atomic<uint64_t> &result) {
+    // all kernels are queued on the worker of this kernel
+    for (auto &stream : in) {
+        scheduler.spawn(sum(*stream, n, result));
+    }
+    co_return;
+}
+
+TEST_F(AuroraEmuCoroTest, WorkStealing) {
+    const int num_kernels = 200;
+    const int num_flits = 1000;
+    std::vector<std::unique_ptr<hlslib::Stream<data_stream_t, 1000>>> in;
+    for (int k = 0; k < num_kernels; k++) {
+        in.emplace_back(new hlslib::Stream<data_stream_t, 1000>());
+        for (int i = 0; i < num_flits; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(i);
+            in.back()->write(data);
+        }
+    }
+    std::atomic<uint64_t> result(0);
+    AuroraEmuScheduler scheduler(4);
+    scheduler.spawn(spawn_all(scheduler, in, num_flits, result));
+    scheduler.wait();
+    EXPECT_EQ(result,
+              uint64_t(num_kernels) * num_flits * (num_flits - 1) / 2);
+    uint64_t stolen = 0;
+    for (size_t w = 0; w < scheduler.get_num_workers(); w++) {
+        stolen += scheduler.get_worker(w).get_stolen_count();
+    }
+    EXPECT_GT(stolen, 0u);
+}
+
+AuroraEmuKernel produce_twice(hlslib::Stream<data_stream_t> &out, int n) {
+    co_await produce(out, n);
+    co_await produce(out, n);
+}
+
+TEST_F(AuroraEmuCoroTest, AwaitKernel) {
+    hlslib::Stream<data_stream_t> s("s");
+    std::vector<uint64_t> received;
+    AuroraEmuScheduler scheduler(1);
+    scheduler.spawn(produce_twice(s, 10));
+    scheduler.spawn(consume(s, 20, received));
+    scheduler.wait();
+    ASSERT_EQ(received.size(), 20u);
+    for (int i = 0; i < 20; i++) {
+        EXPECT_EQ(received[i], i % 10);
+    }
+}
+
+TEST_F(AuroraEmuCoroTest, KernelException) {
+    hlslib::Stream<data_stream_t> s("s"), never("never");
+    std::vector<uint64_t> received;
+    AuroraEmuScheduler scheduler(2);
+    scheduler.spawn(fail(s));
+    scheduler.spawn(produce(s, 1));
+    EXPECT_THROW(scheduler.wait(), std::runtime_error);
+    // kernels that never finish are destroyed with the scheduler
+    scheduler.spawn(consume(never, 1, received));
+}
+
+TEST_F(AuroraEmuCoroTest, KernelsOverEmulatedLink) {
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmu a1("coro1", in1, out1);
+    AuroraEmu a2("coro2", in2, out2);
+    a1.connect(a2);
+    std::vector<uint64_t> received;
+    AuroraEmuScheduler scheduler(2);
+    scheduler.spawn(produce(in1, 1000));
+    // remote kernel that sends the data back
+    scheduler.spawn(forward(out2, in2, 1000));
+    scheduler.spawn(consume(out1, 1000, received));
+    scheduler.wait();
+    ASSERT_EQ(received.size(), 1000u);
+    for (int i = 0; i < 1000; i++) {
+        EXPECT_EQ(received[i], i);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+    bool result = RUN_ALL_TESTS();
+
+    return result;
+}
@@ -0,0 +1,189 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+#include "auroraemu.hpp"
+#include "auroraemu_latency.hpp"
+#include "gtest/gtest.h"
+#include "hlslib/xilinx/Stream.h"
+
+#ifndef AURORAEMU_LATENCY_TRACE
+#error "The latency tests have to be built with AURORAEMU_LATENCY_TRACE"
+#endif
+
+struct AuroraEmuLatencyTest : public ::testing::Test {
+    AuroraEmuLatencyTest() {
+        // Empty
+    }
+
+    void SetUp() {
+        // Empty
+    }
+};
+
+// wait until the receiver recorded all samples, which happens after the
+// flits were written to the user stream
+void wait_for_samples(const LatencyHistograms &h, uint64_t samples) {
+    auto deadline =
+        std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (h.get(STAGE_TOTAL).get_count() < samples &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+TEST_F(AuroraEmuLatencyTest, HistogramPercentiles) {
+    LatencyHistogram h;
+    EXPECT_EQ(h.get_percentile_ns(0.5), 0);
+    for (int i = 0; i < 99; i++) {
+        h.record(1000);
+    }
+    h.record(1000000);
+    EXPECT_EQ(h.get_count(), 100u);
+    EXPECT_EQ(h.get_max_ns(), 1000000);
+    EXPECT_DOUBLE_EQ(h.get_mean_ns(), (99 * 1000 + 1000000) / 100.0);
+    // upper bound of the bucket [512, 1024)
+    EXPECT_EQ(h.get_percentile_ns(0.5), 1024);
+    EXPECT_EQ(h.get_percentile_ns(0.99), 1024);
+    EXPECT_EQ(h.get_percentile_ns(1.0), 1000000);
+    EXPECT_EQ(LatencyHistogram::bucket_of(-5), 0);
+    EXPECT_EQ(LatencyHistogram::bucket_of(1), 1);
+    h.reset();
+    EXPECT_EQ(h.get_count(), 0u);
+}
+
+TEST_F(AuroraEmuLatencyTest, SwitchStages) {
+    const int num_flits = 100;
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuConfig config;
+    // every flit is its own message and sampled
+    config.max_batch_size = 1;
+    config.latency_sample_interval = 1;
+    AuroraEmuCore c1("127.0.0.1", 20000, "c1", "c2", in1, out1, config);
+    AuroraEmuCore c2("127.0.0.1", 20000, "c2", "c1", in2, out2, config);
+    ASSERT_NE(c2.get_latency_histograms(), nullptr);
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    const LatencyHistograms &h = *c2.get_latency_histograms();
+    wait_for_samples(h, num_flits);
+    for (int stage = 0; stage < LATENCY_STAGES; stage++) {
+        EXPECT_EQ(h.get(LatencyStage(stage)).get_count(), num_flits)
+            << latency_stage(stage).name;
+    }
+    // the stages are parts of the total latency
+    EXPECT_LE(h.get(STAGE_SWITCH).get_mean_ns(),
+              h.get(STAGE_TRANSPORT).get_mean_ns());
+    EXPECT_LE(h.get(STAGE_TRANSPORT).get_mean_ns(),
+              h.get(STAGE_TOTAL).get_mean_ns());
+    // c1 did not receive anything
+    EXPECT_EQ(c1.get_latency_histograms()->get(STAGE_TOTAL).get_count(), 0u);
+}
+
+TEST_F(AuroraEmuLatencyTest, PointToPointSampleInterval) {
+    const int num_flits = 100;
+    hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+        out2("out2");
+    AuroraEmuConfig config;
+    config.local_links = false;
+    config.max_batch_size = 1;
+    config.latency_sample_interval = 10;
+    AuroraEmu a1("latency1", in1, out1, config);
+    AuroraEmu a2("latency2", in2, out2, config);
+    a1.connect(a2);
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+        EXPECT_EQ(out2.read().data, ap_uint<512>(i));
+    }
+    const LatencyHistograms &h = *a2.get_latency_histograms();
+    wait_for_samples(h, num_flits / 10);
+    EXPECT_EQ(h.get(STAGE_TOTAL).get_count(), num_flits / 10);
+    EXPECT_EQ(h.get(STAGE_TRANSPORT).get_count(), num_flits / 10);
+    // the samples did not pass a switch
+    EXPECT_EQ(h.get(STAGE_SWITCH).get_count(), 0u);
+    EXPECT_EQ(h.get(STAGE_TO_SWITCH).get_count(), 0u);
+}
+
+TEST_F(AuroraEmuLatencyTest, FullUserStreamInDeliverStage) {
+    typedef AuroraEmuStream<data_stream_t> stream_t;
+    stream_t in1("in1", 4), out1("out1", 4), in2("in2", 4), out2("out2", 1);
+    AuroraEmuSwitch s("127.0.0.1", 20000);
+    AuroraEmuConfig config;
+    config.max_batch_size = 1;
+    config.latency_sample_interval = 1;
+    BasicAuroraEmuCore<data_stream_t, stream_t> c1("127.0.0.1", 20000, "c1",
+                                                   "c2", in1, out1, config);
+    BasicAuroraEmuCore<data_stream_t, stream_t> c2("127.0.0.1", 20000, "c2",
+                                                   "c1", in2, out2, config);
+    for (int i = 0; i < 2; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        in1.write(data);
+    }
+    // the second flit waits for the full stream of the receiver
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    EXPECT_EQ(out2.read().data, ap_uint<512>(0));
+    EXPECT_EQ(out2.read().data, ap_uint<512>(1));
+    const LatencyHistograms &h = *c2.get_latency_histograms();
+    wait_for_samples(h, 2);
+    EXPECT_GE(h.get(STAGE_DELIVER).get_max_ns(), 40000000);
+    EXPECT_LT(h.get(STAGE_TRANSPORT).get_max_ns(), 40000000);
+}
+
+TEST_F(AuroraEmuLatencyTest, ReportAtShutdown) {
+    const std::string file_name = "latency_report.txt";
+    std::remove(file_name.c_str());
+    {
+        hlslib::Stream<data_stream_t> in1("in1"), out1("out1"), in2("in2"),
+            out2("out2");
+        AuroraEmuSwitch s("127.0.0.1", 20000);
+        AuroraEmuConfig config;
+        config.latency_sample_interval = 1;
+        config.latency_report = file_name;
+        AuroraEmuCore c1("127.0.0.1", 20000, "c1", "c2", in1, out1, config);
+        AuroraEmuCore c2("127.0.0.1", 20000, "c2", "c1", in2, out2, config);
+        data_stream_t data;
+        in1.write(data);
+        out2.read();
+        wait_for_samples(*c2.get_latency_histograms(), 1);
+    }
+    std::ifstream f(file_name);
+    std::stringstream report;
+    report << f.rdbuf();
+    EXPECT_NE(report.str().find("core c1"), std::string::npos);
+    EXPECT_NE(report.str().find("core c2"), std::string::npos);
+    EXPECT_NE(report.str().find("switch "), std::string::npos);
+    EXPECT_NE(report.str().find("total "), std::string::npos);
+}
+
+int main(int argc, char *argv[]) {
+    ::testing::InitGoogleTest(&argc, argv);
+
+    bool result = RUN_ALL_TESTS();
+
+    return result;
+}
@@ -0,0 +1,176 @@
+/*
+ * Copyright 2024 Marius Meyer
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <mpi.h>
+
+#include <chrono>
+#include <iostream>
+
+#include "auroraemu_mpi.hpp"
+#include "gtest/gtest.h"
+#include "hlslib/xilinx/Stream.h"
+
+// communicator of the emulated cores, a duplicate of MPI_COMM_WORLD
+MPI_Comm emu_comm;
+int rank, size;
+
+struct AuroraEmuMPITest : public ::testing::Test {
+    AuroraEmuMPITest() {
+        // Empty
+    }
+
+    void SetUp() {
+        // Empty
+    }
+};
+
+/**
+ * Read a receive counter once it reached the expected value or after a
+ * second. The counters are updated after the flits of a message were
+ * passed to the user kernel.
+ */
+uint32_t wait_for_register(AuroraEmuMPICore &core, uint32_t address,
+                           uint32_t expected) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(1);
+    while (core.read_register(address) < expected &&
+           std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::yield();
+    }
+    return core.read_register(address);
+}
+
+TEST_F(AuroraEmuMPITest, Ring) {
+    // port 1 of every rank is connected to port 0 of the next rank, like
+    // the ring mode of the host code. Data is sent in both directions
+    const int num_flits = 10000;
+    hlslib::Stream<data_stream_t, num_flits> in0("in0"), out0("out0"),
+        in1("in1"), out1("out1");
+    int next = (rank + 1) % size;
+    int previous = (rank + size - 1) % size;
+    AuroraEmuMPICore c0(emu_comm, 0, previous, 1, in0, out0);
+    AuroraEmuMPICore c1(emu_comm, 1, next, 0, in1, out1);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < num_flits; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(rank * num_flits + i);
+        in0.write(data);
+        in1.write(data);
+    }
+    for (int i = 0; i < num_flits; i++) {
+        EXPECT_EQ(out0.read().data, ap_uint<512>(previous * num_flits + i));
+        EXPECT_EQ(out1.read().data, ap_uint<512>(next * num_flits + i));
+    }
+    double elapsed_s = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    if (rank == 0) {
+        std::cout << "Ring of " << size << " ranks: "
+                  << 2 * num_flits / elapsed_s << " flits/s per rank"
+                  << std::endl;
+    }
+    EXPECT_EQ(c0.read_register(AuroraEmuRegisters::TX_COUNT_ADDRESS),
+              num_flits);
+    EXPECT_EQ(
+        wait_for_register(c0, AuroraEmuRegisters::RX_COUNT_ADDRESS, num_flits),
+        num_flits);
+    // the remote cores have to exist until all data is received
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+TEST_F(AuroraEmuMPITest, Framing) {
+    // frames of different lengths are sent in messages shorter than the
+    // persistent sends
+    const int num_frames = 100;
+    hlslib::Stream<data_stream_t, 1024> in("in"), out("out");
+    AuroraEmuConfig config;
+    config.framing = true;
+    config.max_frame_size = 16;
+    AuroraEmuMPICore c(emu_comm, 2, (rank + 1) % size, 2, in, out, config);
+    for (int f = 0; f < num_frames; f++) {
+        for (int i = 0; i <= f % 20; i++) {
+            data_stream_t data;
+            data.data = ap_uint<512>(f);
+            data.last = (i == f % 20);
+            in.write(data);
+        }
+    }
+    for (int f = 0; f < num_frames; f++) {
+        for (int i = 0; i <= f % 20; i++) {
+            data_stream_t data = out.read();
+            EXPECT_EQ(data.data, ap_uint<512>(f));
+            EXPECT_EQ(data.last, ap_uint<1>(i == f % 20));
+        }
+    }
+    EXPECT_EQ(wait_for_register(c, AuroraEmuRegisters::FRAMES_RECEIVED_ADDRESS,
+                                num_frames),
+              num_frames);
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+TEST_F(AuroraEmuMPITest, PingPongLatency) {
+    // rank 0 sends a flit to rank 1, which sends it back
+    const int round_trips = 1000;
+    hlslib::Stream<data_stream_t> in("in"), out("out");
+    AuroraEmuConfig config;
+    config.max_batch_size = 1;
+    int peer = rank ^ 1;
+    if (peer >= size) {
+        peer = rank;
+    }
+    AuroraEmuMPICore c(emu_comm, 3, peer, 3, in, out, config);
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < round_trips; i++) {
+        data_stream_t data;
+        data.data = ap_uint<512>(i);
+        if (rank % 2 == 0) {
+            in.write(data);
+            EXPECT_EQ(out.read().data, ap_uint<512>(i));
+        } else {
+            in.write(out.read());
+        }
+    }
+    double rtt_us = std::chrono::duration<double, std::micro>(
+                        std::chrono::steady_clock::now() - start)
+                        .count() /
+                    round_trips;
+    if (rank == 0) {
+        std::cout << "Round trip time: " << rtt_us << " us" << std::endl;
+    }
+    MPI_Barrier(MPI_COMM_WORLD);
+}
+
+int main(int argc, char *argv[]) {
+    int provided;
+    MPI_Init_thread(&argc, &argv, MPI_THREAD_MULTIPLE, &provided);
+    MPI_Comm_dup(MPI_COMM_WORLD, &emu_comm);
+    MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+    ::testing::InitGoogleTest(&argc, argv);
+    // only rank 0 prints the results
+    if (rank != 0) {
+        ::testing::TestEventListeners &listeners =
+            ::testing::UnitTest::GetInstance()->listeners();
+        delete listeners.Release(listeners.default_result_printer());
+    }
+
+    int result = RUN_ALL_TESTS();
+    int any_result = 0;
+    MPI_Allreduce(&result, &any_result, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+    MPI_Comm_free(&emu_comm);
+    MPI_Finalize();
+    return any_result;
+}
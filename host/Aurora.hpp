@@ -20,6 +20,7 @@
 #include "experimental/xrt_ip.h"
 #include <cmath>
 #include <bitset>
+#include <functional>
 
 double get_wtime()
 {
@@ -107,10 +108,38 @@ static const char *rx_eq_mode_names[4] = {
 class Aurora
 {
 public:
-    Aurora(xrt::ip ip) : ip(ip)
+    Aurora(xrt::ip ip) : ip(ip), has_ip(true)
+    {
+        read_configuration();
+    }
+
+    // Access the registers through the given functions instead of an IP,
+    // e.g. those of an emulated core
+    Aurora(std::function<uint32_t(uint32_t)> read,
+           std::function<void(uint32_t, uint32_t)> write)
+        : emulated_read_register(read),
+          emulated_write_register(write),
+          has_ip(false)
+    {
+        read_configuration();
+    }
+
+    // Wrap an emulated core like AuroraEmuCore that provides read_register
+    // and write_register at the hardware addresses
+    template <typename EmulatedCore>
+    static Aurora from_emulator(EmulatedCore &core)
+    {
+        return Aurora(
+            [&core](uint32_t address) { return core.read_register(address); },
+            [&core](uint32_t address, uint32_t value) {
+                core.write_register(address, value);
+            });
+    }
+
+    void read_configuration()
     {
         // read constant configuration information
-        uint32_t configuration = ip.read_register(CONFIGURATION_ADDRESS);
+        uint32_t configuration = read_register(CONFIGURATION_ADDRESS);
 
         has_tkeep = (configuration & HAS_TKEEP);
         has_tlast = (configuration & HAS_TLAST) >> 1;
@@ -119,7 +148,7 @@ public:
         rx_eq_mode = (configuration & RX_EQ_MODE_BINARY) >> 15; 
         ins_loss_nyq = (configuration & INS_LOSS_NYQ) >> 17;
 
-        uint32_t fifo_thresholds = ip.read_register(FIFO_THRESHOLDS_ADDRESS);
+        uint32_t fifo_thresholds = read_register(FIFO_THRESHOLDS_ADDRESS);
 
         fifo_prog_full_threshold = (fifo_thresholds & 0xffff0000) >> 16;
         fifo_prog_empty_threshold = (fifo_thresholds & 0x0000ffff);
@@ -138,7 +167,13 @@ public:
     Aurora(uint32_t instance, xrt::device &device, xrt::uuid &xclbin_uuid)
         : Aurora(create_name_from_instance(instance), device, xclbin_uuid) {}
  
-    Aurora() {}
+    Aurora() : has_ip(false) {}
+
+    // false if default constructed without IP or emulated core
+    bool has_registers()
+    {
+        return has_ip || emulated_read_register;
+    }
 
     // Configuration
 
@@ -154,7 +189,7 @@ public:
 
     uint32_t get_configuration()
     {
-        return ip.read_register(CONFIGURATION_ADDRESS);
+        return read_register(CONFIGURATION_ADDRESS);
     }
 
     void print_configuration()
@@ -174,7 +209,7 @@ public:
 
     uint32_t get_core_status()
     {
-        return ip.read_register(CORE_STATUS_ADDRESS);
+        return read_register(CORE_STATUS_ADDRESS);
     }
 
     uint8_t gt_powergood()
@@ -257,7 +292,7 @@ public:
     }
     uint32_t get_fifo_status()
     {
-        return ip.read_register(FIFO_STATUS_ADDRESS);
+        return read_register(FIFO_STATUS_ADDRESS);
     }
 
     bool fifo_tx_is_prog_empty()
@@ -314,108 +349,108 @@ public:
 
     uint32_t get_tx_count()
     {
-        return ip.read_register(TX_COUNT_ADDRESS);
+        return read_register(TX_COUNT_ADDRESS);
     }
 
     uint32_t get_rx_count()
     {
-        return ip.read_register(RX_COUNT_ADDRESS);
+        return read_register(RX_COUNT_ADDRESS);
     }
 
     uint32_t get_fifo_tx_overflow_count()
     {
-        return ip.read_register(FIFO_TX_OVERFLOW_COUNT_ADDRESS);
+        return read_register(FIFO_TX_OVERFLOW_COUNT_ADDRESS);
     }
 
     uint32_t get_fifo_rx_overflow_count()
     {
-        return ip.read_register(FIFO_RX_OVERFLOW_COUNT_ADDRESS);
+        return read_register(FIFO_RX_OVERFLOW_COUNT_ADDRESS);
     }
 
     uint32_t get_nfc_full_trigger_count()
     {
-        return ip.read_register(NFC_FULL_TRIGGER_COUNT_ADDRESS);
+        return read_register(NFC_FULL_TRIGGER_COUNT_ADDRESS);
     }
 
     uint32_t get_nfc_empty_trigger_count()
     {
-        return ip.read_register(NFC_FULL_TRIGGER_COUNT_ADDRESS);
+        return read_register(NFC_EMPTY_TRIGGER_COUNT_ADDRESS);
     }
 
     uint32_t get_nfc_latency_count()
     {
-        return ip.read_register(NFC_LATENCY_COUNT_ADDRESS);
+        return read_register(NFC_LATENCY_COUNT_ADDRESS);
     }
 
     uint32_t get_gt_not_ready_0_count()
     {
-        return ip.read_register(GT_NOT_READY_0_COUNT_ADDRESS);
+        return read_register(GT_NOT_READY_0_COUNT_ADDRESS);
     }
 
     uint32_t get_gt_not_ready_1_count()
     {
-        return ip.read_register(GT_NOT_READY_1_COUNT_ADDRESS);
+        return read_register(GT_NOT_READY_1_COUNT_ADDRESS);
     }
 
     uint32_t get_gt_not_ready_2_count()
     {
-        return ip.read_register(GT_NOT_READY_2_COUNT_ADDRESS);
+        return read_register(GT_NOT_READY_2_COUNT_ADDRESS);
     }
 
     uint32_t get_gt_not_ready_3_count()
     {
-        return ip.read_register(GT_NOT_READY_3_COUNT_ADDRESS);
+        return read_register(GT_NOT_READY_3_COUNT_ADDRESS);
     }
 
     uint32_t get_line_down_0_count()
     {
-        return ip.read_register(LINE_DOWN_0_COUNT_ADDRESS);
+        return read_register(LINE_DOWN_0_COUNT_ADDRESS);
     }
 
     uint32_t get_line_down_1_count()
     {
-        return ip.read_register(LINE_DOWN_1_COUNT_ADDRESS);
+        return read_register(LINE_DOWN_1_COUNT_ADDRESS);
     }
 
     uint32_t get_line_down_2_count()
     {
-        return ip.read_register(LINE_DOWN_2_COUNT_ADDRESS);
+        return read_register(LINE_DOWN_2_COUNT_ADDRESS);
     }
 
     uint32_t get_line_down_3_count()
     {
-        return ip.read_register(LINE_DOWN_3_COUNT_ADDRESS);
+        return read_register(LINE_DOWN_3_COUNT_ADDRESS);
     }
 
     uint32_t get_pll_not_locked_count()
     {
-        return ip.read_register(PLL_NOT_LOCKED_COUNT_ADDRESS);
+        return read_register(PLL_NOT_LOCKED_COUNT_ADDRESS);
     }
 
     uint32_t get_mmcm_not_locked_count()
     {
-        return ip.read_register(MMCM_NOT_LOCKED_COUNT_ADDRESS);
+        return read_register(MMCM_NOT_LOCKED_COUNT_ADDRESS);
     }
 
     uint32_t get_hard_err_count()
     {
-        return ip.read_register(HARD_ERR_COUNT_ADDRESS);
+        return read_register(HARD_ERR_COUNT_ADDRESS);
     }
 
     uint32_t get_soft_err_count()
     {
-        return ip.read_register(SOFT_ERR_COUNT_ADDRESS);
+        return read_register(SOFT_ERR_COUNT_ADDRESS);
     }
 
     uint32_t get_channel_down_count()
     {
-        return ip.read_register(CHANNEL_DOWN_COUNT_ADDRESS);
+        return read_register(CHANNEL_DOWN_COUNT_ADDRESS);
     }
 
     uint32_t get_frames_received()
     {
         if (has_tlast) {
-            return ip.read_register(FRAMES_RECEIVED_ADDRESS);
+            return read_register(FRAMES_RECEIVED_ADDRESS);
         } else {
             return -1;
         }
@@ -424,7 +459,7 @@ public:
     uint32_t get_frames_with_errors()
     {
         if (has_tlast) {
-            return ip.read_register(FRAMES_WITH_ERRORS_ADDRESS);
+            return read_register(FRAMES_WITH_ERRORS_ADDRESS);
         } else {
             return -1;
         }
@@ -462,14 +497,14 @@ public:
 
     void reset_core()
     {
-        ip.write_register(CORE_RESET_ADDRESS, true);
-        ip.write_register(CORE_RESET_ADDRESS, false);
+        write_register(CORE_RESET_ADDRESS, true);
+        write_register(CORE_RESET_ADDRESS, false);
     }
 
     void reset_counter()
     {
-        ip.write_register(COUNTER_RESET_ADDRESS, true);
-        ip.write_register(COUNTER_RESET_ADDRESS, false);
+        write_register(COUNTER_RESET_ADDRESS, true);
+        write_register(COUNTER_RESET_ADDRESS, false);
     }
 
     // Configuration
@@ -484,6 +519,26 @@ public:
     uint16_t fifo_prog_empty_threshold;
 
 private:
+    uint32_t read_register(uint32_t address)
+    {
+        if (emulated_read_register) {
+            return emulated_read_register(address);
+        }
+        return ip.read_register(address);
+    }
+
+    void write_register(uint32_t address, uint32_t value)
+    {
+        if (emulated_write_register) {
+            emulated_write_register(address, value);
+        } else {
+            ip.write_register(address, value);
+        }
+    }
+
     xrt::ip ip;
+    std::function<uint32_t(uint32_t)> emulated_read_register;
+    std::function<void(uint32_t, uint32_t)> emulated_write_register;
+    bool has_ip;
 };
 
@@ -33,6 +33,7 @@ public:
     std::vector<std::vector<uint32_t>> frames_with_errors;
 
     bool emulation;
+    bool has_counters;
 
     Results(Configuration &config, std::vector<Aurora> auroras, bool emulation, std::vector<std::string> device_bdfs) : config(config), auroras(auroras), device_bdfs(device_bdfs), emulation(emulation)
     {
@@ -98,7 +99,11 @@ public:
 
             channel_down_count[i].resize(config.repetitions);
        }
-       if (!emulation) {
+       // counters are available on hardware and for emulated cores. The
+       // sw_emu xclbin connects the send and recv kernels directly, so
+       // there are no counters without cores that carry the data
+       has_counters = !emulation || (!auroras.empty() && auroras[0].has_registers());
+       if (has_counters) {
             aurora_config.resize(config.num_instances); 
             for (uint32_t i = 0; i < config.num_instances; i++) {
                 aurora_config[i] = auroras[i].get_configuration();
@@ -109,7 +114,7 @@ public:
 
     void update_counter(uint32_t instance, uint32_t repetition)
     {
-        if (!emulation) {
+        if (has_counters) {
             fifo_rx_overflow_count[instance][repetition] = auroras[instance].get_fifo_rx_overflow_count();
             fifo_tx_overflow_count[instance][repetition] = auroras[instance].get_fifo_tx_overflow_count();
             nfc_full_trigger_count[instance][repetition] = auroras[instance].get_nfc_full_trigger_count();
@@ -216,7 +221,7 @@ public:
     void print_results()
     {
         std::cout << std::setw(36) << "Config" << std::setw(25) << "|";
-        if (!emulation) {
+        if (has_counters) {
             std::cout << std::setw(24) << "Latency (s)" << std::setw(12) << "|"
                       << std::setw(27) << "Throughput (Gbit/s)" << std::setw(9) << "|"
                       << std::setw(27) << "Counts per iteration" << std::setw(9) << "|"
@@ -228,7 +233,7 @@ public:
                   << std::setw(12) << "Iterations"
                   << std::setw(12) << "Frame Size"
                   << std::setw(12) << "Bytes";
-        if (!emulation) {
+        if (has_counters) {
             std::cout << "|" << std::setw(11) << "Min."
                       << std::setw(12) << "Avg."
                       << std::setw(12) << "Max."
@@ -242,7 +247,7 @@ public:
                       << std::setw(12) << "Latency"
                       << std::setw(12) << "TX Stalls";
         }
-        std::cout << std::endl << std::setw(emulation ? 60 : 204) << std::setfill('-') << "-"
+        std::cout << std::endl << std::setw(has_counters ? 204 : 60) << std::setfill('-') << "-"
                   << std::endl << std::setfill(' ');
         for (uint32_t r = 0; r < config.repetitions; r++) {
             double latency_min = std::numeric_limits<double>::infinity();
@@ -256,7 +261,7 @@ public:
             uint64_t nfc_full_triggered_sum = 0;
             uint64_t nfc_max_latency = 0;
             uint64_t fifo_tx_stalls_sum = 0;
-            if (!emulation) {
+            if (has_counters) {
                 for (uint32_t i = 0; i < config.num_instances; i++) {
                     double latency = transmission_times[i][r] / config.iterations_per_message[r];
                     latency_sum += latency;
@@ -283,7 +288,7 @@ public:
                       << std::setw(12) << config.iterations_per_message[r]
                       << std::setw(12) << config.frame_sizes[r]
                       << std::setw(12) << config.message_sizes[r];
-            if (!emulation) {
+            if (has_counters) {
                 std::cout << std::setw(12) << latency_min
                           << std::setw(12) << latency_avg
                           << std::setw(12) << latency_max
@@ -307,7 +312,7 @@ public:
                   << std::setw(12) << "Repetition"
                   << std::setw(12) << "Failed"
                   << std::setw(12) << "Bytes";
-        if (!emulation) {
+        if (has_counters) {
             std::cout << std::setw(12) << "Frames"
                       << std::setw(12) << "FIFO RX"
                       << std::setw(12) << "NFC"
@@ -325,7 +330,7 @@ public:
                       << std::setw(12) << "Soft err"
                       << std::setw(12) << "Channel";
         }
-        std::cout << std::endl << std::setw(emulation ? 36 : 240) << std::setfill('-') << "-"
+        std::cout << std::endl << std::setw(has_counters ? 240 : 36) << std::setfill('-') << "-"
                   << std::endl << std::setfill(' ');
 
         for (uint32_t r = 0; r < config.repetitions; r++) {
@@ -353,7 +358,7 @@ public:
                     failed_transmissions_sum++;
                 }
                 byte_errors_sum += errors[i][r];
-                if (!emulation) {
+                if (has_counters) {
                     frame_errors_sum += frames_with_errors[i][r];
                     fifo_rx_errors_sum += fifo_rx_overflow_count[i][r];
                     nfc_full_trigger_sum += nfc_full_trigger_count[i][r];
@@ -376,7 +381,7 @@ public:
             std::cout << std::setw(12) << r
                       << std::setw(12) << failed_transmissions_sum
                       << std::setw(12) << byte_errors_sum;
-            if (!emulation) {
+            if (has_counters) {
                 std::cout << std::setw(12) << frame_errors_sum
                           << std::setw(12) << fifo_rx_errors_sum
                           << std::setw(12) << nfc_full_trigger_sum - nfc_empty_trigger_sum